@@ -10,19 +10,19 @@ std::string NumberExprAST::print() {
   } else if (isInt) {
     s << ival;
   } else {
-    s << sval;
+    s << sval.str();
   }
   return s.str();
 }
 
 
 std::string VariableExprAST::print() {
-  return name;
+  return name.str();
 }
 
 std::string VariableDeclAST::print() {
   std::ostringstream s;
-  s << "var " <<  name;
+  s << "var " <<  name.str();
   if (val != nullptr) {
     s << " = " << val->print();
   }
@@ -30,8 +30,21 @@ std::string VariableDeclAST::print() {
   return s.str();
 }
 
+std::string BinOpString(int op) {
+  switch (op) {
+  case tok_and:
+    return "&&";
+  case tok_or:
+    return "||";
+  case tok_eq:
+    return "==";
+  default:
+    return string(1, char(op));
+  }
+}
+
 std::string BinaryExprAST::print() {
-  return "(" + lhs->print() + op + rhs->print() + ")";
+  return "(" + lhs->print() + BinOpString(op) + rhs->print() + ")";
 }
 
 std::string UnaryExprAST::print() {
@@ -39,7 +52,7 @@ std::string UnaryExprAST::print() {
 }
 
 std::string CallExprAST::print() {
-  return callee + "(...)";
+  return callee.str() + "(...)";
 }
 
 std::string IfStmtAST::print() {
@@ -51,8 +64,14 @@ std::string IfStmtAST::print() {
 
 std::string ForStmtAST::print() {
   std::ostringstream s;
-  s << "for " << varName  << " = (" << start->print() << "), " 
-    << varName << " < (" << end->print() << "), (" << step->print() << ") "
+  s << "for " << varName.str();
+  if (varType == type_byte) {
+    s << " byte";
+  } else if (varType == type_int64) {
+    s << " int64";
+  }
+  s << " = (" << start->print() << "), " 
+    << varName.str() << " < (" << end->print() << "), (" << step->print() << ") "
     << body->print();
   return s.str();
 }
@@ -60,7 +79,7 @@ std::string ForStmtAST::print() {
 std::string BlockStmtAST::print() {
   std::ostringstream s;
   s << "{\n";
-  for (const std::unique_ptr<StatementAST>& e : body) {
+  for (StatementAST* e : body) {
     s << e->print() << "\n";
   }
   s << "}\n";
@@ -1,11 +1,14 @@
 #ifndef AST_H
 #define AST_H
 
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <utility>
 #include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
 
@@ -13,20 +16,44 @@
 
 using std::string;
 using std::vector;
-using std::unique_ptr;
-using std::move;
+using llvm::ArrayRef;
+using llvm::StringRef;
+
+// The nodes are allocated in an ASTArena (see ast_arena.h), which owns them;
+// the pointers between them are not owning.
 
 struct CodegenRes {
   bool success, ret;
   CodegenRes(bool success, bool ret) : success(success), ret(ret) {};
 };
 
+class CompilerSession;
+class Interpreter;
+struct RtValue;
+struct ExecRes;
+
 class StatementAST {
 public:
   virtual ~StatementAST() {}
   // Returns true on success, false on error.
-  virtual CodegenRes codegen() = 0;  
+  virtual CodegenRes codegen(CompilerSession& s) = 0;  
+  // exec runs the statement in the interpreter (see interp.h).
+  virtual ExecRes exec(Interpreter& interp) = 0;
   virtual string print() = 0;
+
+  // isReturnTree returns true if the statement is a return of a pure
+  // expression, or an if with a pure condition whose branches are both return
+  // trees (possibly in blocks of their own): the shape of a predicate that
+  // can be evaluated in full, whatever the path it would have taken. In
+  // branchless mode, codegen picks the returned value with selects instead of
+  // branching (see IfStmtAST::canSelect and codegenReturnValue).
+  virtual bool isReturnTree() const { return false; }
+  // codegenReturnValue emits the computation of the value a return tree
+  // returns, evaluating all of its conditions and values, converted to the
+  // function's return type. Returns nullptr on error.
+  virtual llvm::Value* codegenReturnValue(CompilerSession&) {
+    return nullptr;
+  }
 };
 
 /// ExprAST - Base class for all expression nodes.
@@ -34,8 +61,28 @@ class ExprAST : public StatementAST{
 public:
   virtual ~ExprAST() {}
   // codegenExpr is like codegen, except it return a value.
-  virtual llvm::Value* codegenExpr() = 0;  
-  virtual CodegenRes codegen() override;
+  virtual llvm::Value* codegenExpr(CompilerSession& s) = 0;  
+  virtual CodegenRes codegen(CompilerSession& s) override;
+  // eval is like exec, except it returns a value. Returns false on error.
+  virtual bool eval(Interpreter& interp, RtValue* res) = 0;
+  virtual ExecRes exec(Interpreter& interp) override;
+  // codegenCond emits the test of the expression as a condition, i.e. whether
+  // it's non-zero, as an i1. Returns nullptr on error.
+  llvm::Value* codegenCond(CompilerSession& s);
+  // codegenBranch emits the test of the expression as a condition, branching
+  // to trueBB or falseBB. && and || branch straight to their destinations
+  // from each of their operands. Returns false on error.
+  virtual bool codegenBranch(CompilerSession& s, llvm::BasicBlock* trueBB,
+                             llvm::BasicBlock* falseBB);
+  // isPure returns true if evaluating the expression has no effects and
+  // can't fail: no calls, assignments or dereferences. It can then be
+  // evaluated before or after the code around it.
+  virtual bool isPure() const { return false; }
+
+  // The profile site of the expression's test, if it's the condition of an
+  // if or a loop, or an operand of && or || (see ProfileSiteKind). -1 if
+  // it's none of those.
+  int condSite = -1;
 };
 
 
@@ -60,7 +107,8 @@ public:
     n.ival = val;
     return n;
   }
-  static NumberExprAST FromStr(const std::string& str) {
+  // str needs to be NUL terminated, like the arena's strings.
+  static NumberExprAST FromStr(StringRef str) {
     NumberExprAST n;
     n.isStr = true;
     n.isFP = false;
@@ -68,151 +116,216 @@ public:
     n.sval = str;
     return n;
   }
-  virtual llvm::Value* codegenExpr();
+  virtual llvm::Value* codegenExpr(CompilerSession& s);
+  virtual bool eval(Interpreter& interp, RtValue* res);
   virtual string print();
+  bool isPure() const override { return true; }
 
   bool isFP;
   bool isStr;
   bool isInt;
+  // Integer literals are bytes if they fit in one, and int64 otherwise.
+  bool isByte() const { return ival >= -128 && ival <= 127; }
 
 private:
   double dval;
-  int ival;
-  std::string sval;
+  int64_t ival;
+  StringRef sval;
 };
 
 // Variable references.
 class VariableExprAST : public ExprAST {
 private:
-  std::string name;
+  StringRef name;
 
 public:
-  VariableExprAST(const std::string& name) : name(name){}
-  llvm::Value* codegenExpr() override;
+  VariableExprAST(StringRef name) : name(name){}
+  llvm::Value* codegenExpr(CompilerSession& s) override;
+  bool eval(Interpreter& interp, RtValue* res) override;
   string print() override;
-  string getName() const { return name; }
+  bool isPure() const override { return true; }
+  StringRef getName() const { return name; }
 };
 
 // Variable declarations.
 class VariableDeclAST : public StatementAST {
 private:
-  std::string name;
+  StringRef name;
   VarType type;
   // Initial value. Null if the variable is to be zero-initialized.
-  std::unique_ptr<ExprAST> val;
+  ExprAST* val;
 
 public:
-  VariableDeclAST(const std::string& name, VarType type, std::unique_ptr<ExprAST> val) : 
-    name(name), type(type), val(std::move(val)) {}
+  VariableDeclAST(StringRef name, VarType type, ExprAST* val) :
+    name(name), type(type), val(val) {}
 
-  CodegenRes codegen() override;
+  CodegenRes codegen(CompilerSession& s) override;
+  ExecRes exec(Interpreter& interp) override;
   string print() override;
 };
 
 class UnaryExprAST : public ExprAST {
 private:
   char op;
-  std::unique_ptr<ExprAST> operand;
+  ExprAST* operand;
 
 public:
-  UnaryExprAST(
-      char op, 
-      std::unique_ptr<ExprAST> operand) : 
-    op(op), operand(std::move(operand)) {}
-  llvm::Value* codegenExpr() override;
+  UnaryExprAST(char op, ExprAST* operand) : op(op), operand(operand) {}
+  llvm::Value* codegenExpr(CompilerSession& s) override;
+  bool eval(Interpreter& interp, RtValue* res) override;
   string print() override;
+  // Taking a variable's address is pure; dereferencing isn't.
+  bool isPure() const override { return op == '&'; }
 };
 
+// BinOpString returns the text of the binary operator op, a token.
+string BinOpString(int op);
+
 class BinaryExprAST : public ExprAST {
 private:
-  char op;
-  std::unique_ptr<ExprAST> lhs, rhs;
+  // The operator's token: the character, or tok_and, tok_or or tok_eq.
+  int op;
+  ExprAST* lhs;
+  ExprAST* rhs;
+
+  // codegenLogical emits && and || as values.
+  llvm::Value* codegenLogical(CompilerSession& s);
+  // isBranchless returns true if the && or || is to evaluate both of its
+  // operands and combine them: in branchless mode, or if the profile has one
+  // of them unpredictable, if it can (see canEvaluateBoth).
+  bool isBranchless(CompilerSession& s) const;
+  // testRhsFirst returns true if a branching && or || is to test its rhs
+  // first: with a profile, && tests first the operand that's the most often
+  // false, and || the one that's the most often true, as long as both are
+  // pure. The other one is then evaluated less often.
+  bool testRhsFirst(CompilerSession& s) const;
 
 public:
-  BinaryExprAST(
-      char op, 
-      std::unique_ptr<ExprAST> lhs, 
-      std::unique_ptr<ExprAST> rhs) : 
-    op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
-  llvm::Value* codegenExpr() override;
+  BinaryExprAST(int op, ExprAST* lhs, ExprAST* rhs) :
+    op(op), lhs(lhs), rhs(rhs) {}
+  llvm::Value* codegenExpr(CompilerSession& s) override;
+  bool codegenBranch(CompilerSession& s, llvm::BasicBlock* trueBB,
+                     llvm::BasicBlock* falseBB) override;
+  bool eval(Interpreter& interp, RtValue* res) override;
   string print() override;
+  bool isPure() const override {
+    return op != '=' && lhs->isPure() && rhs->isPure();
+  }
+  // canEvaluateBoth returns true if the operator is && or || and its rhs is
+  // pure: evaluating it when the lhs already decides the result can't fault
+  // or change what the program does, as short-circuiting would have had it.
+  bool canEvaluateBoth() const {
+    return (op == tok_and || op == tok_or) && rhs->isPure();
+  }
 };
 
 // Function calls.
 class CallExprAST : public ExprAST {
 private:
-  std::string callee;
-  std::vector<std::unique_ptr<ExprAST> > args;
+  StringRef callee;
+  ArrayRef<ExprAST*> args;
 
 public:
-  CallExprAST(
-      std::string callee, 
-      std::vector<std::unique_ptr<ExprAST> > args) :
-    callee(callee), args(std::move(args)) {}
-  llvm::Value* codegenExpr() override;
+  CallExprAST(StringRef callee, ArrayRef<ExprAST*> args) :
+    callee(callee), args(args) {}
+  llvm::Value* codegenExpr(CompilerSession& s) override;
+  bool eval(Interpreter& interp, RtValue* res) override;
   string print() override;
+
+  // The call's profile site (see ProfileSiteKind).
+  int callSite = -1;
 };
 
 // IfStmtAST - if/then/else.
 class IfStmtAST : public StatementAST {
 private:
-  std::unique_ptr<ExprAST> condExpr;
-  std::unique_ptr<StatementAST> thenStmt, elseStmt;
+  ExprAST* condExpr;
+  StatementAST* thenStmt;
+  StatementAST* elseStmt;
 
 public:
   IfStmtAST(
-      std::unique_ptr<ExprAST> condExpr,
-      std::unique_ptr<StatementAST> thenStmt,
-      std::unique_ptr<StatementAST> elseStmt) : 
-    condExpr(std::move(condExpr)), thenStmt(std::move(thenStmt)), elseStmt(std::move(elseStmt)) {};
+      ExprAST* condExpr, StatementAST* thenStmt, StatementAST* elseStmt) :
+    condExpr(condExpr), thenStmt(thenStmt), elseStmt(elseStmt) {};
 
-  CodegenRes codegen() override;
+  CodegenRes codegen(CompilerSession& s) override;
+  ExecRes exec(Interpreter& interp) override;
   string print() override;
+  bool isReturnTree() const override {
+    return condExpr->isPure() && canSelect();
+  }
+  llvm::Value* codegenReturnValue(CompilerSession& s) override;
+  // canSelect returns true if the if only returns, and both of its branches
+  // can be evaluated whatever the condition: it can then select the value it
+  // returns. Its own condition is evaluated either way.
+  bool canSelect() const {
+    return thenStmt->isReturnTree() && elseStmt->isReturnTree();
+  }
 };
 
 // ForExprAST - for loop.
+//
+// A double loop variable keeps the Kaleidoscope semantics: the body runs
+// before the end condition is first tested. An integer one (byte or int64)
+// makes a while loop: the end condition is tested before every iteration,
+// including the first, and the variable is stepped after the body. That's the
+// loop shape LLVM's induction variable and vectorization passes recognize.
 class ForStmtAST : public StatementAST {
-  std::string varName;
+  StringRef varName;
+  VarType varType;
   // As opposed to the LLVM Kaleidoskope tutorial, step will never be nil. It
-  // will be an expression yielding 1.0 if its missing from the source we're
-  // compiling.
-  std::unique_ptr<ExprAST> start, end, step;
-  std::unique_ptr<StatementAST> body;
+  // will be an expression yielding 1 (or 1.0) if its missing from the source
+  // we're compiling.
+  ExprAST* start;
+  ExprAST* end;
+  ExprAST* step;
+  StatementAST* body;
+
+  // codegenInt emits the loops with an integer variable.
+  CodegenRes codegenInt(CompilerSession& s);
+  ExecRes execInt(Interpreter& interp);
 
 public:
-  ForStmtAST(const std::string& varName,
-             std::unique_ptr<ExprAST> start,
-             std::unique_ptr<ExprAST> end, 
-             std::unique_ptr<ExprAST> step,
-             std::unique_ptr<StatementAST> body)
-    : varName(varName), start(std::move(start)), end(std::move(end)),
-      step(std::move(step)), body(std::move(body)) {}
-
-  CodegenRes codegen() override;
+  ForStmtAST(StringRef varName, VarType varType, ExprAST* start, ExprAST* end,
+             ExprAST* step, StatementAST* body)
+    : varName(varName), varType(varType),
+      start(start), end(end), step(step), body(body) {}
+
+  CodegenRes codegen(CompilerSession& s) override;
+  ExecRes exec(Interpreter& interp) override;
   string print() override;
 };
 
 // BlockStmtAST - a block (i.e. {...}).
 class BlockStmtAST : public StatementAST {
-  std::vector<std::unique_ptr<StatementAST>> body;
+  ArrayRef<StatementAST*> body;
 
 public:
-  BlockStmtAST(std::vector<std::unique_ptr<StatementAST>> body)
-    : body(std::move(body)) {}
+  BlockStmtAST(ArrayRef<StatementAST*> body) : body(body) {}
 
-  CodegenRes codegen() override;
+  CodegenRes codegen(CompilerSession& s) override;
+  ExecRes exec(Interpreter& interp) override;
   string print() override;
+  bool isReturnTree() const override {
+    return body.size() == 1 && body[0]->isReturnTree();
+  }
+  llvm::Value* codegenReturnValue(CompilerSession& s) override {
+    return body[0]->codegenReturnValue(s);
+  }
 };
 
 class ReturnStmtAST : public StatementAST {
 private:
-  unique_ptr<ExprAST> expr;
+  ExprAST* expr;
 
 public:
-  ReturnStmtAST(unique_ptr<ExprAST> expr) : expr(std::move(expr)) {}
+  ReturnStmtAST(ExprAST* expr) : expr(expr) {}
 
-  CodegenRes codegen() override;
+  CodegenRes codegen(CompilerSession& s) override;
+  ExecRes exec(Interpreter& interp) override;
   string print() override;
+  bool isReturnTree() const override { return expr->isPure(); }
+  llvm::Value* codegenReturnValue(CompilerSession& s) override;
 };
 
 // PrototypeAST - This class represents the "prototype" for a function, which
@@ -220,43 +333,127 @@ public:
 // arguments the function takes).
 class PrototypeAST {
 private:
-  string name;
+  StringRef name;
   VarType retType;
-  vector<string> argNames;
-  vector<VarType> argTypes;
+  ArrayRef<StringRef> argNames;
+  ArrayRef<VarType> argTypes;
 
 public:
   PrototypeAST(
-      string name, 
+      StringRef name,
       VarType retType,
-      vector<string> argNames, 
-      vector<VarType> argTypes) 
+      ArrayRef<StringRef> argNames,
+      ArrayRef<VarType> argTypes)
     : name(name),
       retType(retType),
-      argNames(std::move(argNames)), argTypes(std::move(argTypes)) {}
-  string getName() const { return name; }
+      argNames(argNames), argTypes(argTypes) {}
+  StringRef getName() const { return name; }
+  VarType getRetType() const { return retType; }
   VarType getArgType(int i) const {
     return argTypes[i];
   }
-  llvm::Function* codegen() const;
+  ArrayRef<StringRef> getArgNames() const { return argNames; }
+  llvm::Function* codegen(CompilerSession& s) const;
+};
+
+// ColumnType is the encoding of a column in a row's value.
+enum ColumnType {
+  col_int,      // zigzag varint
+  col_decimal,  // uvarint length + decimal
+  col_bytes,    // uvarint length + data
+};
+
+// SchemaAST is a schema declaration: the types of the columns of a table's
+// rows, in column id order. See schema.h for the functions it gets.
+class SchemaAST {
+private:
+  StringRef name;
+  ArrayRef<ColumnType> columns;
+
+public:
+  SchemaAST(StringRef name, ArrayRef<ColumnType> columns)
+    : name(name), columns(columns) {}
+  StringRef getName() const { return name; }
+  ArrayRef<ColumnType> getColumns() const { return columns; }
+};
+
+// StateMerge is how the partial values of a state variable, accumulated by
+// different threads over different rows, are combined.
+enum StateMerge {
+  merge_sum,  // starts at 0
+  merge_min,  // starts at INT64_MAX
+  merge_max,  // starts at INT64_MIN
+};
+
+// StateAST is a state declaration: a variable prog_main can read and assign,
+// which keeps its value from one row to the next (an accumulator). State
+// variables are int64s. They're passed to prog_main by the batch entry point
+// (see CompilerSession::CodegenBatchEntry), and their values at the end of a
+// scan are the merge of every thread's.
+class StateAST {
+private:
+  StringRef name;
+  VarType type;
+  StateMerge merge;
+
+public:
+  StateAST(StringRef name, VarType type, StateMerge merge)
+    : name(name), type(type), merge(merge) {}
+  StringRef getName() const { return name; }
+  VarType getType() const { return type; }
+  StateMerge getMerge() const { return merge; }
+};
+
+// OutputAST is an output declaration: a variable prog_main can assign, whose
+// value for every matching row is written to an output column, next to the
+// other outputs of the row (struct of arrays). Output variables are int64s
+// and start every row at 0. The columns are passed to the batch entry point
+// (see CompilerSession::CodegenBatchEntry), so that the rows are decoded once,
+// while filtering them.
+class OutputAST {
+private:
+  StringRef name;
+  VarType type;
+
+public:
+  OutputAST(StringRef name, VarType type) : name(name), type(type) {}
+  StringRef getName() const { return name; }
+  VarType getType() const { return type; }
+};
+
+// ParamAST is a parameter declaration: a placeholder for a value that's only
+// known when the program is run, like the literals of a query template.
+// Parameters are int64s or byte_ptrs, and prog_main sees them as variables
+// holding the values. A program can be compiled once for any values, which
+// the batch entry point takes (see CompilerSession::CodegenBatchEntry), or
+// specialized for some values, which it gets as constants.
+class ParamAST {
+private:
+  StringRef name;
+  VarType type;
+
+public:
+  ParamAST(StringRef name, VarType type) : name(name), type(type) {}
+  StringRef getName() const { return name; }
+  VarType getType() const { return type; }
 };
 
 /// FunctionAST - This class represents a function definition itself.
 class FunctionAST {
 private:
-  unique_ptr<PrototypeAST> proto;
-  unique_ptr<StatementAST> body;
+  PrototypeAST* proto;
+  StatementAST* body;
 
 public:
-  FunctionAST(
-      unique_ptr<PrototypeAST> proto, 
-      unique_ptr<StatementAST> body) : 
-    proto(move(proto)), 
-    body(move(body)) {};
-
-  // This codegen is not const because it destroys proto. It can only be called
-  // once.
-  llvm::Function* codegen();
+  FunctionAST(PrototypeAST* proto, StatementAST* body) :
+    proto(proto), body(body) {};
+
+  // codegen registers the prototype with the session, which refers to it
+  // for as long as the session (and the arena) are around.
+  llvm::Function* codegen(CompilerSession& s);
+
+  const PrototypeAST& getProto() const { return *proto; }
+  StatementAST& getBody() const { return *body; }
 };
 
 #endif
@@ -0,0 +1,67 @@
+#ifndef AST_ARENA_H
+#define AST_ARENA_H
+
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+// ASTArena holds the AST of a program: the nodes, the lists of children and
+// the identifiers and literals. Everything is bump allocated out of a few
+// slabs and freed at once when the arena goes away, once the program has been
+// compiled (or is no longer interpreted); parsing doesn't go through malloc
+// for every node.
+//
+// The nodes' destructors never run, so the nodes only point into the arena:
+// children are raw pointers, lists are ArrayRefs and names are StringRefs.
+class ASTArena {
+public:
+  ASTArena() = default;
+  ASTArena(const ASTArena&) = delete;
+  ASTArena& operator=(const ASTArena&) = delete;
+
+  // New constructs a T in the arena.
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    return new (alloc.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  // copy returns a copy of l in the arena.
+  template <typename T>
+  llvm::ArrayRef<T> copy(llvm::ArrayRef<T> l) {
+    if (l.empty()) {
+      return llvm::ArrayRef<T>();
+    }
+    T* res = alloc.Allocate<T>(l.size());
+    std::uninitialized_copy(l.begin(), l.end(), res);
+    return llvm::ArrayRef<T>(res, l.size());
+  }
+
+  // intern returns the arena's copy of s. All the copies of a string are the
+  // same one. The copy is NUL terminated, so data() can be used as a C
+  // string.
+  llvm::StringRef intern(llvm::StringRef s) {
+    auto it = strings.find(s);
+    if (it != strings.end()) {
+      return *it;
+    }
+    char* data = alloc.Allocate<char>(s.size() + 1);
+    if (!s.empty()) {
+      memcpy(data, s.data(), s.size());
+    }
+    data[s.size()] = '\0';
+    llvm::StringRef res(data, s.size());
+    strings.insert(res);
+    return res;
+  }
+
+private:
+  llvm::BumpPtrAllocator alloc;
+  llvm::DenseSet<llvm::StringRef> strings;
+};
+
+#endif
@@ -0,0 +1,464 @@
+// bench measures the compilation pipeline and the compiled filters, so that
+// regressions show up as numbers:
+//
+//   - the latency of lexing, parsing and compiling generated programs of a
+//     few sizes, as one module and as a module per definition, with the
+//     compilation broken down by phase (see CompileStats);
+//   - the throughput of a filter on l_quantity over generated TPC-H lineitem
+//     rows, at a few selectivities, through the row and the batch entry
+//     points (compiled with and without branches, and as a template taking
+//     the threshold as a parameter), against the same filter written by hand
+//     in C++ on top of the builtin.cc helpers.
+//
+// The rows are generated from a fixed seed, so the runs are comparable across
+// builds. It's linked like the main binary, minus main.cc.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ast_arena.h"
+#include "builtin.h"
+#include "compiler_main.h"
+#include "filter_cache.h"
+#include "global.h"
+#include "lexer.h"
+#include "parser.h"
+#include "stats.h"
+
+using std::string;
+
+namespace {
+
+// Every measurement runs for at least this long.
+uint64_t minNanos = 200 * 1000 * 1000;
+
+uint64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Measure runs fn over and over, doubling the number of runs until they take
+// minNanos, and returns the nanoseconds per run.
+template <typename Fn>
+double Measure(Fn fn) {
+  fn();  // Warm up.
+  for (uint64_t iters = 1;; iters *= 2) {
+    uint64_t start = nowNanos();
+    for (uint64_t i = 0; i < iters; i++) {
+      fn();
+    }
+    uint64_t elapsed = nowNanos() - start;
+    if (elapsed >= minNanos) {
+      return double(elapsed) / iters;
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Data generation
+//===----------------------------------------------------------------------===//
+
+void putUvarint(string* out, uint64_t u) {
+  while (u >= 0x80) {
+    out->push_back(char(u | 0x80));
+    u >>= 7;
+  }
+  out->push_back(char(u));
+}
+
+void putIntCol(string* out, int64_t v) {
+  out->push_back(0x13);
+  putUvarint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+// putDecimalCol appends the decimal column hundredths / 100.
+void putDecimalCol(string* out, uint64_t hundredths) {
+  string dec;
+  if (hundredths == 0) {
+    dec.push_back(0x27);  // Zero.
+  } else {
+    int digits = 0;
+    for (uint64_t c = hundredths; c != 0; c /= 10) {
+      digits++;
+    }
+    // hundredths / 100 = 0.<hundredths> * 10^(digits - 2).
+    if (digits >= 2) {
+      dec.push_back(0x34);  // Positive, large.
+      dec.push_back(char(0x88 + digits - 2));
+    } else {
+      dec.push_back(0x28);  // Positive, small.
+      dec.push_back(char(0x88 + 2 - digits));
+    }
+    string coeff;
+    for (uint64_t c = hundredths; c != 0; c >>= 8) {
+      coeff.insert(coeff.begin(), char(c & 0xff));
+    }
+    dec += coeff;
+  }
+  out->push_back(0x15);
+  putUvarint(out, dec.size());
+  *out += dec;
+}
+
+void putBytesCol(string* out, const string& s) {
+  out->push_back(0x16);
+  putUvarint(out, s.size());
+  *out += s;
+}
+
+// Rows holds generated rows back to back.
+struct Rows {
+  string data;
+  std::vector<const char*> keys;
+  std::vector<const char*> vals;
+};
+
+// GenerateLineitems generates n lineitem rows in the layout of the row in
+// main.cc: the columns of the TPC-H lineitem table in order, their values
+// drawn from the TPC-H distributions. l_quantity is uniform in [1, 50].
+void GenerateLineitems(size_t n, Rows* rows) {
+  static const char* const shipInstructs[] = {
+    "DELIVER IN PERSON", "COLLECT COD", "NONE", "TAKE BACK RETURN",
+  };
+  static const char* const shipModes[] = {
+    "REG AIR", "AIR", "RAIL", "SHIP", "TRUCK", "MAIL", "FOB",
+  };
+  static const char* const words[] = {
+    "furiously", "regular", "courts", "above", "the", "slyly", "ironic",
+    "packages", "deposits", "final", "pending", "requests", "blithely",
+  };
+  std::mt19937_64 rng(42);
+  auto uniform = [&rng](int64_t lo, int64_t hi) {
+    return std::uniform_int_distribution<int64_t>(lo, hi)(rng);
+  };
+
+  std::vector<size_t> offsets;
+  string& data = rows->data;
+  data.clear();
+  for (size_t i = 0; i < n; i++) {
+    offsets.push_back(data.size());
+    data.append(4, '\0');  // The checksum isn't checked.
+    data.push_back(0x0a);  // Tuple tag.
+    putIntCol(&data, int64_t(i / 4 + 1));               // l_orderkey
+    putIntCol(&data, uniform(1, 200000));               // l_partkey
+    putIntCol(&data, uniform(1, 10000));                // l_suppkey
+    putIntCol(&data, int64_t(i % 4 + 1));               // l_linenumber
+    int64_t quantity = uniform(1, 50);
+    putDecimalCol(&data, quantity * 100);               // l_quantity
+    int64_t extendedPrice = quantity * uniform(90000, 200000);
+    putDecimalCol(&data, extendedPrice);                // l_extendedprice
+    putDecimalCol(&data, uniform(0, 10));               // l_discount
+    putDecimalCol(&data, uniform(0, 8));                // l_tax
+    putBytesCol(&data, string(1, "RAN"[uniform(0, 2)]));  // l_returnflag
+    putBytesCol(&data, string(1, "OF"[uniform(0, 1)]));   // l_linestatus
+    int64_t shipDate = uniform(8000, 10500);
+    putIntCol(&data, shipDate);                         // l_shipdate
+    putIntCol(&data, shipDate + uniform(-60, 60));      // l_commitdate
+    putIntCol(&data, shipDate + uniform(1, 30));        // l_receiptdate
+    putBytesCol(&data, shipInstructs[uniform(0, 3)]);   // l_shipinstruct
+    putBytesCol(&data, shipModes[uniform(0, 6)]);       // l_shipmode
+    string comment;
+    for (int64_t w = uniform(2, 6); w > 0; w--) {
+      if (!comment.empty()) {
+        comment += ' ';
+      }
+      comment += words[uniform(0, 12)];
+    }
+    putBytesCol(&data, comment);                        // l_comment
+  }
+  rows->keys.assign(n, "");
+  rows->vals.clear();
+  for (size_t off : offsets) {
+    rows->vals.push_back(data.data() + off);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Compile latency
+//===----------------------------------------------------------------------===//
+
+// SizedProgram returns a program of numFunctions functions calling each other
+// in a chain, and a prog_main calling the last one.
+string SizedProgram(int numFunctions) {
+  string prog = "def int64 f0(int64 x) { return x + 1; }\n";
+  for (int i = 1; i < numFunctions; i++) {
+    string n = std::to_string(i);
+    prog += "def int64 f" + n + "(int64 x) {\n"
+            "  var y int64 = x * " + std::to_string(i + 1) + " + " + n + ";\n"
+            "  if (y < " + n + ") then {\n"
+            "    return y + 1;\n"
+            "  } else {\n"
+            "    return f" + std::to_string(i - 1) + "(y) - x;\n"
+            "  }\n"
+            "  return 0;\n"
+            "}\n";
+  }
+  prog += "def byte prog_main(byte_ptr k, byte_ptr v) {\n"
+          "  var x int64 = f" + std::to_string(numFunctions - 1) + "(1);\n"
+          "  if (x < 0) then { return 1; } else { return 0; }\n"
+          "  return 0;\n"
+          "}\n";
+  return prog;
+}
+
+void BenchCompile() {
+  for (int numFunctions : {1, 10, 100}) {
+    string prog = SizedProgram(numFunctions);
+
+    double lexNanos = Measure([&prog]() {
+      Lexer lexer(prog);
+      while (lexer.gettok() != tok_eof) {
+      }
+    });
+    double parseNanos = Measure([&prog]() {
+      Lexer lexer(prog);
+      ASTArena arena;
+      Parser parser(lexer, arena);
+      ParsedProgram parsed;
+      if (!parser.ParseProgram(&parsed)) {
+        fprintf(stderr, "generated program doesn't parse\n");
+        exit(1);
+      }
+    });
+
+    fprintf(stderr, "compile/%d functions (%lu bytes): lex %.0f ns, "
+        "lex+parse %.0f ns\n", numFunctions, (unsigned long)prog.size(),
+        lexNanos, parseNanos);
+    for (CompileMode mode : {compile_whole_program, compile_per_definition}) {
+      CompileStats total;
+      uint64_t numCompiles = 0;
+      double compileNanos = Measure([&prog, mode, &total, &numCompiles]() {
+        std::shared_ptr<const CompiledFilter> filter = CompileFilter(
+            *TheJIT, prog, pred_branching, nullptr /* paramValues */, mode);
+        if (filter == nullptr) {
+          fprintf(stderr, "generated program doesn't compile\n");
+          exit(1);
+        }
+        total.add(filter->stats);
+        numCompiles++;
+      });
+
+      fprintf(stderr, "  %s: compile %.0f ns, %.0f modules\n",
+          mode == compile_whole_program ? "whole program" : "per definition",
+          compileNanos, double(total.numModules) / numCompiles);
+      for (int p = 0; p < num_compile_phases; p++) {
+        fprintf(stderr, "    %s: %.0f ns\n",
+            CompilePhaseName(CompilePhase(p)),
+            double(total.phaseNanos[p]) / numCompiles);
+      }
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Filter throughput
+//===----------------------------------------------------------------------===//
+
+// quantityFilter returns the filter l_quantity < threshold, threshold being
+// an expression in hundredths, after decls.
+string quantityFilter(const string& decls, const string& threshold) {
+  return "extern byte_ptr skip_checksum(byte_ptr s);\n"
+         "extern byte_ptr skip_byte(byte_ptr s);\n"
+         "extern byte_ptr skip_cols(byte_ptr s, int64 k);\n"
+         "extern int64 decode_decimal(byte_ptr s, int64 scale);\n" + decls +
+         "def byte prog_main(byte_ptr k, byte_ptr v) {\n"
+         "  v = skip_checksum(v);\n"
+         "  v = skip_byte(v);\n"
+         "  v = skip_cols(v, 4);\n"
+         "  v = skip_byte(v);\n"
+         "  var quantity int64 = decode_decimal(v, 2);\n"
+         "  if (quantity < " + threshold + ") then {\n"
+         "    return 1;\n"
+         "  } else {\n"
+         "    return 0;\n"
+         "  }\n"
+         "  return 0;\n"
+         "}\n";
+}
+
+// QuantityProgram returns the filter l_quantity < threshold, threshold being
+// in hundredths.
+string QuantityProgram(int64_t threshold) {
+  return quantityFilter("", std::to_string(threshold));
+}
+
+// QuantityTemplate returns QuantityProgram with the threshold as a parameter.
+string QuantityTemplate() {
+  return quantityFilter("param threshold int64;\n", "threshold");
+}
+
+// The quantity filter written by hand.
+int64_t baselineThreshold;
+
+char BaselineRow(const char* k, const char* v) {
+  (void)k;
+  char* p = skip_checksum(const_cast<char*>(v));
+  p = skip_byte(p);
+  p = skip_cols(p, 4);
+  p = skip_byte(p);
+  return decode_decimal(p, 2) < baselineThreshold;
+}
+
+// BaselineBatch has the signature of a batch entry point; the filter has no
+// state, outputs or parameters.
+uint32_t BaselineBatch(
+    const char** keys, const char** vals, uint32_t n, uint8_t* outBitmap,
+    int64_t* state, int64_t** outCols, const int64_t* params) {
+  (void)state;
+  (void)outCols;
+  (void)params;
+  uint32_t matches = 0;
+  for (uint32_t i = 0; i < n; i += 8) {
+    uint8_t byte = 0;
+    for (uint32_t j = i; j < n && j < i + 8; j++) {
+      char res = BaselineRow(keys[j], vals[j]);
+      byte |= uint8_t(res != 0) << (j - i);
+      matches += res != 0;
+    }
+    outBitmap[i / 8] = byte;
+  }
+  return matches;
+}
+
+// RunRows runs rowFn over all the rows and returns the number of matches.
+uint64_t RunRows(CompiledFilter::RowFn rowFn, const Rows& rows) {
+  uint64_t matches = 0;
+  for (size_t i = 0; i < rows.vals.size(); i++) {
+    matches += rowFn(rows.keys[i], rows.vals[i]) != 0;
+  }
+  return matches;
+}
+
+// RunBatches runs batchFn over blocks of the rows and returns the number of
+// matches. params are the arguments of a filter taking parameters.
+uint64_t RunBatches(CompiledFilter::BatchFn batchFn, const Rows& rows,
+                    std::vector<uint8_t>* bitmap,
+                    const int64_t* params = nullptr) {
+  const uint32_t rowsPerBlock = 1024;
+  bitmap->resize((rowsPerBlock + 7) / 8);
+  uint64_t matches = 0;
+  for (size_t i = 0; i < rows.vals.size(); i += rowsPerBlock) {
+    uint32_t n = uint32_t(std::min<size_t>(rowsPerBlock, rows.vals.size() - i));
+    matches += batchFn(const_cast<const char**>(&rows.keys[i]),
+                       const_cast<const char**>(&rows.vals[i]), n,
+                       bitmap->data(), nullptr /* state */,
+                       nullptr /* outCols */, params);
+  }
+  return matches;
+}
+
+void report(const char* what, int64_t threshold, const Rows& rows,
+            uint64_t matches, double nanos) {
+  size_t n = rows.vals.size();
+  fprintf(stderr, "filter/%s quantity < %ld: %.2f ns/row, %.1f Mrows/s, "
+      "selectivity %.1f%%\n", what, long(threshold / 100), nanos / n,
+      n / nanos * 1000, 100.0 * matches / n);
+}
+
+void BenchFilters(size_t numRows) {
+  Rows rows;
+  GenerateLineitems(numRows, &rows);
+  fprintf(stderr, "generated %lu lineitem rows (%lu bytes)\n",
+      (unsigned long)numRows, (unsigned long)rows.data.size());
+
+  std::vector<uint8_t> bitmap;
+  // The template is compiled once, and run with every threshold.
+  std::shared_ptr<const CompiledFilter> generic =
+      CompileFilter(*TheJIT, QuantityTemplate());
+  if (generic == nullptr) {
+    fprintf(stderr, "quantity template doesn't compile\n");
+    exit(1);
+  }
+  // About 2%, 10%, 50% and 90% of the rows match.
+  for (int64_t threshold : {200, 600, 2600, 4600}) {
+    string prog = QuantityProgram(threshold);
+    std::shared_ptr<const CompiledFilter> filter = CompileFilter(*TheJIT, prog);
+    std::shared_ptr<const CompiledFilter> branchless =
+        CompileFilter(*TheJIT, prog, pred_branchless);
+    if (filter == nullptr || branchless == nullptr) {
+      fprintf(stderr, "quantity filter doesn't compile\n");
+      exit(1);
+    }
+    baselineThreshold = threshold;
+
+    uint64_t matches = 0;
+    double nanos = Measure([&]() { matches = RunRows(filter->rowFn, rows); });
+    report("row", threshold, rows, matches, nanos);
+    nanos = Measure([&]() {
+      matches = RunBatches(filter->batchFn, rows, &bitmap);
+    });
+    report("batch", threshold, rows, matches, nanos);
+    nanos = Measure([&]() {
+      matches = RunBatches(branchless->batchFn, rows, &bitmap);
+    });
+    report("batch branchless", threshold, rows, matches, nanos);
+    std::vector<int64_t> args = ParamArgs({ParamValue::Int64(threshold)});
+    uint64_t templateMatches = 0;
+    nanos = Measure([&]() {
+      templateMatches =
+          RunBatches(generic->batchFn, rows, &bitmap, args.data());
+    });
+    report("batch template", threshold, rows, templateMatches, nanos);
+
+    uint64_t baselineMatches = 0;
+    nanos = Measure([&]() { baselineMatches = RunRows(BaselineRow, rows); });
+    report("c++ row", threshold, rows, baselineMatches, nanos);
+    nanos = Measure([&]() {
+      baselineMatches = RunBatches(BaselineBatch, rows, &bitmap);
+    });
+    report("c++ batch", threshold, rows, baselineMatches, nanos);
+    if (baselineMatches != matches || templateMatches != matches) {
+      fprintf(stderr, "filter matched %lu rows, template %lu, "
+          "c++ baseline %lu\n", (unsigned long)matches,
+          (unsigned long)templateMatches, (unsigned long)baselineMatches);
+      exit(1);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // -O<n> is the optimization level of the compiled programs, like in main.
+  unsigned optLevel = 2;
+  // -num-rows=<n> is the number of rows the filters run over.
+  size_t numRows = 1 << 20;
+  const string numRowsFlag = "-num-rows=";
+  // -min-time-ms=<n> is how long every measurement runs for, at least.
+  const string minTimeFlag = "-min-time-ms=";
+  // -filter and -compile only run those benchmarks.
+  bool runCompile = true;
+  bool runFilters = true;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+        arg[2] >= '0' && arg[2] <= '3') {
+      optLevel = arg[2] - '0';
+    } else if (arg.compare(0, numRowsFlag.size(), numRowsFlag) == 0) {
+      numRows = std::stoul(arg.substr(numRowsFlag.size()));
+    } else if (arg.compare(0, minTimeFlag.size(), minTimeFlag) == 0) {
+      minNanos = std::stoull(arg.substr(minTimeFlag.size())) * 1000 * 1000;
+    } else if (arg == "-compile") {
+      runFilters = false;
+    } else if (arg == "-filter") {
+      runCompile = false;
+    } else {
+      fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  InitLLVM(optLevel);
+
+  if (runCompile) {
+    BenchCompile();
+  }
+  if (runFilters) {
+    BenchFilters(numRows);
+  }
+  return 0;
+}
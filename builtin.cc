@@ -1,6 +1,14 @@
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 
+#include "builtin.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #ifdef LLVM_ON_WIN32
 #define DLLEXPORT __declspec(dllexport)
 #else
@@ -36,6 +44,85 @@ extern "C" char* skip_int(char *s) {
   return ++s;
 }
 
+// skip_cols skips the column tags and the varints alike: both end at the
+// first byte without the continuation bit, so skipping k int columns is
+// skipping past 2k such bytes. The vector versions look at a block of bytes
+// at a time, as long as the block doesn't cross into the next page (which
+// might not be mapped; the row's own bytes are all before its end).
+
+static const uintptr_t pageSize = 4096;
+
+// nthSetBit returns the index of the nth (1-based) set bit of bits.
+static int nthSetBit(uint64_t bits, uint64_t n) {
+  for (; n > 1; n--) {
+    bits &= bits - 1;
+  }
+  return __builtin_ctzll(bits);
+}
+
+static char* skipColsScalar(char* s, uint64_t ends) {
+  for (; ends > 0; s++) {
+    if (!(*s & 128)) {
+      ends--;
+    }
+  }
+  return s;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static char* skipColsSSE2(char* s, uint64_t ends) {
+  while (ends > 0 && (uintptr_t(s) & (pageSize - 1)) <= pageSize - 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    // The bytes without the continuation bit.
+    uint64_t bits = uint16_t(~_mm_movemask_epi8(block));
+    uint64_t n = __builtin_popcountll(bits);
+    if (n >= ends) {
+      return s + nthSetBit(bits, ends) + 1;
+    }
+    ends -= n;
+    s += 16;
+  }
+  return skipColsScalar(s, ends);
+}
+
+__attribute__((target("avx2")))
+static char* skipColsAVX2(char* s, uint64_t ends) {
+  while (ends > 0 && (uintptr_t(s) & (pageSize - 1)) <= pageSize - 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+    uint64_t bits = uint32_t(~_mm256_movemask_epi8(block));
+    uint64_t n = __builtin_popcountll(bits);
+    if (n >= ends) {
+      return s + nthSetBit(bits, ends) + 1;
+    }
+    ends -= n;
+    s += 32;
+  }
+  return skipColsScalar(s, ends);
+}
+#endif
+
+// The version for the host CPU.
+static char* (*const skipColsImpl)(char*, uint64_t) = []() {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return skipColsAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return skipColsSSE2;
+  }
+#endif
+  return skipColsScalar;
+}();
+
+extern "C" DLLEXPORT char* skip_cols(char* s, int64_t k) {
+  if (k <= 0) {
+    return s;
+  }
+  return skipColsImpl(s, 2 * uint64_t(k));
+}
+
 extern "C" DLLEXPORT char my_strcmp(const char *str1, char l1, const char *str2, char l2) {
   // return char(strcmp(str1, str2)); 
   char l = l1;
@@ -48,6 +135,13 @@ extern "C" DLLEXPORT char my_strcmp(const char *str1, char l1, const char *str2,
       return 1;
     }
   }
+  // A prefix sorts first.
+  if (l1 < l2) {
+    return -1;
+  }
+  if (l1 > l2) {
+    return 1;
+  }
   return 0;
 }
 
@@ -57,3 +151,170 @@ extern "C" DLLEXPORT char streq(const char *str1, char l1, const char *str2, cha
   }
   return 0;
 }
+
+extern "C" DLLEXPORT char bytes_eq(
+    const char* s1, int64_t l1, const char* s2, int64_t l2) {
+  return l1 == l2 && memcmp(s1, s2, l1) == 0;
+}
+
+extern "C" DLLEXPORT char bytes_cmp(
+    const char* s1, int64_t l1, const char* s2, int64_t l2) {
+  int res = memcmp(s1, s2, l1 < l2 ? l1 : l2);
+  if (res != 0) {
+    return res < 0 ? -1 : 1;
+  }
+  if (l1 != l2) {
+    return l1 < l2 ? -1 : 1;
+  }
+  return 0;
+}
+
+extern "C" DLLEXPORT char bytes_prefix(
+    const char* s, int64_t l, const char* prefix, int64_t prefixLen) {
+  return l >= prefixLen && memcmp(s, prefix, prefixLen) == 0;
+}
+
+extern "C" DLLEXPORT char bytes_contains(
+    const char* s, int64_t l, const char* needle, int64_t needleLen) {
+  if (needleLen == 0) {
+    return 1;
+  }
+  if (l < needleLen) {
+    return 0;
+  }
+  // memchr finds the candidates for the first byte, a vector at a time.
+  const char* end = s + l - needleLen + 1;
+  for (const char* p = s; p < end; p++) {
+    p = static_cast<const char*>(memchr(p, needle[0], end - p));
+    if (p == nullptr) {
+      return 0;
+    }
+    if (memcmp(p + 1, needle + 1, needleLen - 1) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The decoders below read the value encoding of a row's columns. An int
+// column is a zigzag varint. Decimal and bytes columns are a uvarint length
+// followed by that many bytes.
+
+// readUvarint decodes the little endian base 128 varint at s and advances s
+// past it.
+static uint64_t readUvarint(const char*& s) {
+  uint64_t res = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = uint8_t(*s++);
+    res |= uint64_t(b & 127) << shift;
+    if (!(b & 128)) {
+      return res;
+    }
+  }
+}
+
+extern "C" DLLEXPORT int64_t decode_int(const char* s) {
+  uint64_t u = readUvarint(s);
+  // Undo the zigzag encoding: 0, -1, 1, -2, ... are encoded as 0, 1, 2, 3, ...
+  return int64_t(u >> 1) ^ -int64_t(u & 1);
+}
+
+extern "C" DLLEXPORT int64_t decode_bytes_len(const char* s) {
+  return int64_t(readUvarint(s));
+}
+
+extern "C" DLLEXPORT char* decode_bytes_data(char* s) {
+  const char* data = s;
+  readUvarint(data);
+  return const_cast<char*>(data);
+}
+
+extern "C" DLLEXPORT char* skip_len_prefixed(char* s) {
+  const char* data = s;
+  uint64_t len = readUvarint(data);
+  return const_cast<char*>(data) + len;
+}
+
+// The markers starting an encoded decimal. The ones in between are for NaN and
+// the infinities.
+enum DecimalMarker : uint8_t {
+  decimalNegLarge = 0x1a,
+  decimalNegMedium = 0x25,
+  decimalNegSmall = 0x26,
+  decimalZero = 0x27,
+  decimalPosSmall = 0x28,
+  decimalPosMedium = 0x29,
+  decimalPosLarge = 0x34,
+};
+
+// readUvarintAscending decodes the order preserving uvarint at s (the
+// encoding of a decimal's exponent) and advances s past it. Values up to 109
+// take a single byte, 0x88 + v; larger ones are 0xf5 + n followed by n big
+// endian bytes.
+static uint64_t readUvarintAscending(const char*& s) {
+  uint8_t first = uint8_t(*s++);
+  if (first < 0xf6) {
+    return first - 0x88;
+  }
+  uint64_t res = 0;
+  for (int n = first - 0xf5; n > 0; n--) {
+    res = (res << 8) | uint8_t(*s++);
+  }
+  return res;
+}
+
+extern "C" DLLEXPORT int64_t decode_decimal(const char* s, int64_t scale) {
+  uint64_t len = readUvarint(s);
+  if (len == 0) {
+    return 0;
+  }
+  const char* end = s + len;
+  uint8_t marker = uint8_t(*s++);
+  bool neg = false;
+  // The decimal is 0.<coefficient> * 10^e.
+  int64_t e = 0;
+  switch (marker) {
+  case decimalZero:
+    return 0;
+  case decimalNegLarge:
+    neg = true;
+    e = int64_t(readUvarintAscending(s));
+    break;
+  case decimalNegMedium:
+    neg = true;
+    break;
+  case decimalNegSmall:
+    neg = true;
+    e = -int64_t(readUvarintAscending(s));
+    break;
+  case decimalPosSmall:
+    e = -int64_t(readUvarintAscending(s));
+    break;
+  case decimalPosMedium:
+    break;
+  case decimalPosLarge:
+    e = int64_t(readUvarintAscending(s));
+    break;
+  default:
+    // NaN and infinities.
+    return 0;
+  }
+  // The rest is the big endian coefficient.
+  uint64_t coeff = 0;
+  while (s < end) {
+    coeff = (coeff << 8) | uint8_t(*s++);
+  }
+  int64_t digits = 0;
+  for (uint64_t c = coeff; c != 0; c /= 10) {
+    digits++;
+  }
+  // value * 10^scale = coeff * 10^(e - digits + scale)
+  int64_t res = int64_t(coeff);
+  for (int64_t p = e - digits + scale; p > 0; p--) {
+    res *= 10;
+  }
+  for (int64_t p = e - digits + scale; p < 0 && res != 0; p++) {
+    res /= 10;
+  }
+  return neg ? -res : res;
+}
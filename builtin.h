@@ -0,0 +1,51 @@
+#ifndef BUILTIN_H
+#define BUILTIN_H
+
+#include <cstdint>
+
+// The host versions of the functions programs can declare as extern. The JIT
+// resolves calls that aren't bound to the IR runtime library (see runtime.h)
+// to these; the interpreter calls them directly.
+
+extern "C" double putchard(double x);
+extern "C" char* skip_checksum(char *s);
+extern "C" char* skip_bytes(char *s, char numBytes);
+extern "C" char* skip_byte(char *s);
+extern "C" char* skip_int(char *s);
+// skip_cols skips k int columns (each a tag and a varint) at s, looking at
+// 16 or 32 bytes at a time when the CPU can.
+extern "C" char* skip_cols(char* s, int64_t k);
+// my_strcmp and streq compare strings of up to 127 chars, as signed chars; a
+// prefix sorts first. The bytes_* functions below don't have the length limit.
+extern "C" char my_strcmp(const char *str1, char l1, const char *str2, char l2);
+extern "C" char streq(const char *str1, char l1, const char *str2, char l2);
+
+// Comparisons of byte strings, as unsigned bytes like memcmp.
+// bytes_eq returns 1 if the strings are equal.
+extern "C" char bytes_eq(
+    const char* s1, int64_t l1, const char* s2, int64_t l2);
+// bytes_cmp returns -1, 0 or 1; a prefix sorts first.
+extern "C" char bytes_cmp(
+    const char* s1, int64_t l1, const char* s2, int64_t l2);
+// bytes_prefix returns 1 if s starts with prefix (LIKE 'prefix%').
+extern "C" char bytes_prefix(
+    const char* s, int64_t l, const char* prefix, int64_t prefixLen);
+// bytes_contains returns 1 if needle occurs in s (LIKE '%needle%').
+extern "C" char bytes_contains(
+    const char* s, int64_t l, const char* needle, int64_t needleLen);
+
+// Typed decoders for the columns of a row.
+// decode_int returns the int column value at s.
+extern "C" int64_t decode_int(const char* s);
+// decode_decimal returns the decimal column value at s times 10^scale,
+// truncated; decode_decimal(s, 2) of 17.5 is 1750. The coefficient needs to
+// fit in 64 bits.
+extern "C" int64_t decode_decimal(const char* s, int64_t scale);
+// decode_bytes_len and decode_bytes_data return the length and the start of
+// the bytes column value at s.
+extern "C" int64_t decode_bytes_len(const char* s);
+extern "C" char* decode_bytes_data(char* s);
+// skip_len_prefixed skips the decimal or bytes column value at s.
+extern "C" char* skip_len_prefixed(char* s);
+
+#endif
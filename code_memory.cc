@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <utility>
+
+#include "llvm/Support/Process.h"
+
+#include "code_memory.h"
+
+using llvm::sys::Memory;
+using llvm::sys::MemoryBlock;
+
+CodeSlabMapper::CodeSlabMapper(size_t slabBytes)
+  : slabBytes(slabBytes), pageSize(llvm::sys::Process::getPageSize()) {}
+
+CodeSlabMapper::~CodeSlabMapper() {
+  for (Pool* pool : {&code, &data}) {
+    for (MemoryBlock& slab : pool->slabs) {
+      Memory::releaseMappedMemory(slab);
+    }
+  }
+}
+
+MemoryBlock CodeSlabMapper::allocateMappedMemory(
+    AllocationPurpose purpose, size_t numBytes,
+    const MemoryBlock* const /* nearBlock */, unsigned flags,
+    std::error_code& ec) {
+  // nearBlock is ignored: the slabs keep the blocks of a kind near each other
+  // anyway.
+  ec = std::error_code();
+  size_t size = (numBytes + pageSize - 1) / pageSize * pageSize;
+  std::lock_guard<std::mutex> lock(mu);
+  Pool& pool = poolFor(purpose);
+  // First fit: the ranges at the start of the slabs get reused first, which
+  // keeps the blocks in use packed together.
+  auto it = std::find_if(
+      pool.free.begin(), pool.free.end(),
+      [size](const std::pair<char* const, size_t>& r) {
+        return r.second >= size;
+      });
+  if (it == pool.free.end()) {
+    size_t bytes = std::max(size, slabBytes);
+    bytes = (bytes + pageSize - 1) / pageSize * pageSize;
+    MemoryBlock slab = Memory::allocateMappedMemory(
+        bytes, nullptr /* NearBlock */, Memory::MF_READ | Memory::MF_WRITE,
+        ec);
+    if (ec) {
+      return MemoryBlock();
+    }
+    pool.slabs.push_back(slab);
+    mapped += slab.size();
+    it = pool.free.emplace(static_cast<char*>(slab.base()), slab.size())
+             .first;
+  }
+  char* start = it->first;
+  size_t avail = it->second;
+  pool.free.erase(it);
+  if (avail > size) {
+    pool.free.emplace(start + size, avail - size);
+  }
+  used += size;
+  MemoryBlock block(start, size);
+  // Reused memory has the protection the module before left it with.
+  ec = Memory::protectMappedMemory(block, flags);
+  if (ec) {
+    used -= size;
+    freeLocked(pool, start, size);
+    return MemoryBlock();
+  }
+  return block;
+}
+
+std::error_code CodeSlabMapper::protectMappedMemory(
+    const MemoryBlock& block, unsigned flags) {
+  return Memory::protectMappedMemory(block, flags);
+}
+
+std::error_code CodeSlabMapper::releaseMappedMemory(MemoryBlock& m) {
+  if (m.base() == nullptr) {
+    return std::error_code();
+  }
+  std::lock_guard<std::mutex> lock(mu);
+  Pool* pool = poolOf(m.base());
+  if (pool == nullptr) {
+    return std::make_error_code(std::errc::invalid_argument);
+  }
+  used -= m.size();
+  freeLocked(*pool, static_cast<char*>(m.base()), m.size());
+  m = MemoryBlock();
+  return std::error_code();
+}
+
+void CodeSlabMapper::freeLocked(Pool& pool, char* start, size_t size) {
+  // Merge the range with the free ranges around it.
+  auto next = pool.free.lower_bound(start);
+  if (next != pool.free.end() && start + size == next->first) {
+    size += next->second;
+    next = pool.free.erase(next);
+  }
+  if (next != pool.free.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == start) {
+      prev->second += size;
+      return;
+    }
+  }
+  pool.free.emplace(start, size);
+}
+
+CodeSlabMapper::Pool* CodeSlabMapper::poolOf(const void* p) {
+  const char* c = static_cast<const char*>(p);
+  for (Pool* pool : {&code, &data}) {
+    for (const MemoryBlock& slab : pool->slabs) {
+      const char* base = static_cast<const char*>(slab.base());
+      if (c >= base && c < base + slab.size()) {
+        return pool;
+      }
+    }
+  }
+  return nullptr;
+}
+
+uint64_t CodeSlabMapper::mappedBytes() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return mapped;
+}
+
+uint64_t CodeSlabMapper::usedBytes() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return used;
+}
+
+TrackingMemoryManager::~TrackingMemoryManager() {
+  totals->codeBytes -= numCodeBytes;
+  totals->dataBytes -= numDataBytes;
+}
+
+uint8_t* TrackingMemoryManager::allocateCodeSection(
+    uintptr_t size, unsigned alignment, unsigned sectionID,
+    llvm::StringRef sectionName) {
+  numCodeBytes += size;
+  totals->codeBytes += size;
+  return llvm::SectionMemoryManager::allocateCodeSection(
+      size, alignment, sectionID, sectionName);
+}
+
+uint8_t* TrackingMemoryManager::allocateDataSection(
+    uintptr_t size, unsigned alignment, unsigned sectionID,
+    llvm::StringRef sectionName, bool isReadOnly) {
+  numDataBytes += size;
+  totals->dataBytes += size;
+  return llvm::SectionMemoryManager::allocateDataSection(
+      size, alignment, sectionID, sectionName, isReadOnly);
+}
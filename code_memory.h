@@ -0,0 +1,115 @@
+#ifndef CODE_MEMORY_H
+#define CODE_MEMORY_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Memory.h"
+
+// CodeMemoryCounters add up the section memory of the modules linked into a
+// JIT, as accounted by their TrackingMemoryManagers.
+struct CodeMemoryCounters {
+  std::atomic<uint64_t> codeBytes{0};
+  std::atomic<uint64_t> dataBytes{0};
+};
+
+// CodeSlabMapper is a SectionMemoryManager::MemoryMapper carving the memory
+// of the JIT's modules out of a few large slabs, rather than mapping pages of
+// their own for every module. The code of all the filters ends up in the
+// same few regions, next to each other, instead of being spread around the
+// address space between their data; memory freed by removed modules is
+// reused by the next ones rather than going back to the kernel.
+//
+// Code and data come from different slabs. Blocks are still whole pages: the
+// memory managers make a module's code executable, and its data read only,
+// when the module is linked, so the pages of a module aren't shared with the
+// next module, which needs them writable to be loaded.
+//
+// The mapper is thread safe, and needs to outlive the memory managers using
+// it.
+class CodeSlabMapper : public llvm::SectionMemoryManager::MemoryMapper {
+public:
+  using AllocationPurpose = llvm::SectionMemoryManager::AllocationPurpose;
+
+  // Slabs are mapped slabBytes at a time; bigger blocks get a slab of their
+  // own.
+  explicit CodeSlabMapper(size_t slabBytes = 4 << 20);
+  // Unmaps the slabs.
+  ~CodeSlabMapper() override;
+  CodeSlabMapper(const CodeSlabMapper&) = delete;
+  CodeSlabMapper& operator=(const CodeSlabMapper&) = delete;
+
+  llvm::sys::MemoryBlock allocateMappedMemory(
+      AllocationPurpose purpose, size_t numBytes,
+      const llvm::sys::MemoryBlock* const nearBlock, unsigned flags,
+      std::error_code& ec) override;
+  std::error_code protectMappedMemory(
+      const llvm::sys::MemoryBlock& block, unsigned flags) override;
+  std::error_code releaseMappedMemory(llvm::sys::MemoryBlock& m) override;
+
+  // The bytes of the slabs, and the bytes of them handed out.
+  uint64_t mappedBytes() const;
+  uint64_t usedBytes() const;
+
+private:
+  // A pool of slabs for one kind of memory.
+  struct Pool {
+    std::vector<llvm::sys::MemoryBlock> slabs;
+    // The free ranges of the slabs, by start address, with no two adjacent
+    // ones.
+    std::map<char*, size_t> free;
+  };
+
+  Pool& poolFor(AllocationPurpose purpose) {
+    return purpose == AllocationPurpose::Code ? code : data;
+  }
+  // poolOf returns the pool whose slabs hold p. mu needs to be held.
+  Pool* poolOf(const void* p);
+  // freeLocked adds the size bytes at start to pool's free ranges. mu needs
+  // to be held.
+  void freeLocked(Pool& pool, char* start, size_t size);
+
+  const size_t slabBytes;
+  const size_t pageSize;
+  mutable std::mutex mu;
+  Pool code;
+  Pool data;
+  uint64_t mapped = 0;
+  uint64_t used = 0;
+};
+
+// TrackingMemoryManager is a SectionMemoryManager that accounts for the
+// sections it allocates: the ones of one module, as RuntimeDyld gets a
+// memory manager per object. What it allocates is added to the module's
+// counts and to totals, and taken off totals again once the module is gone
+// and the manager is destroyed.
+class TrackingMemoryManager : public llvm::SectionMemoryManager {
+public:
+  // mapper and totals need to outlive the manager.
+  TrackingMemoryManager(MemoryMapper* mapper, CodeMemoryCounters* totals)
+    : llvm::SectionMemoryManager(mapper), totals(totals) {}
+  ~TrackingMemoryManager() override;
+
+  uint8_t* allocateCodeSection(
+      uintptr_t size, unsigned alignment, unsigned sectionID,
+      llvm::StringRef sectionName) override;
+  uint8_t* allocateDataSection(
+      uintptr_t size, unsigned alignment, unsigned sectionID,
+      llvm::StringRef sectionName, bool isReadOnly) override;
+
+  uint64_t codeBytes() const { return numCodeBytes; }
+  uint64_t dataBytes() const { return numDataBytes; }
+
+private:
+  CodeMemoryCounters* const totals;
+  std::atomic<uint64_t> numCodeBytes{0};
+  std::atomic<uint64_t> numDataBytes{0};
+};
+
+#endif
@@ -1,5 +1,9 @@
 #include <cstdio>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
 #include <memory>
 
 #include "llvm/IR/LLVMContext.h"
@@ -8,12 +12,16 @@
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
 
 #include "ast.h"
+#include "diag.h"
 #include "parser.h"
-#include "kaleidoscpe_jit.h"
+#include "profile.h"
+#include "runtime.h"
+#include "session.h"
 
 using std::vector;
 using std::sprintf;
@@ -31,175 +39,238 @@ using llvm::Type;
 using llvm::PointerType;
 using llvm::BasicBlock;
 
-LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-std::unique_ptr<Module> TheModule;
-std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-
-struct Variable {
-  VarType type;
-  llvm::Type* llvmType;
-  llvm::AllocaInst* allocaInst;  // Space for the value.
-
-  Variable(VarType type, llvm::Type* llvmType, llvm::AllocaInst* allocaInst)
-    : type(type), llvmType(llvmType), allocaInst(allocaInst) {}
-};
-
-llvm::Type* getLLVMType(VarType type) {
+static llvm::Type* getLLVMType(LLVMContext& context, VarType type) {
   switch(type) {
   case type_double:
-    return Type::getDoubleTy(TheContext);
+    return Type::getDoubleTy(context);
   case type_byte:
-    return Type::getInt8Ty(TheContext);
+    return Type::getInt8Ty(context);
   case type_bool:
-    return Type::getInt1Ty(TheContext);
+    return Type::getInt1Ty(context);
   case type_byte_ptr:
-    return PointerType::get(Type::getInt8Ty(TheContext), 0 /* address_space */);
+    return PointerType::get(Type::getInt8Ty(context), 0 /* address_space */);
+  case type_int64:
+    return Type::getInt64Ty(context);
   }
 }
 
-llvm::Value* getZeroVal(VarType type) {
-  auto llvmType = getLLVMType(type);
+static llvm::Value* getZeroVal(LLVMContext& context, VarType type) {
+  auto llvmType = getLLVMType(context, type);
   assert(llvmType);
   switch(type) {
   case type_double:
     // TODO(andrei): can I use getNullValue() here?
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0));
+    return llvm::ConstantFP::get(context, llvm::APFloat(0.0));
   case type_byte:
   case type_bool:
   case type_byte_ptr:
+  case type_int64:
     return llvm::Constant::getNullValue(llvmType);
   }
 }
 
-// Variable name to space where the value is stored.
-static std::map<string, Variable> NamedValues;
+// convertTo implicitly converts v to type: bytes widen to int64 (sign
+// extended). Anything else has to have the right type already. Returns
+// nullptr on a type mismatch.
+static Value* convertTo(CompilerSession& s, Value* v, llvm::Type* type) {
+  if (v->getType() == type) {
+    return v;
+  }
+  if (v->getType()->isIntegerTy(8) && type->isIntegerTy(64)) {
+    return s.builder->CreateSExt(v, type, "widen");
+  }
+  return logErrorV("type mismatch");
+}
 
-// Gets a copy.
-unique_ptr<Variable> getVar(const string& name) {
-  auto it = NamedValues.find(name);
-  if (it == NamedValues.end()) {
+// instrumentedCounters returns the counters of site if the session
+// instruments the code, or nullptr.
+static std::atomic<uint64_t>* instrumentedCounters(
+    CompilerSession& s, int site) {
+  if (s.getProfileMode() != profile_instrument || site < 0 ||
+      unsigned(site) >= s.getProfile()->numSites()) {
     return nullptr;
   }
-  return make_unique<Variable>(it->second);
+  return s.getProfile()->counters(site);
+}
+
+// profiledCounts sets counts to the counts of site if the session generates
+// code with a profile. Returns false if it doesn't.
+static bool profiledCounts(CompilerSession& s, int site, SiteCounts* counts) {
+  if (s.getProfileMode() != profile_use || site < 0 ||
+      unsigned(site) >= s.getProfile()->numSites()) {
+    return false;
+  }
+  *counts = s.getProfile()->counts(site);
+  return true;
+}
+
+// emitCounterAdd emits the addition of inc, an i64, to counter: an atomic
+// load and an atomic store, rather than a locked add (see
+// profile_instrument).
+static void emitCounterAdd(
+    CompilerSession& s, std::atomic<uint64_t>* counter, Value* inc) {
+  llvm::Type* i64Ty = Type::getInt64Ty(*s.context);
+  Value* addr = s.builder->CreateIntToPtr(
+      llvm::ConstantInt::get(i64Ty, uint64_t(uintptr_t(counter))),
+      PointerType::get(i64Ty, 0 /* address_space */), "counter");
+  llvm::LoadInst* count = s.builder->CreateLoad(addr, "count");
+  count->setAtomic(llvm::AtomicOrdering::Monotonic);
+  count->setAlignment(8);
+  llvm::StoreInst* store = s.builder->CreateStore(
+      s.builder->CreateAdd(count, inc, "next_count"), addr);
+  store->setAtomic(llvm::AtomicOrdering::Monotonic);
+  store->setAlignment(8);
+}
+
+// branchWeights returns the weights of the true and false outcomes of a
+// condition with counts c, as !prof metadata. The counts are scaled down to
+// fit the 32 bit weights. Every outcome weighs at least 1: a sample not
+// having any doesn't make it impossible.
+static llvm::MDNode* branchWeights(CompilerSession& s, const SiteCounts& c) {
+  uint64_t t = c.taken;
+  // Lost increments can leave more true tests than tests.
+  uint64_t f = c.entries > c.taken ? c.entries - c.taken : 0;
+  uint64_t scale = std::max(t, f) / UINT32_MAX + 1;
+  return llvm::MDBuilder(*s.context).createBranchWeights(
+      uint32_t(t / scale) + 1, uint32_t(f / scale) + 1);
 }
 
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-// Map of function name to the (latest) prototype declared with that name.
-std::map<string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+// Conditions the profile has true for a fraction of their tests in this range
+// are unpredictable. Conditions tested fewer times than minProfiledTests by
+// the profiled rows don't count.
+static const double minUnpredictableRate = 0.2;
+static const double maxUnpredictableRate = 0.8;
+static const uint64_t minProfiledTests = 100;
+
+// isUnpredictable returns true if the session generates code with a profile
+// that has site unpredictable. Such conditions are tested without branching
+// when they can be, like in branchless mode.
+static bool isUnpredictable(CompilerSession& s, int site) {
+  SiteCounts c;
+  return profiledCounts(s, site, &c) && c.entries >= minProfiledTests &&
+      c.rate() >= minUnpredictableRate && c.rate() <= maxUnpredictableRate;
+}
 
-CodegenRes ExprAST::codegen() {
-  auto* val = codegenExpr();
+CodegenRes ExprAST::codegen(CompilerSession& s) {
+  auto* val = codegenExpr(s);
   return CodegenRes(val != nullptr, false);
 }
 
-// resolveFunction takes a function name and returns the corresponding Function
-// from the current module (if present) or generates the function from a
-// registered prototype if the function had previously been generated in
-// another module.
-Function* resolveFunction(const string& name) {
-  Function* f = TheModule->getFunction(name);
-  if (f) {
-    return f;
+Value* ExprAST::codegenCond(CompilerSession& s) {
+  Value* v = codegenExpr(s);
+  if (!v) return nullptr;
+  // Convert the value to a bool by comparing non-equal to 0.
+  Value* cond = s.builder->CreateICmpNE(
+      v, llvm::Constant::getNullValue(v->getType()), "cond");
+  if (std::atomic<uint64_t>* counters = instrumentedCounters(s, condSite)) {
+    emitCounterAdd(s, &counters[0], s.builder->getInt64(1));
+    emitCounterAdd(s, &counters[1], s.builder->CreateZExt(
+        cond, Type::getInt64Ty(*s.context), "taken"));
   }
-  auto it = FunctionProtos.find(name);
-  if (it != FunctionProtos.end()) {
-    return it->second->codegen();
+  return cond;
+}
+
+bool ExprAST::codegenBranch(
+    CompilerSession& s, BasicBlock* trueBB, BasicBlock* falseBB) {
+  Value* cond = codegenCond(s);
+  if (!cond) return false;
+  llvm::BranchInst* br = s.builder->CreateCondBr(cond, trueBB, falseBB);
+  SiteCounts counts;
+  if (profiledCounts(s, condSite, &counts) && counts.entries > 0) {
+    br->setMetadata(llvm::LLVMContext::MD_prof, branchWeights(s, counts));
   }
-  return nullptr;
+  return true;
 }
 
 // Create an alloca instruction in the entry block of the function. This is
 // used for mutable variables etc.
 static llvm::AllocaInst* createEntryBlockAlloca(
     Function* fun,
-    const std::string& varName,
+    llvm::StringRef varName,
     llvm::Type* type) {
   IRBuilder<> TmpB(
       &fun->getEntryBlock(), fun->getEntryBlock().begin());
-  return TmpB.CreateAlloca(type, 0, varName.c_str());
+  return TmpB.CreateAlloca(type, 0, varName);
 }
 
-Value* NumberExprAST::codegenExpr() {
+// createStringLiteral emits str as a private constant global of the current
+// module and returns a pointer to its first byte. The literal compares
+// recognize such globals (see SpecializeLiteralCompares).
+static llvm::Constant* createStringLiteral(
+    CompilerSession& s, llvm::StringRef str) {
+  llvm::Constant* constArr = llvm::ConstantDataArray::getString(
+      *s.context, str, true /* AddNull */);
+  llvm::ArrayType* arrayTy = llvm::ArrayType::get(
+      Type::getInt8Ty(*s.context), str.size() + 1);
+  llvm::GlobalVariable* gvarArrayStr = new llvm::GlobalVariable(
+    *s.module,
+    arrayTy,
+    /*isConstant=*/true,
+    /*Linkage=*/llvm::GlobalValue::PrivateLinkage,
+    /*Initializer=*/0, // has initializer, specified below
+    /*Name=*/".str");
+  gvarArrayStr->setAlignment(1);
+  gvarArrayStr->setInitializer(constArr);
+
+  std::vector<llvm::Constant*> idxs;
+  llvm::ConstantInt* idx0 = llvm::ConstantInt::get(
+      *s.context, llvm::APInt(32, 0));
+  idxs.push_back(idx0);
+  idxs.push_back(idx0);
+  return llvm::ConstantExpr::getGetElementPtr(arrayTy, gvarArrayStr, idxs);
+}
+
+Value* NumberExprAST::codegenExpr(CompilerSession& s) {
   if (isFP) {
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(dval));
-  } else if (isInt) {
-    return llvm::Constant::getIntegerValue(Type::getInt8Ty(TheContext), 
+    return llvm::ConstantFP::get(*s.context, llvm::APFloat(dval));
+  } else if (isInt && isByte()) {
+    return llvm::Constant::getIntegerValue(Type::getInt8Ty(*s.context), 
         llvm::APInt(8, ival, false /* signed */));
+  } else if (isInt) {
+    return llvm::ConstantInt::get(
+        Type::getInt64Ty(*s.context), ival, true /* isSigned */);
   } else {
-    llvm::Constant* constArr = llvm::ConstantDataArray::getString(
-        TheContext, sval, true /* AddNull */);
-    llvm::ArrayType* arrayTy = llvm::ArrayType::get(
-        Type::getInt8Ty(TheContext), sval.length() + 1);
-    llvm::GlobalVariable* gvarArrayStr = new llvm::GlobalVariable(
-      *TheModule,
-      arrayTy,
-      /*isConstant=*/true,
-      /*Linkage=*/llvm::GlobalValue::PrivateLinkage,
-      /*Initializer=*/0, // has initializer, specified below
-      /*Name=*/".str");
-      gvarArrayStr->setAlignment(1);
-    gvarArrayStr->setInitializer(constArr);
-      
-    
-     std::vector<llvm::Constant*> idxs;
-     llvm::ConstantInt* idx0 = llvm::ConstantInt::get(
-         TheContext, llvm::APInt(32, 0));
-     idxs.push_back(idx0);
-     idxs.push_back(idx0);
-     llvm::Constant* startPtr = llvm::ConstantExpr::getGetElementPtr(
-         arrayTy,
-         gvarArrayStr, idxs);
-     return startPtr;
-  }
-}
-
-Value* VariableExprAST::codegenExpr() {
-  unique_ptr<Variable> v = getVar(name);
+    return createStringLiteral(s, sval);
+  }
+}
+
+Value* VariableExprAST::codegenExpr(CompilerSession& s) {
+  unique_ptr<Variable> v = s.getVar(name);
   if (!v) {
     char msg[1000];
-    std::sprintf(msg, "unknown variable %s", name.c_str());
+    std::sprintf(msg, "unknown variable %s", name.data());
     return logErrorV(msg);
   }
   // Load the value from memory.
-  return Builder.CreateLoad(v->allocaInst, name.c_str());
+  return s.builder->CreateLoad(v->addr, name);
 }
 
-Value* UnaryExprAST::codegenExpr() {
+Value* UnaryExprAST::codegenExpr(CompilerSession& s) {
   VariableExprAST* varAST = nullptr;
   unique_ptr<Variable> var;
   switch (op) {
   case '&':
-    varAST = dynamic_cast<VariableExprAST*>(operand.get());
+    varAST = dynamic_cast<VariableExprAST*>(operand);
     if (!varAST) {
       return logErrorV("address of can only be applied to variables");
     }
-    var = getVar(varAST->getName());
+    var = s.getVar(varAST->getName());
     if (!var) {
       char msg[1000];
-      sprintf(msg, "unknown variable: %s", varAST->getName().c_str());
+      sprintf(msg, "unknown variable: %s", varAST->getName().data());
       return logErrorV(msg);
     }
     // The var itself is the address we're looking for.
-    return var->allocaInst;
-  case '*':
-    varAST = dynamic_cast<VariableExprAST*>(operand.get());
-    if (!varAST) {
-      return logErrorV("dereferencing can only be applied to variables");
-    }
-    var = getVar(varAST->getName());
-    if (!var) {
-      char msg[1000];
-      sprintf(msg, "unknown variable: %s", varAST->getName().c_str());
-      return logErrorV(msg);
-    }
-    if (var->type != type_byte_ptr) {
+    return var->addr;
+  case '*': {
+    // Any pointer can be dereferenced, e.g. *(p + i).
+    Value* ptr = operand->codegenExpr(s);
+    if (!ptr) return nullptr;
+    if (!ptr->getType()->isPointerTy()) {
       return logErrorV("can only dereference pointers");
     }
-    {
-      Value* loadPtr = Builder.CreateLoad(var->allocaInst, "load_ptr");
-      return Builder.CreateLoad(loadPtr, "deref");
-    }
+    return s.builder->CreateLoad(ptr, "deref");
+  }
   default:
     char msg[1000];
     sprintf(msg, "unknown unary op: %c", op);
@@ -207,238 +278,521 @@ Value* UnaryExprAST::codegenExpr() {
   }
 }
 
-Value* BinaryExprAST::codegenExpr() {
+// In branching mode, && and || test their lhs first and only get to the rhs
+// if it's needed:
+//   lhs && rhs:
+//     br lhs, and.rhs, false
+//   and.rhs:
+//     br rhs, true, false
+// Used as values, they branch to blocks merging 1 and 0. With a profile, the
+// operands may be tested the other way around (see testRhsFirst). They branch
+// like this in branchless mode too when their rhs isn't safe to evaluate
+// regardless of the lhs (see canEvaluateBoth).
+bool BinaryExprAST::codegenBranch(
+    CompilerSession& s, BasicBlock* trueBB, BasicBlock* falseBB) {
+  if ((op != tok_and && op != tok_or) || isBranchless(s)) {
+    return ExprAST::codegenBranch(s, trueBB, falseBB);
+  }
+  ExprAST* first = lhs;
+  ExprAST* second = rhs;
+  if (testRhsFirst(s)) {
+    std::swap(first, second);
+  }
+  Function* parentFun = s.builder->GetInsertBlock()->getParent();
+  BasicBlock* rhsBB = BasicBlock::Create(
+      *s.context, op == tok_and ? "and.rhs" : "or.rhs");
+  bool ok = op == tok_and ? first->codegenBranch(s, rhsBB, falseBB)
+                          : first->codegenBranch(s, trueBB, rhsBB);
+  if (!ok) return false;
+  parentFun->getBasicBlockList().push_back(rhsBB);
+  s.builder->SetInsertPoint(rhsBB);
+  return second->codegenBranch(s, trueBB, falseBB);
+}
+
+// Operands tested fewer times than this by the profiled rows keep their
+// order.
+static const uint64_t minReorderTests = 100;
+
+bool BinaryExprAST::testRhsFirst(CompilerSession& s) const {
+  SiteCounts l, r;
+  if (!profiledCounts(s, lhs->condSite, &l) ||
+      !profiledCounts(s, rhs->condSite, &r) ||
+      l.entries < minReorderTests || r.entries < minReorderTests ||
+      !lhs->isPure() || !rhs->isPure()) {
+    return false;
+  }
+  // The rhs was only tested on the rows the lhs let through, which are taken
+  // as a fair sample of all the rows.
+  return op == tok_and ? r.rate() < l.rate() : r.rate() > l.rate();
+}
+
+bool BinaryExprAST::isBranchless(CompilerSession& s) const {
+  if (!canEvaluateBoth()) return false;
+  return s.getPredicateMode() == pred_branchless ||
+      isUnpredictable(s, lhs->condSite) || isUnpredictable(s, rhs->condSite);
+}
+
+Value* BinaryExprAST::codegenLogical(CompilerSession& s) {
+  if (isBranchless(s)) {
+    Value* l = lhs->codegenCond(s);
+    if (!l) return nullptr;
+    Value* r = rhs->codegenCond(s);
+    if (!r) return nullptr;
+    Value* res = op == tok_and ? s.builder->CreateAnd(l, r, "andtmp")
+                               : s.builder->CreateOr(l, r, "ortmp");
+    return s.builder->CreateZExt(
+        res, Type::getInt8Ty(*s.context), "booltmp");
+  }
+  Function* parentFun = s.builder->GetInsertBlock()->getParent();
+  BasicBlock* trueBB = BasicBlock::Create(*s.context, "logic.true");
+  BasicBlock* falseBB = BasicBlock::Create(*s.context, "logic.false");
+  BasicBlock* mergeBB = BasicBlock::Create(*s.context, "logic.end");
+  if (!codegenBranch(s, trueBB, falseBB)) return nullptr;
+  for (BasicBlock* bb : {trueBB, falseBB}) {
+    parentFun->getBasicBlockList().push_back(bb);
+    s.builder->SetInsertPoint(bb);
+    s.builder->CreateBr(mergeBB);
+  }
+  parentFun->getBasicBlockList().push_back(mergeBB);
+  s.builder->SetInsertPoint(mergeBB);
+  llvm::PHINode* phi = s.builder->CreatePHI(
+      Type::getInt8Ty(*s.context), 2, "booltmp");
+  phi->addIncoming(s.builder->getInt8(1), trueBB);
+  phi->addIncoming(s.builder->getInt8(0), falseBB);
+  return phi;
+}
+
+Value* BinaryExprAST::codegenExpr(CompilerSession& s) {
+  if (op == tok_and || op == tok_or) {
+    return codegenLogical(s);
+  }
   // The assignment operator is a special case because we don't want to emit
   // code for the LHS.
   if (op == '=') {
     // Check that the lhs is a variable reference.
-    VariableExprAST* varAST = dynamic_cast<VariableExprAST*>(lhs.get());
+    VariableExprAST* varAST = dynamic_cast<VariableExprAST*>(lhs);
     if (!varAST) {
       return logErrorV("destination of assignment must be a variable");
     }
     // Codegen the RHS.
-    Value* r = rhs->codegenExpr();
+    Value* r = rhs->codegenExpr(s);
+    if (!r) {
+      return nullptr;
+    }
 
     // Lookup the name.
-    unique_ptr<Variable> var = getVar(varAST->getName());
+    unique_ptr<Variable> var = s.getVar(varAST->getName());
     if (!var) {
       char msg[1000];
-      sprintf(msg, "unknown variable: %s", varAST->getName().c_str());
+      sprintf(msg, "unknown variable: %s", varAST->getName().data());
       return logErrorV(msg);
     }
-    Builder.CreateStore(r, var->allocaInst);
+    r = convertTo(s, r, var->llvmType);
+    if (!r) {
+      return nullptr;
+    }
+    s.builder->CreateStore(r, var->addr);
     // Return the result of the rhs.
     return r;
   }
 
-  Value* l = lhs->codegenExpr();
-  Value* r = rhs->codegenExpr();
+  Value* l = lhs->codegenExpr(s);
+  Value* r = rhs->codegenExpr(s);
 
   if (!l || !r) {
     return nullptr;
   }
+  // A pointer plus an integer is the pointer that many bytes further.
+  if (op == '+' && l->getType()->isPointerTy() && r->getType()->isIntegerTy()) {
+    return s.builder->CreateInBoundsGEP(l, r, "ptradd");
+  }
+  // Mixed byte and int64 operands are done in 64 bits.
+  if (l->getType()->isIntegerTy(64)) {
+    r = convertTo(s, r, l->getType());
+  } else if (r->getType()->isIntegerTy(64)) {
+    l = convertTo(s, l, r->getType());
+  }
+  if (!l || !r) {
+    return nullptr;
+  }
+  // Pointers can only be compared for equality.
+  bool pointers = op == tok_eq && l->getType()->isPointerTy();
+  if (l->getType() != r->getType() ||
+      !(l->getType()->isIntegerTy() || pointers)) {
+    char msg[1000];
+    sprintf(msg, "invalid operands for bin op: %s",
+        BinOpString(op).c_str());
+    return logErrorV(msg);
+  }
 
   switch (op) {
   case '+':
-    // return Builder.CreateFAdd(l, r, "addtmp");
-    return Builder.CreateAdd(l, r, "addtmp");
+    // return s.builder->CreateFAdd(l, r, "addtmp");
+    return s.builder->CreateAdd(l, r, "addtmp");
   case '-':
-    // return Builder.CreateFSub(l, r, "subtmp");
-    return Builder.CreateSub(l, r, "subtmp");
+    // return s.builder->CreateFSub(l, r, "subtmp");
+    return s.builder->CreateSub(l, r, "subtmp");
   case '*':
-    // return Builder.CreateFMul(l, r, "multmp");
-    return Builder.CreateMul(l, r, "multmp");
+    // return s.builder->CreateFMul(l, r, "multmp");
+    return s.builder->CreateMul(l, r, "multmp");
   case '<':
-    // compare unordered less than
-    // !!! l = Builder.CreateFCmpULT(l, r, "cmptmp");
-    l = Builder.CreateICmpULT(l, r, "cmptmp");
-    // !!!
-    // Convert bool 0/1 to double 0.0 or 1.0
-    // return Builder.CreateUIToFP(
-    //     l, Type::getDoubleTy(TheContext), "booltmp");
+    // Integers are signed. The result is a byte, 0 or 1.
+    l = s.builder->CreateICmpSLT(l, r, "cmptmp");
+    return s.builder->CreateZExt(l, Type::getInt8Ty(*s.context), "booltmp");
+  case tok_eq:
+    l = s.builder->CreateICmpEQ(l, r, "eqtmp");
+    return s.builder->CreateZExt(l, Type::getInt8Ty(*s.context), "booltmp");
   default:
     char msg[1000];
-    sprintf(msg, "invalid bin op: %c", op);
+    sprintf(msg, "invalid bin op: %s", BinOpString(op).c_str());
     return logErrorV(msg);
   }
 }
 
-Value* CallExprAST::codegenExpr() {
+Value* CallExprAST::codegenExpr(CompilerSession& s) {
   // Resolve the function, either in the current module or in the list of
   // functions in all the modules.
-  Function* calleeFun = resolveFunction(callee);
+  Function* calleeFun = s.resolveFunction(callee);
   if (!calleeFun) {
     char msg[1000];
-    sprintf(msg, "unknown function referenced: %s", callee.c_str());
+    sprintf(msg, "unknown function referenced: %s", callee.data());
     return logErrorV(msg);
   }
 
+  // Calls to the decoding helpers get their body from the runtime library,
+  // so that they can be inlined.
+  if (calleeFun->isDeclaration() && IsRuntimeBuiltin(callee.str())) {
+    DefineRuntimeBuiltin(calleeFun, s.getTargetMachine());
+  }
+
   if (calleeFun->arg_size() != args.size()) {
     char msg[1000];
     sprintf(msg, "incorrect # arguments passed to %s: expected %lu, got %lu",
-        callee.c_str(), calleeFun->arg_size(), args.size());
+        callee.data(), calleeFun->arg_size(), args.size());
     return logErrorV(msg);
   }
 
   vector<Value*> argsV;
-  for (const std::unique_ptr<ExprAST>& a : args) {
-    Value* v = a->codegenExpr();
+  for (ExprAST* a : args) {
+    Value* v = a->codegenExpr(s);
+    if (!v) {
+      return nullptr;
+    }
+    llvm::Type* paramType =
+        calleeFun->getFunctionType()->getParamType(argsV.size());
+    v = convertTo(s, v, paramType);
     if (!v) {
       return nullptr;
     }
     argsV.push_back(v);
   }
-  return Builder.CreateCall(calleeFun, argsV, "calltmp");
+  if (std::atomic<uint64_t>* counters = instrumentedCounters(s, callSite)) {
+    emitCounterAdd(s, &counters[0], s.builder->getInt64(1));
+  }
+  llvm::CallInst* call = s.builder->CreateCall(calleeFun, argsV, "calltmp");
+  SiteCounts counts;
+  if (profiledCounts(s, callSite, &counts) && counts.entries == 0 &&
+      s.getProfile()->rows() > 0) {
+    // None of the profiled rows made the call: the paths to it are cold.
+    call->addAttribute(
+        llvm::AttributeList::FunctionIndex, llvm::Attribute::Cold);
+  }
+  return call;
 }
 
-Function* PrototypeAST::codegen() const {
+Function* PrototypeAST::codegen(CompilerSession& s) const {
   // The signature of the params.
   vector<Type*> paramTypes;
   for (size_t i = 0; i < argNames.size(); i++) {
-    llvm::Type* llvmType = getLLVMType(argTypes[i]);
+    llvm::Type* llvmType = getLLVMType(*s.context, argTypes[i]);
     if (llvmType == nullptr) return nullptr;
     paramTypes.push_back(llvmType); 
   }
-  llvm::Type* retLLVMType = getLLVMType(retType);
+  for (llvm::Type* t : s.hiddenArgTypes(name)) {
+    paramTypes.push_back(t);
+  }
+  llvm::Type* retLLVMType = getLLVMType(*s.context, retType);
   if (retLLVMType == nullptr) return nullptr;
   llvm::FunctionType* ft = llvm::FunctionType::get(
       retLLVMType, paramTypes, false /* isVarArg */);
   // Insert the function into the module.
-  Function* f = Function::Create(ft, Function::ExternalLinkage, name, TheModule.get());
+  Function* f = Function::Create(ft, Function::ExternalLinkage, name, s.module.get());
 
-  // Set argument names;
-  int idx = 0;
-  for (auto& p : f->args()) {
-    p.setName(argNames[idx++]);
+  // Set argument names; the hidden ones get theirs from bindHiddenArgs.
+  for (size_t i = 0; i < argNames.size(); i++) {
+    std::next(f->arg_begin(), i)->setName(argNames[i]);
   }
   return f;
 }
 
-Function* FunctionAST::codegen() {
+// bindHiddenArgs adds the variables f gets through its hidden arguments (see
+// CompilerSession::hiddenArgTypes), the ones from firstHidden on, to the
+// symbol table. The state variables are used in place; the batch entry point
+// keeps them in registers. An output variable is the row's slot in its output
+// column, zeroed first so that rows not assigning it output 0. A parameter is
+// a local variable set to its value, which in a session specialized for the
+// values is a constant: mem2reg then gets it to its uses, like a literal.
+// Returns false if the values don't match the parameters.
+static bool bindHiddenArgs(
+    CompilerSession& s, Function* f, size_t firstHidden) {
+  auto argIt = std::next(f->arg_begin(), firstHidden);
+  if (s.takesState(f->getName())) {
+    Value* state = &*argIt++;
+    state->setName("state");
+    for (size_t j = 0; j < s.states.size(); j++) {
+      const StateAST& var = *s.states[j];
+      Value* slot = s.builder->CreateConstInBoundsGEP1_64(
+          state, j, var.getName());
+      s.namedValues.insert(std::make_pair(
+          var.getName(),
+          Variable(var.getType(), getLLVMType(*s.context, var.getType()),
+                   slot)));
+    }
+  }
+  if (s.takesOutputs(f->getName())) {
+    Value* outCols = &*argIt++;
+    Value* outRow = &*argIt++;
+    outCols->setName("out_cols");
+    outRow->setName("out_row");
+    for (size_t j = 0; j < s.outputs.size(); j++) {
+      const OutputAST& var = *s.outputs[j];
+      llvm::Type* llvmType = getLLVMType(*s.context, var.getType());
+      Value* col = s.builder->CreateLoad(
+          s.builder->CreateConstInBoundsGEP1_64(outCols, j),
+          var.getName() + "_col");
+      Value* slot = s.builder->CreateInBoundsGEP(col, outRow, var.getName());
+      s.builder->CreateStore(getZeroVal(*s.context, var.getType()), slot);
+      s.namedValues.insert(std::make_pair(
+          var.getName(), Variable(var.getType(), llvmType, slot)));
+    }
+  }
+  const ParamValues* values = s.getParamValues();
+  bool takesParams = s.takesParams(f->getName());
+  if (takesParams || (values != nullptr && f->getName() == "prog_main")) {
+    Value* params = nullptr;
+    if (takesParams) {
+      params = &*argIt++;
+      params->setName("params");
+    } else if (values->size() != s.params.size()) {
+      char msg[1000];
+      sprintf(msg, "the program has %lu parameters, got values for %lu",
+          (unsigned long)s.params.size(), (unsigned long)values->size());
+      logErrorV(msg);
+      return false;
+    }
+    for (size_t j = 0; j < s.params.size(); j++) {
+      const ParamAST& var = *s.params[j];
+      llvm::Type* llvmType = getLLVMType(*s.context, var.getType());
+      Value* val;
+      if (takesParams) {
+        Value* slot = s.builder->CreateConstInBoundsGEP1_64(params, j);
+        if (var.getType() == type_byte_ptr) {
+          slot = s.builder->CreateBitCast(slot, llvmType->getPointerTo());
+        }
+        val = s.builder->CreateLoad(slot, var.getName());
+      } else if ((*values)[j].type != var.getType()) {
+        char msg[1000];
+        sprintf(msg, "value of the wrong type for parameter %s",
+            var.getName().str().c_str());
+        logErrorV(msg);
+        return false;
+      } else if (var.getType() == type_int64) {
+        val = llvm::ConstantInt::get(
+            llvmType, (*values)[j].ival, true /* isSigned */);
+      } else {
+        val = createStringLiteral(s, (*values)[j].sval);
+      }
+      llvm::AllocaInst* alloca =
+          createEntryBlockAlloca(f, var.getName(), llvmType);
+      s.builder->CreateStore(val, alloca);
+      s.namedValues.insert(std::make_pair(
+          var.getName(), Variable(var.getType(), llvmType, alloca)));
+    }
+  }
+  return true;
+}
+
+// discardFunction drops f, whose code failed to generate, so that it can be
+// defined again. If the functions before it in the module call it, it stays
+// as a declaration.
+static void discardFunction(Function* f) {
+  if (f->use_empty()) {
+    f->eraseFromParent();
+  } else {
+    f->deleteBody();
+  }
+}
+
+Function* FunctionAST::codegen(CompilerSession& s) {
   const PrototypeAST& p = *proto;
-  // Transfer ownership of the prototype to the FunctionProtos map.
-  FunctionProtos[p.getName()] = std::move(proto);
-  Function* f = resolveFunction(p.getName());
+  s.functionProtos[p.getName().str()] = proto;
+  Function* f = s.resolveFunction(p.getName());
   // We just added the function above.
   assert(f);
 
-  BasicBlock *bb = BasicBlock::Create(TheContext, "entry", f);
-  Builder.SetInsertPoint(bb);
+  BasicBlock *bb = BasicBlock::Create(*s.context, "entry", f);
+  s.builder->SetInsertPoint(bb);
 
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
-  int i = 0;
+  // Record the function arguments in the s.namedValues map.
+  s.namedValues.clear();
+  size_t i = 0;
   for (auto& arg : f->args()) {
+    if (i == p.getArgNames().size()) {
+      // The hidden arguments follow.
+      break;
+    }
 
     VarType type = p.getArgType(i);
     llvm::Type* llvmType = arg.getType();
     // Create an alloca for this variable.
     llvm::AllocaInst* alloca = createEntryBlockAlloca(f, arg.getName(), llvmType);
     // Store the initial value into the alloca.
-    Builder.CreateStore(&arg, alloca);
+    s.builder->CreateStore(&arg, alloca);
 
     // Add the variable to the symbol table.
-    NamedValues.insert(std::make_pair(arg.getName(), Variable(type, llvmType, alloca)));
+    s.namedValues.insert(std::make_pair(arg.getName(), Variable(type, llvmType, alloca)));
     i++;
   }
+  if (!bindHiddenArgs(s, f, i)) {
+    discardFunction(f);
+    return nullptr;
+  }
 
-  auto bodyRes = body->codegen();
+  auto bodyRes = body->codegen(s);
   if (!bodyRes.success) {
     // In case of error in the body, we erase the function so it can be defined
     // again.
-    f->eraseFromParent();
+    discardFunction(f);
     return nullptr;
   }
   // bool xxx = (p.getName() != "magic");
 
   if (p.getName() != "magic") {
-    BasicBlock* lastBlock = Builder.GetInsertBlock();
+    BasicBlock* lastBlock = s.builder->GetInsertBlock();
     if (lastBlock->empty()) {
-      Builder.CreateRet(llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)));
+      s.builder->CreateRet(llvm::ConstantFP::get(*s.context, llvm::APFloat(0.0)));
     }
     // !!! now the return value is in the generated code, but I should assert that.
-    // Builder.CreateRet(retVal);
+    // s.builder->CreateRet(retVal);
   } else {
     // fprintf(stderr, "!!! FunctionAST::codegen 8\n");
-    // Function* parentFun = Builder.GetInsertBlock()->getParent();
-    // BasicBlock* b2 = BasicBlock::Create(TheContext, "b2", parentFun);
-    // BasicBlock* b3 = BasicBlock::Create(TheContext, "b3", parentFun);
+    // Function* parentFun = s.builder->GetInsertBlock()->getParent();
+    // BasicBlock* b2 = BasicBlock::Create(*s.context, "b2", parentFun);
+    // BasicBlock* b3 = BasicBlock::Create(*s.context, "b3", parentFun);
     //
-    // Value* arg0 = NamedValues[f->args().begin()->getName()];
-    // auto condCode = Builder.CreateFCmpONE(
-    //     arg0, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "ifcond");
-    // Builder.CreateCondBr(condCode, b2, b3);
+    // Value* arg0 = s.namedValues[f->args().begin()->getName()];
+    // auto condCode = s.builder->CreateFCmpONE(
+    //     arg0, llvm::ConstantFP::get(*s.context, llvm::APFloat(0.0)), "ifcond");
+    // s.builder->CreateCondBr(condCode, b2, b3);
     //
-    // Builder.SetInsertPoint(b2);
-    // auto bogusRet = llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
-    // Builder.CreateRet(bogusRet);
+    // s.builder->SetInsertPoint(b2);
+    // auto bogusRet = llvm::ConstantFP::get(*s.context, llvm::APFloat(1.0));
+    // s.builder->CreateRet(bogusRet);
     //
-    // Builder.SetInsertPoint(b3);
-    // bogusRet = llvm::ConstantFP::get(TheContext, llvm::APFloat(2.0));
-    // Builder.CreateRet(bogusRet);
+    // s.builder->SetInsertPoint(b3);
+    // bogusRet = llvm::ConstantFP::get(*s.context, llvm::APFloat(2.0));
+    // s.builder->CreateRet(bogusRet);
   }
   
   // Validate the generated code, checking for consistency.
-  // !!!
-  f->print(llvm::errs());
+  DiagPrint(diag_ir, "Generated function:", *f);
 
   assert(!llvm::verifyFunction(*f, &llvm::errs()));
 
-  TheFPM->run(*f);
+  PhaseScope phase(s.clock, phase_function_passes);
+  s.fpm->run(*f);
+  // The promoted variables bring the string literals to the compares they're
+  // used in; fold those, and clean up after them.
+  if (SpecializeLiteralCompares(*f)) {
+    s.fpm->run(*f);
+  }
 
   return f;
 }
 
-CodegenRes IfStmtAST::codegen() {
-  Value* condCode = condExpr->codegenExpr();
-  if (!condCode) return CodegenRes(false, false); 
-  // Convert condition to a bool by comparing non-equal to 0.
-  condCode = Builder.CreateICmpNE(
-      condCode,
-      llvm::Constant::getNullValue(condCode->getType()), "ifcond");
-      // !!! llvm::Constant::get(TheContext, llvm::APFloat(0)), "ifcond");
+CodegenRes IfStmtAST::codegen(CompilerSession& s) {
+  // In branchless mode, or if the profile has its condition unpredictable, an
+  // if that only returns selects the value it returns, unless that would
+  // evaluate what the condition guards.
+  if (canSelect() && (s.getPredicateMode() == pred_branchless ||
+                      isUnpredictable(s, condExpr->condSite))) {
+    Value* retVal = codegenReturnValue(s);
+    if (retVal == nullptr) return CodegenRes(false, false);
+    s.builder->CreateRet(retVal);
+    return CodegenRes(true, true);
+  }
 
   // Get a reference to the function in which we're generating code. We'll
   // create new blocks in this function.
-  Function* parentFun = Builder.GetInsertBlock()->getParent();
-
-  // Create blocks for the then and else cases. 
-  // The 'then' block is inserted at the end of the function; the others will
-  // be inserted later.
-  BasicBlock* thenBlock = BasicBlock::Create(TheContext, "then", parentFun);
-  BasicBlock* elseBlock = BasicBlock::Create(TheContext, "if");
-  BasicBlock* mergeBlock = BasicBlock::Create(TheContext, "ifcont");
-  Builder.CreateCondBr(condCode, thenBlock, elseBlock);
+  Function* parentFun = s.builder->GetInsertBlock()->getParent();
+
+  // Create blocks for the then and else cases. They're inserted into the
+  // function once the condition, which may add blocks of its own, is done.
+  BasicBlock* thenBlock = BasicBlock::Create(*s.context, "then");
+  BasicBlock* elseBlock = BasicBlock::Create(*s.context, "if");
+  BasicBlock* mergeBlock = BasicBlock::Create(*s.context, "ifcont");
+  if (!condExpr->codegenBranch(s, thenBlock, elseBlock)) {
+    return CodegenRes(false, false);
+  }
+  parentFun->getBasicBlockList().push_back(thenBlock);
 
   // Emit "then" code into a new block.
-  Builder.SetInsertPoint(thenBlock);
-  auto thenRes = thenStmt->codegen();
+  s.builder->SetInsertPoint(thenBlock);
+  auto thenRes = thenStmt->codegen(s);
   if (!thenRes.success) return thenRes;
   if (!thenRes.ret) {  
     // Unconditional jump after the if/then/else block.
-    Builder.CreateBr(mergeBlock);
+    s.builder->CreateBr(mergeBlock);
   }
 
   // Emit "else" code into a new block.
   parentFun->getBasicBlockList().push_back(elseBlock);
-  Builder.SetInsertPoint(elseBlock);
-  auto elseRes = elseStmt->codegen();
+  s.builder->SetInsertPoint(elseBlock);
+  auto elseRes = elseStmt->codegen(s);
   if (!elseRes.success) return elseRes;
   if (!elseRes.ret) {
     // Unconditional jump after the if/then/else block.
-    Builder.CreateBr(mergeBlock);
+    s.builder->CreateBr(mergeBlock);
   }
   
   // Emit the "merge" code.
   parentFun->getBasicBlockList().push_back(mergeBlock);
-  Builder.SetInsertPoint(mergeBlock);
+  s.builder->SetInsertPoint(mergeBlock);
   return CodegenRes(true, false);
 }
 
-CodegenRes ReturnStmtAST::codegen() {
-  Value* retVal = expr->codegenExpr();
+Value* IfStmtAST::codegenReturnValue(CompilerSession& s) {
+  Value* cond = condExpr->codegenCond(s);
+  if (cond == nullptr) return nullptr;
+  Value* thenVal = thenStmt->codegenReturnValue(s);
+  if (thenVal == nullptr) return nullptr;
+  Value* elseVal = elseStmt->codegenReturnValue(s);
+  if (elseVal == nullptr) return nullptr;
+  Value* sel = s.builder->CreateSelect(cond, thenVal, elseVal, "seltmp");
+  // Codegen turns selects whose condition is predictable back into branches.
+  SiteCounts counts;
+  auto* selInst = llvm::dyn_cast<llvm::Instruction>(sel);
+  if (selInst != nullptr && profiledCounts(s, condExpr->condSite, &counts) &&
+      counts.entries > 0) {
+    selInst->setMetadata(llvm::LLVMContext::MD_prof, branchWeights(s, counts));
+  }
+  return sel;
+}
+
+Value* ReturnStmtAST::codegenReturnValue(CompilerSession& s) {
+  Value* retVal = expr->codegenExpr(s);
+  if (retVal == nullptr) return nullptr;
+  return convertTo(
+      s, retVal, s.builder->GetInsertBlock()->getParent()->getReturnType());
+}
+
+CodegenRes ReturnStmtAST::codegen(CompilerSession& s) {
+  Value* retVal = expr->codegenExpr(s);
   if (retVal == nullptr) return CodegenRes(false, false);
-  Builder.CreateRet(retVal);
+  retVal = convertTo(
+      s, retVal, s.builder->GetInsertBlock()->getParent()->getReturnType());
+  if (retVal == nullptr) return CodegenRes(false, false);
+  s.builder->CreateRet(retVal);
   return CodegenRes(true, true);
 }
 
@@ -457,78 +811,163 @@ CodegenRes ReturnStmtAST::codegen() {
 //   store nextvar -> var
 //   br endcond, loop, afterloop
 // afterloop:
-CodegenRes ForStmtAST::codegen() {
-  Function* fun = Builder.GetInsertBlock()->getParent();
-  // TODO(andrei): this variable shouldn't always be a double.
+CodegenRes ForStmtAST::codegen(CompilerSession& s) {
+  if (varType != type_double) {
+    return codegenInt(s);
+  }
+  Function* fun = s.builder->GetInsertBlock()->getParent();
   llvm::AllocaInst* alloca = createEntryBlockAlloca(
-      fun, varName, Type::getDoubleTy(TheContext));
+      fun, varName, Type::getDoubleTy(*s.context));
 
   // Emit the start code first, without the loop variable in scope.
-  Value* startVal = start->codegenExpr();
+  Value* startVal = start->codegenExpr(s);
   if (!startVal) return CodegenRes(false, false);
 
-  Builder.CreateStore(startVal, alloca);
+  s.builder->CreateStore(startVal, alloca);
 
   // Make the new basic block for the loop header, inserting after current
   // block.
-  Function* parentFun = Builder.GetInsertBlock()->getParent();
-  BasicBlock* loopBB = BasicBlock::Create(TheContext, "loop", parentFun);
+  Function* parentFun = s.builder->GetInsertBlock()->getParent();
+  BasicBlock* loopBB = BasicBlock::Create(*s.context, "loop", parentFun);
   // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(loopBB);
+  s.builder->CreateBr(loopBB);
 
   // Start insertion in LoopBB.
-  Builder.SetInsertPoint(loopBB);
+  s.builder->SetInsertPoint(loopBB);
 
   // Within the loop, the variable is defined equal to the variable we just
   // introduced. If it shadows an existing variable, we have to restore it, so
   // save it now.
-  unique_ptr<Variable> oldLoopVar = getVar(varName);
-  NamedValues.insert(std::make_pair(varName, Variable(type_double, getLLVMType(type_double), alloca)));
+  unique_ptr<Variable> oldLoopVar = s.getVar(varName);
+  s.namedValues.insert(std::make_pair(varName, Variable(type_double, getLLVMType(*s.context, type_double), alloca)));
   // Generate code for the body. The generated Value is ignored.
-  CodegenRes bodyRes = body->codegen();
+  CodegenRes bodyRes = body->codegen(s);
   if (!bodyRes.success) return bodyRes;
 
   Value* endCond = nullptr;
   if (!bodyRes.ret) {
     // Emit the step value.
-    Value* stepVal = step->codegenExpr();
+    Value* stepVal = step->codegenExpr(s);
     if (!stepVal) return CodegenRes(false, false);
     // Reload, increment, and restore the alloca. This handles the case where the
     // body of the loop mutates the variable.
-    Value* curLoopVarVal = Builder.CreateLoad(alloca);
-    Value* nextLoopVar = Builder.CreateFAdd(curLoopVarVal, stepVal, "nextvar");
-    Builder.CreateStore(nextLoopVar, alloca);
+    Value* curLoopVarVal = s.builder->CreateLoad(alloca);
+    Value* nextLoopVar = s.builder->CreateFAdd(curLoopVarVal, stepVal, "nextvar");
+    s.builder->CreateStore(nextLoopVar, alloca);
 
     // Compute and evaluate the end condition.
-    endCond = end->codegenExpr();
+    endCond = end->codegenExpr(s);
     if (!endCond) return CodegenRes(false, false);
     // Convert condition to a bool by comparing non-equal to 0.0.
-    endCond = Builder.CreateFCmpONE(
-      endCond, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "loopcond");
+    endCond = s.builder->CreateFCmpONE(
+      endCond, llvm::ConstantFP::get(*s.context, llvm::APFloat(0.0)), "loopcond");
   }
   
   // Create the "after loop" block and insert it.
-  BasicBlock* afterLoopBB = BasicBlock::Create(TheContext, "afterloop", parentFun);
+  BasicBlock* afterLoopBB = BasicBlock::Create(*s.context, "afterloop", parentFun);
   // Insert the conditional branch into the end of afterLoopBB.
   if (endCond != nullptr) {
-    Builder.CreateCondBr(endCond, loopBB, afterLoopBB);
+    s.builder->CreateCondBr(endCond, loopBB, afterLoopBB);
   }
   
   // Any new code will be inserted in AfterBB.
-  Builder.SetInsertPoint(afterLoopBB);
+  s.builder->SetInsertPoint(afterLoopBB);
 
   // Restore the unshadowed variable.
   if (oldLoopVar != nullptr) {
-    NamedValues.insert(std::make_pair(varName, *oldLoopVar));
+    s.namedValues.insert(std::make_pair(varName, *oldLoopVar));
   } else {
-    NamedValues.erase(varName);
+    s.namedValues.erase(varName.str());
+  }
+  return CodegenRes(true, false);
+}
+
+// Output integer for-loops as:
+//   var = alloca iN
+//   ...
+//   start = startexpr
+//   store start -> var
+//   goto loop.cond
+// loop.cond:
+//   br endexpr, loop.body, afterloop
+// loop.body:
+//   <code for body>
+//   step = stepexpr
+//   curvar = load var
+//   nextvar = curvar +nsw step
+//   store nextvar -> var
+//   goto loop.cond
+// afterloop:
+// Once mem2reg turns var into a phi, loop.cond is the loop's header and
+// nextvar an add recurrence, so loop rotation, IndVarSimplify and the loop
+// vectorizer can compute the trip count. The add is nsw: the variable
+// overflowing is undefined, like for C's signed loop counters.
+CodegenRes ForStmtAST::codegenInt(CompilerSession& s) {
+  Function* fun = s.builder->GetInsertBlock()->getParent();
+  llvm::Type* llvmType = getLLVMType(*s.context, varType);
+  llvm::AllocaInst* alloca = createEntryBlockAlloca(fun, varName, llvmType);
+
+  // Emit the start code first, without the loop variable in scope.
+  Value* startVal = start->codegenExpr(s);
+  if (!startVal) return CodegenRes(false, false);
+  startVal = convertTo(s, startVal, llvmType);
+  if (!startVal) return CodegenRes(false, false);
+  s.builder->CreateStore(startVal, alloca);
+
+  BasicBlock* condBB = BasicBlock::Create(*s.context, "loop.cond", fun);
+  BasicBlock* bodyBB = BasicBlock::Create(*s.context, "loop.body");
+  BasicBlock* afterLoopBB = BasicBlock::Create(*s.context, "afterloop");
+  s.builder->CreateBr(condBB);
+
+  unique_ptr<Variable> oldLoopVar = s.getVar(varName);
+  s.namedValues.erase(varName.str());
+  s.namedValues.insert(
+      std::make_pair(varName, Variable(varType, llvmType, alloca)));
+  // Restores the unshadowed variable, on the way out.
+  auto restoreVar = [&]() {
+    s.namedValues.erase(varName.str());
+    if (oldLoopVar != nullptr) {
+      s.namedValues.insert(std::make_pair(varName, *oldLoopVar));
+    }
+  };
+
+  // The end condition, tested before every iteration.
+  s.builder->SetInsertPoint(condBB);
+  if (!end->codegenBranch(s, bodyBB, afterLoopBB)) {
+    restoreVar();
+    return CodegenRes(false, false);
   }
+
+  fun->getBasicBlockList().push_back(bodyBB);
+  s.builder->SetInsertPoint(bodyBB);
+  CodegenRes bodyRes = body->codegen(s);
+  if (!bodyRes.success) {
+    restoreVar();
+    return bodyRes;
+  }
+  if (!bodyRes.ret) {
+    Value* stepVal = step->codegenExpr(s);
+    if (stepVal) stepVal = convertTo(s, stepVal, llvmType);
+    if (!stepVal) {
+      restoreVar();
+      return CodegenRes(false, false);
+    }
+    // Reload the variable, in case the body assigned it.
+    Value* curVal = s.builder->CreateLoad(alloca, varName);
+    Value* nextVal = s.builder->CreateNSWAdd(curVal, stepVal, "nextvar");
+    s.builder->CreateStore(nextVal, alloca);
+    s.builder->CreateBr(condBB);
+  }
+
+  fun->getBasicBlockList().push_back(afterLoopBB);
+  s.builder->SetInsertPoint(afterLoopBB);
+  restoreVar();
   return CodegenRes(true, false);
 }
 
-CodegenRes BlockStmtAST::codegen() {
-  for (const std::unique_ptr<StatementAST>& e : body) {
-    auto stmtRes = e->codegen();
+CodegenRes BlockStmtAST::codegen(CompilerSession& s) {
+  for (StatementAST* e : body) {
+    auto stmtRes = e->codegen(s);
     if (!stmtRes.success) return stmtRes;
     if (stmtRes.ret) {
       return CodegenRes(true, true);
@@ -537,10 +976,10 @@ CodegenRes BlockStmtAST::codegen() {
   return CodegenRes(true, false);
 }
 
-CodegenRes VariableDeclAST::codegen() {
-  Function* fun = Builder.GetInsertBlock()->getParent();
+CodegenRes VariableDeclAST::codegen(CompilerSession& s) {
+  Function* fun = s.builder->GetInsertBlock()->getParent();
 
-  llvm::Type* llvmType = getLLVMType(type);
+  llvm::Type* llvmType = getLLVMType(*s.context, type);
   if (llvmType == nullptr) return CodegenRes(false, false);
 
   // Emit the initializer before adding the variable to scope, this prevents
@@ -552,18 +991,20 @@ CodegenRes VariableDeclAST::codegen() {
   //  }
   Value* initVal;
   if (val) {
-    initVal = val->codegenExpr();
+    initVal = val->codegenExpr(s);
+    if (initVal == nullptr) return CodegenRes(false, false);
+    initVal = convertTo(s, initVal, llvmType);
     if (initVal == nullptr) return CodegenRes(false, false);
   } else {
-    initVal = getZeroVal(type);
+    initVal = getZeroVal(*s.context, type);
   }
   // Allocate space for the variable on the heap. 
   llvm::AllocaInst *alloca = createEntryBlockAlloca(fun, name, llvmType);
   // Store the initial value in the allocated memory.
-  Builder.CreateStore(initVal, alloca);
+  s.builder->CreateStore(initVal, alloca);
   
   // Remember this binding.
   // TODO(andrei): When do we remove the variable from scope?
-  NamedValues.insert(std::make_pair(name, Variable(type, llvmType, alloca)));
+  s.namedValues.insert(std::make_pair(name, Variable(type, llvmType, alloca)));
   return CodegenRes(true, false);
 }
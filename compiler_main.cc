@@ -0,0 +1,43 @@
+#include <memory>
+#include <string>
+
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "compiler_main.h"
+#include "diag.h"
+#include "global.h"
+#include "kaleidoscpe_jit.h"
+
+using std::string;
+
+std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+
+void InitLLVM(unsigned optLevel, const string& objectCacheDir,
+              unsigned numCompileThreads, bool lazy, unsigned jitEvents,
+              bool framePointers, const string& targetCPU,
+              const string& targetFeatures) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  llvm::CodeGenOpt::Level cgOptLevel = llvm::CodeGenOpt::Default;
+  switch (optLevel) {
+  case 0:
+    cgOptLevel = llvm::CodeGenOpt::None;
+    break;
+  case 1:
+    cgOptLevel = llvm::CodeGenOpt::Less;
+    break;
+  case 2:
+    cgOptLevel = llvm::CodeGenOpt::Default;
+    break;
+  default:
+    cgOptLevel = llvm::CodeGenOpt::Aggressive;
+    break;
+  }
+  TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>(
+      cgOptLevel, objectCacheDir, numCompileThreads, lazy, jitEvents,
+      framePointers, targetCPU, targetFeatures);
+  Diag(diag_info, "target: %s", TheJIT->getTargetKey().c_str());
+}
@@ -1,7 +1,22 @@
 #ifndef COMPILER_MAIN_H
 #define COMPILER_MAIN_H
 
-void CompileStr(const std::string& prog);
-void InitLLVM();
+#include <string>
+
+// InitLLVM sets up the JIT. optLevel is 0-3, like clang's -O. 0 favors
+// compile time, 3 favors the speed of the generated code. If objectCacheDir
+// isn't empty, compiled objects are cached there across runs. If
+// numCompileThreads isn't 0, the JIT compiles on that many background
+// threads. If lazy is set, functions are only compiled once they're needed.
+// jitEvents are the KaleidoscopeJIT::JITEvents to register the code with, for
+// profilers and debuggers. If framePointers is set, the code keeps its frame
+// pointers, for profilers to unwind through it. The code is generated for the
+// host's CPU and features unless targetCPU names another CPU; targetFeatures
+// enables or disables features on top ("+avx2,-avx512f").
+void InitLLVM(unsigned optLevel = 2, const std::string& objectCacheDir = "",
+              unsigned numCompileThreads = 0, bool lazy = false,
+              unsigned jitEvents = 0, bool framePointers = false,
+              const std::string& targetCPU = "",
+              const std::string& targetFeatures = "");
 
 #endif
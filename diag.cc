@@ -0,0 +1,63 @@
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+
+#include "diag.h"
+
+namespace {
+
+StderrDiagSink stderrSink;
+std::atomic<DiagSink*> sink{&stderrSink};
+std::atomic<int> verbosity{diag_error};
+
+}  // namespace
+
+void StderrDiagSink::report(DiagLevel, llvm::StringRef msg) {
+  // The verbosity already filtered the messages by level. One write per
+  // message, so that the messages of different threads don't get mixed up.
+  fprintf(stderr, "%.*s\n", int(msg.size()), msg.data());
+}
+
+void SetDiagnostics(DiagSink* s, DiagLevel v) {
+  sink.store(s != nullptr ? s : &stderrSink);
+  verbosity.store(v);
+}
+
+void SetDiagVerbosity(DiagLevel v) {
+  verbosity.store(v);
+}
+
+bool DiagEnabled(DiagLevel level) {
+  return level <= verbosity.load(std::memory_order_relaxed);
+}
+
+void DiagString(DiagLevel level, llvm::StringRef msg) {
+  if (DiagEnabled(level)) {
+    sink.load()->report(level, msg);
+  }
+}
+
+void Diag(DiagLevel level, const char* fmt, ...) {
+  if (!DiagEnabled(level)) {
+    return;
+  }
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  }
+  if (size_t(n) < sizeof(buf)) {
+    sink.load()->report(level, llvm::StringRef(buf, n));
+    return;
+  }
+  // Too long for the stack buffer, like the IR dumps.
+  std::string msg(n, '\0');
+  va_start(args, fmt);
+  vsnprintf(&msg[0], n + 1, fmt, args);
+  va_end(args);
+  sink.load()->report(level, msg);
+}
@@ -0,0 +1,66 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+// The compiler reports what it has to say through Diag, to a process wide
+// DiagSink. The messages have a level, and the ones above the verbosity are
+// dropped before they're formatted: by default only errors are reported, and
+// compiling a program doesn't print anything else.
+
+enum DiagLevel {
+  diag_error,  // Errors in the program.
+  diag_info,   // What the compiler is doing: the definitions it read, the
+               // values of the top-level expressions.
+  diag_ir,     // Dumps of the program and of the IR it's compiled to.
+};
+
+// DiagSink receives the diagnostics that pass the verbosity. It's called from
+// all the threads compiling, so it needs to be thread safe.
+class DiagSink {
+public:
+  virtual ~DiagSink() = default;
+  // msg doesn't end with a newline.
+  virtual void report(DiagLevel level, llvm::StringRef msg) = 0;
+};
+
+// StderrDiagSink writes every diagnostic to stderr, on a line of its own. It's
+// the default sink.
+class StderrDiagSink : public DiagSink {
+public:
+  void report(DiagLevel level, llvm::StringRef msg) override;
+};
+
+// SetDiagnostics makes sink (which needs to outlive its use) receive the
+// diagnostics up to verbosity. A null sink restores the default one.
+void SetDiagnostics(DiagSink* sink, DiagLevel verbosity);
+// SetDiagVerbosity only changes the verbosity.
+void SetDiagVerbosity(DiagLevel verbosity);
+
+// DiagEnabled returns whether diagnostics of the level are reported.
+bool DiagEnabled(DiagLevel level);
+
+// Diag reports a printf style message.
+void Diag(DiagLevel level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// DiagString reports msg as it is.
+void DiagString(DiagLevel level, llvm::StringRef msg);
+
+// DiagPrint reports prefix followed by the printed v, a Function or a Module,
+// if level is enabled.
+template <typename T>
+void DiagPrint(DiagLevel level, llvm::StringRef prefix, const T& v) {
+  if (!DiagEnabled(level)) {
+    return;
+  }
+  std::string msg;
+  llvm::raw_string_ostream os(msg);
+  os << prefix;
+  v.print(os, nullptr);
+  DiagString(level, os.str());
+}
+
+#endif
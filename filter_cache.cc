@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <string>
+
+#include "ast.h"
+#include "diag.h"
+#include "filter_cache.h"
+#include "session.h"
+
+using std::string;
+
+string NormalizeProgram(const string& prog) {
+  string res;
+  res.reserve(prog.size());
+  bool pendingSpace = false;
+  for (size_t i = 0; i < prog.size(); i++) {
+    char c = prog[i];
+    if (c == '#') {
+      // Comment until end of line.
+      while (i < prog.size() && prog[i] != '\n' && prog[i] != '\r') {
+        i++;
+      }
+      pendingSpace = true;
+      continue;
+    }
+    if (isspace(c)) {
+      pendingSpace = true;
+      continue;
+    }
+    if (pendingSpace && !res.empty()) {
+      res += ' ';
+    }
+    pendingSpace = false;
+    if (c == '"') {
+      // Copy string literals verbatim.
+      size_t end = prog.find('"', i + 1);
+      if (end == string::npos) {
+        end = prog.size() - 1;
+      }
+      res.append(prog, i, end - i + 1);
+      i = end;
+      continue;
+    }
+    res += c;
+  }
+  return res;
+}
+
+CompiledFilter::~CompiledFilter() {
+  for (auto h : modules) {
+    jit->removeModule(h);
+  }
+}
+
+void CompiledFilter::initState(int64_t* s) const {
+  for (size_t i = 0; i < state.size(); i++) {
+    switch (state[i].merge) {
+    case merge_sum:
+      s[i] = 0;
+      break;
+    case merge_min:
+      s[i] = INT64_MAX;
+      break;
+    case merge_max:
+      s[i] = INT64_MIN;
+      break;
+    }
+  }
+}
+
+void CompiledFilter::mergeState(int64_t* into, const int64_t* from) const {
+  for (size_t i = 0; i < state.size(); i++) {
+    switch (state[i].merge) {
+    case merge_sum:
+      // Wrap around like the generated code does.
+      into[i] = int64_t(uint64_t(into[i]) + uint64_t(from[i]));
+      break;
+    case merge_min:
+      into[i] = std::min(into[i], from[i]);
+      break;
+    case merge_max:
+      into[i] = std::max(into[i], from[i]);
+      break;
+    }
+  }
+}
+
+bool CompiledFilter::checkParams(const ParamValues& values) const {
+  if (values.size() != params.size()) {
+    Diag(diag_error, "the program has %lu parameters, got values for %lu",
+        (unsigned long)params.size(), (unsigned long)values.size());
+    return false;
+  }
+  for (size_t i = 0; i < params.size(); i++) {
+    if (values[i].type != params[i].type) {
+      Diag(diag_error, "value of the wrong type for parameter %s",
+          params[i].name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<int64_t> ParamArgs(const ParamValues& values) {
+  std::vector<int64_t> args;
+  for (const ParamValue& v : values) {
+    if (v.type == type_byte_ptr) {
+      args.push_back(int64_t(intptr_t(v.sval.data())));
+    } else {
+      args.push_back(v.ival);
+    }
+  }
+  return args;
+}
+
+std::shared_ptr<const CompiledFilter> CompileFilter(
+    llvm::orc::KaleidoscopeJIT& jit, const string& prog,
+    PredicateMode predicateMode, const ParamValues* paramValues,
+    CompileMode compileMode, ProfileMode profileMode,
+    std::shared_ptr<FilterProfile> profile) {
+  auto filter = std::make_shared<CompiledFilter>();
+  filter->jit = &jit;
+  if (profileMode == profile_instrument) {
+    filter->profile = profile;
+  }
+  {
+    CompilerSession session(jit, prog, predicateMode, paramValues,
+                            compileMode, profileMode, profile.get());
+    session.MainLoop();
+    filter->modules = std::move(session.getAddedModules());
+    filter->stats = session.getStats();
+    // The names are in the session's arena.
+    for (const StateAST* s : session.states) {
+      filter->state.push_back(StateSlot{s->getName().str(), s->getMerge()});
+    }
+    for (const OutputAST* o : session.outputs) {
+      filter->outputs.push_back(o->getName().str());
+    }
+    filter->specialized = paramValues != nullptr && !session.params.empty();
+    for (const ParamAST* p : session.params) {
+      if (!filter->specialized) {
+        filter->params.push_back(ParamSlot{p->getName().str(), p->getType()});
+      }
+    }
+  }
+  // With state, outputs or parameters, prog_main takes them and isn't a
+  // RowFn.
+  bool batchOnly = !filter->state.empty() || !filter->outputs.empty() ||
+      !filter->params.empty();
+
+  // Only look at the modules of this program; other programs define their own
+  // prog_main.
+  {
+    PhaseClock clock(&filter->stats);
+    PhaseScope phase(clock, phase_jit_lookup);
+    for (auto h : filter->modules) {
+      if (!batchOnly) {
+        if (auto sym = jit.findSymbolIn(h, "prog_main")) {
+          filter->rowFn =
+              (CompiledFilter::RowFn)(intptr_t)(*sym.getAddress());
+        }
+      }
+      if (auto sym = jit.findSymbolIn(h, "prog_main_batch")) {
+        filter->batchFn =
+            (CompiledFilter::BatchFn)(intptr_t)(*sym.getAddress());
+      }
+    }
+  }
+  for (auto h : filter->modules) {
+    llvm::orc::KaleidoscopeJIT::ModuleStats m = jit.getModuleStats(h);
+    if (m.Compiled) {
+      filter->stats.numModulesCompiled++;
+      filter->stats.machineCodeNanos += m.CompileNanos;
+      filter->stats.codeBytes += m.ObjectBytes;
+    }
+    filter->stats.memoryBytes += m.CodeBytes + m.DataBytes;
+  }
+  if ((filter->rowFn == nullptr && !batchOnly) ||
+      filter->batchFn == nullptr) {
+    Diag(diag_error, "program doesn't define prog_main");
+    return nullptr;
+  }
+  return filter;
+}
+
+// cacheKey returns the key of prog's filter in a FilterCache.
+static string cacheKey(const string& prog, PredicateMode predicateMode) {
+  return std::to_string(int(predicateMode)) + ":" + NormalizeProgram(prog);
+}
+
+// specializationKey returns the key of the filter for the program with key
+// progKey specialized for values.
+static string specializationKey(
+    const string& progKey, const ParamValues& values) {
+  string key = progKey;
+  for (const ParamValue& v : values) {
+    // The normalized program only has newlines in its string literals. The
+    // strings are length prefixed, so any bytes can be in them.
+    key += '\n';
+    if (v.type == type_byte_ptr) {
+      key += std::to_string(v.sval.size()) + ":" + v.sval;
+    } else {
+      key += std::to_string(v.ival);
+    }
+  }
+  return key;
+}
+
+// The parameter sets FilterCache counts the uses of at most; past that, it
+// forgets the counts of the sets that aren't queued, and counts them again.
+static const size_t maxTrackedParamSets = 4096;
+// The uses of a parameter set whose specialization has been queued: it isn't
+// counted anymore, and isn't queued again.
+static const uint64_t queuedParamUses = UINT64_MAX;
+
+FilterCache::~FilterCache() {
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    stopping = true;
+    pendingSpecializations.clear();
+  }
+  specializationQueued.notify_all();
+  if (specializer.joinable()) {
+    specializer.join();
+  }
+}
+
+std::shared_ptr<const CompiledFilter> FilterCache::Get(
+    const string& prog, PredicateMode predicateMode) {
+  return get(cacheKey(prog, predicateMode), prog, predicateMode);
+}
+
+std::shared_ptr<const CompiledFilter> FilterCache::get(
+    const string& key, const string& prog, PredicateMode predicateMode) {
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      numHits++;
+      // Move to the front of the LRU list.
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->filter;
+    }
+  }
+
+  numMisses++;
+  std::shared_ptr<const CompiledFilter> filter =
+      CompileFilter(jit, prog, predicateMode);
+  if (filter == nullptr) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mu);
+  totalStats.add(filter->stats);
+  return insertLocked(key, std::move(filter));
+}
+
+std::shared_ptr<const CompiledFilter> FilterCache::insertLocked(
+    const string& key, std::shared_ptr<const CompiledFilter> filter) {
+  auto it = index.find(key);
+  if (it != index.end()) {
+    // Somebody else compiled the same program in the meantime; use theirs so
+    // that there's only one copy in the cache. Ours goes away with filter.
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->filter;
+  }
+  uint64_t bytes = filter->stats.memoryBytes;
+  while (!lru.empty() &&
+         ((capacity > 0 && lru.size() >= capacity) ||
+          (codeBudget > 0 && cachedBytes + bytes > codeBudget))) {
+    cachedBytes -= lru.back().filter->stats.memoryBytes;
+    index.erase(lru.back().key);
+    lru.pop_back();
+  }
+  cachedBytes += bytes;
+  lru.push_front(Entry{key, filter});
+  index[key] = lru.begin();
+  return filter;
+}
+
+BoundFilter FilterCache::Bind(
+    const string& prog, const ParamValues& values,
+    PredicateMode predicateMode) {
+  BoundFilter res;
+  string key = cacheKey(prog, predicateMode);
+  string specKey = specializationKey(key, values);
+  if (!values.empty()) {
+    std::lock_guard<std::mutex> lock(mu);
+    auto it = index.find(specKey);
+    if (it != index.end()) {
+      numHits++;
+      lru.splice(lru.begin(), lru, it->second);
+      res.filter = it->second->filter;
+      return res;
+    }
+  }
+
+  std::shared_ptr<const CompiledFilter> filter =
+      get(key, prog, predicateMode);
+  if (filter == nullptr || !filter->checkParams(values)) {
+    return res;
+  }
+  if (!values.empty() && hotParamUses > 0) {
+    std::lock_guard<std::mutex> lock(mu);
+    if (paramUses.size() >= maxTrackedParamSets) {
+      // Keep the queued sets from being queued again, unless they're all
+      // there is.
+      for (auto u = paramUses.begin(); u != paramUses.end();) {
+        u = u->second == queuedParamUses ? std::next(u) : paramUses.erase(u);
+      }
+      if (paramUses.size() >= maxTrackedParamSets) {
+        paramUses.clear();
+      }
+    }
+    auto it = paramUses.emplace(specKey, 0).first;
+    if (it->second != queuedParamUses && ++it->second == hotParamUses &&
+        !stopping) {
+      // Once it's queued, the set isn't counted anymore, until its
+      // specialization is cached; if it fails, the set keeps using the
+      // generic filter.
+      it->second = queuedParamUses;
+      pendingSpecializations.push_back(
+          Specialization{specKey, prog, values, predicateMode});
+      if (!specializer.joinable()) {
+        specializer = std::thread([this]() { specializerLoop(); });
+      }
+      specializationQueued.notify_one();
+    }
+  }
+  res.filter = std::move(filter);
+  auto boundValues = std::make_shared<const ParamValues>(values);
+  res.args = ParamArgs(*boundValues);
+  res.values = std::move(boundValues);
+  return res;
+}
+
+void FilterCache::specializerLoop() {
+  std::unique_lock<std::mutex> lock(mu);
+  while (true) {
+    specializationQueued.wait(lock, [this]() {
+      return stopping || !pendingSpecializations.empty();
+    });
+    if (stopping) {
+      return;
+    }
+    Specialization spec = std::move(pendingSpecializations.front());
+    pendingSpecializations.pop_front();
+    specializing = true;
+    lock.unlock();
+    std::shared_ptr<const CompiledFilter> filter =
+        CompileFilter(jit, spec.prog, spec.predicateMode, &spec.values);
+    lock.lock();
+    specializing = false;
+    if (filter != nullptr) {
+      numSpecializations++;
+      totalStats.add(filter->stats);
+      insertLocked(spec.key, std::move(filter));
+      // Binds now find the specialization, until it's evicted; the set then
+      // gets counted again.
+      paramUses.erase(spec.key);
+    }
+    specializationDone.notify_all();
+  }
+}
+
+void FilterCache::WaitForSpecializations() {
+  std::unique_lock<std::mutex> lock(mu);
+  specializationDone.wait(lock, [this]() {
+    return stopping ||
+        (pendingSpecializations.empty() && !specializing);
+  });
+}
+
+uint64_t FilterCache::memoryBytes() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return cachedBytes;
+}
+
+CompileStats FilterCache::stats() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return totalStats;
+}
+
+size_t FilterCache::size() const {
+  std::lock_guard<std::mutex> lock(mu);
+  return lru.size();
+}
@@ -0,0 +1,261 @@
+#ifndef FILTER_CACHE_H
+#define FILTER_CACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "kaleidoscpe_jit.h"
+#include "profile.h"
+#include "session.h"
+#include "stats.h"
+
+// StateSlot describes one of a program's state variables (see StateAST).
+struct StateSlot {
+  std::string name;
+  StateMerge merge;
+};
+
+// ParamSlot describes one of a program's parameters (see ParamAST).
+struct ParamSlot {
+  std::string name;
+  VarType type;
+};
+
+// CompiledFilter is a program that's been compiled and linked by a JIT. It
+// owns the program's modules and removes them from the JIT when it's
+// destroyed.
+//
+// A program declaring state variables accumulates them over the rows it's run
+// on. Every thread running it has its own state, an int64_t per slot set up by
+// initState. The batch entry point reads the state and writes it back when
+// it's done; once all the rows are done, the threads' states are combined
+// with mergeState.
+//
+// A program declaring output variables also writes them for the rows it
+// matches, to columns the caller provides: outCols[j] is room for n values of
+// output j, the first count of which the batch entry point fills, one per
+// matching row in order.
+//
+// A program declaring parameters is either compiled for any values, which
+// the batch entry point takes laid out by ParamArgs, or specialized for some
+// values, which are baked into its code.
+struct CompiledFilter {
+  using RowFn = char (*)(const char* k, const char* v);
+  // state, outCols and params are null for programs without state, output or
+  // parameter variables (or with their parameters specialized).
+  using BatchFn = uint32_t (*)(
+      const char** keys, const char** vals, uint32_t n, uint8_t* outBitmap,
+      int64_t* state, int64_t** outCols, const int64_t* params);
+
+  CompiledFilter() = default;
+  CompiledFilter(const CompiledFilter&) = delete;
+  CompiledFilter& operator=(const CompiledFilter&) = delete;
+  ~CompiledFilter();
+
+  // prog_main. Null for programs with state or output variables, or taking
+  // parameters, which only run in batches.
+  RowFn rowFn = nullptr;
+  BatchFn batchFn = nullptr;  // prog_main_batch
+  // The state variables, in the order of their slots.
+  std::vector<StateSlot> state;
+  // The names of the output variables, in the order of their columns.
+  std::vector<std::string> outputs;
+  // The parameters the batch entry point takes values for, in order. Empty if
+  // the filter is specialized.
+  std::vector<ParamSlot> params;
+  // Whether the program's parameters are constants.
+  bool specialized = false;
+  llvm::orc::KaleidoscopeJIT* jit = nullptr;
+  // The modules holding the program's code.
+  std::vector<llvm::orc::KaleidoscopeJIT::ModuleHandleT> modules;
+  // How the compilation went.
+  CompileStats stats;
+  // The profile the filter's code counts into, if it's instrumented. Shared
+  // with whoever reads it; the code increments it until it's been removed.
+  std::shared_ptr<FilterProfile> profile;
+
+  // initState sets state, state.size() slots, to the starting value of every
+  // variable.
+  void initState(int64_t* state) const;
+  // mergeState combines the state of another thread, from, into into.
+  void mergeState(int64_t* into, const int64_t* from) const;
+  // checkParams returns true if values are values for params. Otherwise it
+  // reports why not.
+  bool checkParams(const ParamValues& values) const;
+};
+
+// ParamArgs lays out values as the params argument of a batch entry point: an
+// int64_t per parameter, the value of an int64 one or the address of the bytes
+// of a byte_ptr one. They point into values, which need to stay as they are
+// while the arguments are used.
+std::vector<int64_t> ParamArgs(const ParamValues& values);
+
+// CompileFilter runs prog through its own CompilerSession and resolves the
+// program's entry points, lowering the conditions according to
+// predicateMode. If paramValues isn't null, the program is specialized for
+// these values of its parameters. The program goes to the JIT as one module
+// unless compileMode says otherwise. With profileMode, the code is
+// instrumented into profile, or generated with its counts (see
+// ProfileMode). Returns nullptr if the program fails to
+// compile or doesn't define prog_main (or prog_main_batch, for programs with
+// state, outputs or parameters); in that case whatever modules were added for
+// prog have been removed again. It can be called from several threads at
+// once.
+std::shared_ptr<const CompiledFilter> CompileFilter(
+    llvm::orc::KaleidoscopeJIT& jit, const std::string& prog,
+    PredicateMode predicateMode = pred_branching,
+    const ParamValues* paramValues = nullptr,
+    CompileMode compileMode = compile_whole_program,
+    ProfileMode profileMode = profile_none,
+    std::shared_ptr<FilterProfile> profile = nullptr);
+
+// BoundFilter is a filter to run with some values of its program's
+// parameters, as returned by FilterCache::Bind.
+struct BoundFilter {
+  std::shared_ptr<const CompiledFilter> filter;
+  // The values, if filter isn't specialized for them.
+  std::shared_ptr<const ParamValues> values;
+  // The params argument of filter's batch entry point, pointing into values.
+  std::vector<int64_t> args;
+
+  const int64_t* params() const {
+    return args.empty() ? nullptr : args.data();
+  }
+};
+
+// FilterCache maps program sources to their compiled filters, so that running
+// a program that's been seen before doesn't go through the lexer, parser,
+// codegen and JIT again. Programs are keyed by their normalized text (see
+// NormalizeProgram) and the PredicateMode they're compiled with. The cache
+// holds at most capacity programs, whose code and data take at most
+// codeBudget bytes of the JIT's memory (0 means no limit, for either); the
+// least recently used ones are evicted. An evicted filter's memory is
+// reclaimed once nobody holds on to it anymore; the budget only counts the
+// filters in the cache.
+//
+// Programs need to be self contained: one program calling functions defined
+// by another one would break once the other one is evicted.
+//
+// Programs with parameters are query templates: they're compiled once, for
+// any values, and every set of values used hotParamUses times is specialized
+// on a background thread. The specialized filters are cached next to the
+// others, keyed by the program and the values (0 means never specializing).
+//
+// The cache is thread safe. Misses are compiled outside of its lock, so
+// different programs get compiled in parallel.
+class FilterCache {
+public:
+  FilterCache(llvm::orc::KaleidoscopeJIT& jit, size_t capacity,
+              uint64_t hotParamUses = 8, uint64_t codeBudget = 0)
+    : jit(jit), capacity(capacity), codeBudget(codeBudget),
+      hotParamUses(hotParamUses) {}
+  // Drops the specializations that haven't started and waits for the one in
+  // progress, if any.
+  ~FilterCache();
+  FilterCache(const FilterCache&) = delete;
+  FilterCache& operator=(const FilterCache&) = delete;
+
+  // Get returns the compiled filter for prog, compiling it on a miss. Returns
+  // nullptr if the program fails to compile or doesn't define prog_main. The
+  // filter's code stays valid as long as the caller holds on to it, even if
+  // it's evicted in the meantime. A program with parameters is compiled for
+  // any values.
+  std::shared_ptr<const CompiledFilter> Get(
+      const std::string& prog, PredicateMode predicateMode = pred_branching);
+  // Bind returns the filter to run prog with values of its parameters: the
+  // specialization for values, if there's one by now, or else the filter Get
+  // returns with the arguments for values. Returns a null filter if the
+  // program fails to compile or values don't fit its parameters.
+  BoundFilter Bind(const std::string& prog, const ParamValues& values,
+                   PredicateMode predicateMode = pred_branching);
+  // WaitForSpecializations waits until the specializations Bind has started
+  // so far are in the cache (or have failed).
+  void WaitForSpecializations();
+
+  size_t size() const;
+  // The memory taken by the code and data of the cached filters (see
+  // CompileStats::memoryBytes).
+  uint64_t memoryBytes() const;
+  uint64_t hits() const { return numHits; }
+  uint64_t misses() const { return numMisses; }
+  uint64_t specializations() const { return numSpecializations; }
+  // The stats of all the compilations of the programs that missed, and of the
+  // specializations, added up.
+  CompileStats stats() const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const CompiledFilter> filter;
+  };
+  using LRUList = std::list<Entry>;
+  // A parameter set to specialize a program for.
+  struct Specialization {
+    std::string key;
+    std::string prog;
+    ParamValues values;
+    PredicateMode predicateMode;
+  };
+
+  // get is Get for the program's key.
+  std::shared_ptr<const CompiledFilter> get(
+      const std::string& key, const std::string& prog,
+      PredicateMode predicateMode);
+  // insertLocked adds filter under key, unless there's a filter for key
+  // already, and returns the one in the cache. mu needs to be held.
+  std::shared_ptr<const CompiledFilter> insertLocked(
+      const std::string& key, std::shared_ptr<const CompiledFilter> filter);
+  // specializerLoop compiles the queued specializations, until the cache
+  // is destroyed.
+  void specializerLoop();
+
+  llvm::orc::KaleidoscopeJIT& jit;
+  const size_t capacity;
+  const uint64_t codeBudget;
+  // Guards lru, index and cachedBytes.
+  mutable std::mutex mu;
+  // Most recently used first.
+  LRUList lru;
+  std::unordered_map<std::string, LRUList::iterator> index;
+  // The memoryBytes of the filters in lru.
+  uint64_t cachedBytes = 0;
+  // Guarded by mu.
+  CompileStats totalStats;
+  std::atomic<uint64_t> numHits{0};
+  std::atomic<uint64_t> numMisses{0};
+
+  const uint64_t hotParamUses;
+  // The specializer thread, started with the first specialization, and its
+  // queue. All guarded by mu.
+  std::thread specializer;
+  std::deque<Specialization> pendingSpecializations;
+  // Whether the specializer is compiling one of them.
+  bool specializing = false;
+  bool stopping = false;
+  // Signaled when a specialization is queued, and when stopping.
+  std::condition_variable specializationQueued;
+  // Signaled when the specializer is done with a specialization.
+  std::condition_variable specializationDone;
+  // How many times each parameter set (by specialization key) has been bound,
+  // until its specialization is queued, or queuedParamUses from then on until
+  // it's cached. Guarded by mu.
+  std::unordered_map<std::string, uint64_t> paramUses;
+  std::atomic<uint64_t> numSpecializations{0};
+};
+
+// NormalizeProgram strips comments and collapses whitespace outside of string
+// literals, so that programs differing only in formatting share a cache
+// entry.
+std::string NormalizeProgram(const std::string& prog);
+
+#endif
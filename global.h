@@ -3,19 +3,11 @@
 
 #include <memory>
 
-#include "llvm/IR/Module.h"
-#include "llvm/IR/LegacyPassManager.h"
-
 #include "kaleidoscpe_jit.h"
 
-class PrototypeAST;
-
-extern std::unique_ptr<llvm::Module> TheModule;
-extern llvm::LLVMContext TheContext;
-extern std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+// TheJIT is the process wide JIT, set up by InitLLVM. It's thread safe and
+// shared by all the compilations; everything else about a compilation lives
+// in its CompilerSession.
 extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-
-void ResetModule();
 
 #endif
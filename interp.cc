@@ -0,0 +1,683 @@
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "builtin.h"
+#include "diag.h"
+#include "interp.h"
+#include "schema.h"
+
+using std::string;
+using std::vector;
+
+/// logErrorI - Error helper for the interpreter; returns false.
+static bool logErrorI(const string& str) {
+  Diag(diag_error, "interpreter error: %s", str.c_str());
+  return false;
+}
+
+RtValue RtValue::Zero(VarType type) {
+  RtValue v;
+  v.type = type;
+  v.p = nullptr;
+  v.i = 0;
+  v.d = 0;
+  return v;
+}
+
+RtValue RtValue::Double(double d) {
+  RtValue v = Zero(type_double);
+  v.d = d;
+  return v;
+}
+
+RtValue RtValue::Byte(char b) {
+  RtValue v = Zero(type_byte);
+  v.b = b;
+  return v;
+}
+
+RtValue RtValue::Bool(bool c) {
+  RtValue v = Zero(type_bool);
+  v.c = c;
+  return v;
+}
+
+RtValue RtValue::BytePtr(char* p) {
+  RtValue v = Zero(type_byte_ptr);
+  v.p = p;
+  return v;
+}
+
+RtValue RtValue::Int64(int64_t i) {
+  RtValue v = Zero(type_int64);
+  v.i = i;
+  return v;
+}
+
+bool RtValue::isTrue() const {
+  switch (type) {
+  case type_double:
+    return d != 0;
+  case type_byte:
+    return b != 0;
+  case type_bool:
+    return c;
+  case type_byte_ptr:
+    return p != nullptr;
+  case type_int64:
+    return i != 0;
+  }
+  return false;
+}
+
+bool RtValue::convertTo(VarType to) {
+  if (type == to) {
+    return true;
+  }
+  if (type == type_byte && to == type_int64) {
+    *this = Int64(b);
+    return true;
+  }
+  return false;
+}
+
+//===----------------------------------------------------------------------===//
+// Host builtins
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+struct NativeBuiltin {
+  VarType retType;
+  vector<VarType> argTypes;
+  std::function<RtValue(const vector<RtValue>& args)> call;
+};
+
+const std::map<llvm::StringRef, NativeBuiltin>& nativeBuiltins() {
+  static const std::map<llvm::StringRef, NativeBuiltin> res = {
+    {"putchard", {type_double, {type_double},
+      [](const vector<RtValue>& a) {
+        return RtValue::Double(putchard(a[0].d));
+      }}},
+    {"skip_checksum", {type_byte_ptr, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_checksum(a[0].p));
+      }}},
+    {"skip_bytes", {type_byte_ptr, {type_byte_ptr, type_byte},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_bytes(a[0].p, a[1].b));
+      }}},
+    {"skip_byte", {type_byte_ptr, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_byte(a[0].p));
+      }}},
+    {"skip_int", {type_byte_ptr, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_int(a[0].p));
+      }}},
+    {"skip_cols", {type_byte_ptr, {type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_cols(a[0].p, a[1].i));
+      }}},
+    {"my_strcmp", {type_byte, {type_byte_ptr, type_byte, type_byte_ptr, type_byte},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(my_strcmp(a[0].p, a[1].b, a[2].p, a[3].b));
+      }}},
+    {"streq", {type_byte, {type_byte_ptr, type_byte, type_byte_ptr, type_byte},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(streq(a[0].p, a[1].b, a[2].p, a[3].b));
+      }}},
+    {"bytes_eq", {type_byte,
+      {type_byte_ptr, type_int64, type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(bytes_eq(a[0].p, a[1].i, a[2].p, a[3].i));
+      }}},
+    {"bytes_cmp", {type_byte,
+      {type_byte_ptr, type_int64, type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(bytes_cmp(a[0].p, a[1].i, a[2].p, a[3].i));
+      }}},
+    {"bytes_prefix", {type_byte,
+      {type_byte_ptr, type_int64, type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(bytes_prefix(a[0].p, a[1].i, a[2].p, a[3].i));
+      }}},
+    {"bytes_contains", {type_byte,
+      {type_byte_ptr, type_int64, type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::Byte(bytes_contains(a[0].p, a[1].i, a[2].p, a[3].i));
+      }}},
+    {"decode_int", {type_int64, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::Int64(decode_int(a[0].p));
+      }}},
+    {"decode_decimal", {type_int64, {type_byte_ptr, type_int64},
+      [](const vector<RtValue>& a) {
+        return RtValue::Int64(decode_decimal(a[0].p, a[1].i));
+      }}},
+    {"decode_bytes_len", {type_int64, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::Int64(decode_bytes_len(a[0].p));
+      }}},
+    {"decode_bytes_data", {type_byte_ptr, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(decode_bytes_data(a[0].p));
+      }}},
+    {"skip_len_prefixed", {type_byte_ptr, {type_byte_ptr},
+      [](const vector<RtValue>& a) {
+        return RtValue::BytePtr(skip_len_prefixed(a[0].p));
+      }}},
+  };
+  return res;
+}
+
+}  // namespace
+
+//===----------------------------------------------------------------------===//
+// InterpProgram and Interpreter
+//===----------------------------------------------------------------------===//
+
+InterpProgram::InterpProgram(const ParsedProgram& prog) {
+  for (const auto& f : prog.functions) {
+    functions[f->getProto().getName()] = f;
+  }
+  for (const auto& p : prog.externs) {
+    externs[p->getName()] = p;
+  }
+  for (const auto& s : prog.schemas) {
+    schemas[s->getName()] = s;
+  }
+}
+
+const FunctionAST* InterpProgram::getFunction(llvm::StringRef name) const {
+  auto it = functions.find(name);
+  return it == functions.end() ? nullptr : it->second;
+}
+
+const PrototypeAST* InterpProgram::getExtern(llvm::StringRef name) const {
+  auto it = externs.find(name);
+  return it == externs.end() ? nullptr : it->second;
+}
+
+const SchemaAST* InterpProgram::getSchema(llvm::StringRef name) const {
+  auto it = schemas.find(name);
+  return it == schemas.end() ? nullptr : it->second;
+}
+
+const SchemaAST* InterpProgram::getOnlySchema() const {
+  return schemas.size() == 1 ? schemas.begin()->second : nullptr;
+}
+
+RtValue* Interpreter::lookupVar(llvm::StringRef name) {
+  auto it = frame->find(name);
+  if (it == frame->end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void Interpreter::setVar(llvm::StringRef name, RtValue val) {
+  (*frame)[name] = val;
+}
+
+void Interpreter::eraseVar(llvm::StringRef name) {
+  frame->erase(name);
+}
+
+bool Interpreter::Call(
+    llvm::StringRef name, vector<RtValue> args, RtValue* res) {
+  const PrototypeAST* proto = nullptr;
+  const FunctionAST* fun = prog.getFunction(name);
+  if (fun != nullptr) {
+    proto = &fun->getProto();
+  } else {
+    proto = prog.getExtern(name);
+  }
+  if (proto == nullptr) {
+    return callSchemaFunction(name, args, res);
+  }
+  llvm::ArrayRef<llvm::StringRef> argNames = proto->getArgNames();
+  if (argNames.size() != args.size()) {
+    return logErrorI("incorrect # arguments passed to " + name.str());
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!args[i].convertTo(proto->getArgType(i))) {
+      return logErrorI("argument type mismatch in call to " + name.str());
+    }
+  }
+
+  if (fun == nullptr) {
+    // An extern; run the host builtin.
+    auto it = nativeBuiltins().find(name);
+    if (it == nativeBuiltins().end()) {
+      return logErrorI("extern not available in the interpreter: " + name.str());
+    }
+    const NativeBuiltin& builtin = it->second;
+    if (builtin.retType != proto->getRetType() ||
+        builtin.argTypes.size() != args.size()) {
+      return logErrorI("extern declared with the wrong signature: " + name.str());
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+      if (builtin.argTypes[i] != args[i].type) {
+        return logErrorI("extern declared with the wrong signature: " + name.str());
+      }
+    }
+    *res = builtin.call(args);
+    return true;
+  }
+
+  std::map<llvm::StringRef, RtValue> callFrame;
+  for (size_t i = 0; i < args.size(); i++) {
+    callFrame[argNames[i]] = args[i];
+  }
+  std::map<llvm::StringRef, RtValue>* callerFrame = frame;
+  frame = &callFrame;
+  ExecRes bodyRes = fun->getBody().exec(*this);
+  frame = callerFrame;
+  if (!bodyRes.success) {
+    return false;
+  }
+  if (!bodyRes.ret) {
+    // Falling off the end of the function.
+    *res = RtValue::Zero(proto->getRetType());
+    return true;
+  }
+  if (!bodyRes.val.convertTo(proto->getRetType())) {
+    return logErrorI("return type mismatch in " + name.str());
+  }
+  *res = bodyRes.val;
+  return true;
+}
+
+bool Interpreter::callSchemaFunction(
+    llvm::StringRef name, vector<RtValue>& args, RtValue* res) {
+  string schemaName;
+  SchemaFunction fn;
+  const SchemaAST* schema = nullptr;
+  if (ParseSchemaFunctionName(name, &schemaName, &fn)) {
+    schema = prog.getSchema(schemaName);
+  }
+  if (schema == nullptr) {
+    return logErrorI("unknown function referenced: " + name.str());
+  }
+  vector<VarType> argTypes;
+  switch (fn) {
+  case schema_col:
+    argTypes = {type_byte_ptr, type_int64};
+    break;
+  case schema_index:
+    argTypes = {type_byte_ptr, type_byte_ptr};
+    break;
+  case schema_col_at:
+    argTypes = {type_byte_ptr, type_byte_ptr, type_int64};
+    break;
+  }
+  if (argTypes.size() != args.size()) {
+    return logErrorI("incorrect # arguments passed to " + name.str());
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    if (!args[i].convertTo(argTypes[i])) {
+      return logErrorI("argument type mismatch in call to " + name.str());
+    }
+  }
+  switch (fn) {
+  case schema_col:
+    *res = RtValue::BytePtr(SchemaCol(*schema, args[0].p, args[1].i));
+    break;
+  case schema_index:
+    *res = RtValue::BytePtr(SchemaIndex(*schema, args[0].p, args[1].p));
+    break;
+  case schema_col_at:
+    *res = RtValue::BytePtr(SchemaColAt(args[0].p, args[1].p, args[2].i));
+    break;
+  }
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// AST nodes
+//===----------------------------------------------------------------------===//
+
+ExecRes ExprAST::exec(Interpreter& interp) {
+  RtValue val;
+  if (!eval(interp, &val)) {
+    return ExecRes::Error();
+  }
+  return ExecRes::Done();
+}
+
+bool NumberExprAST::eval(Interpreter&, RtValue* res) {
+  if (isFP) {
+    *res = RtValue::Double(dval);
+  } else if (isInt && isByte()) {
+    *res = RtValue::Byte(char(ival));
+  } else if (isInt) {
+    *res = RtValue::Int64(ival);
+  } else {
+    // The literal lives as long as the AST, like the global codegen emits
+    // lives as long as the module.
+    *res = RtValue::BytePtr(const_cast<char*>(sval.data()));
+  }
+  return true;
+}
+
+bool VariableExprAST::eval(Interpreter& interp, RtValue* res) {
+  RtValue* v = interp.lookupVar(name);
+  if (v == nullptr) {
+    return logErrorI("unknown variable " + name.str());
+  }
+  *res = *v;
+  return true;
+}
+
+bool UnaryExprAST::eval(Interpreter& interp, RtValue* res) {
+  VariableExprAST* varAST = dynamic_cast<VariableExprAST*>(operand);
+  switch (op) {
+  case '&': {
+    if (!varAST) {
+      return logErrorI("address of can only be applied to variables");
+    }
+    RtValue* var = interp.lookupVar(varAST->getName());
+    if (var == nullptr) {
+      return logErrorI("unknown variable: " + varAST->getName().str());
+    }
+    // Where the variable is stored is the address we're looking for.
+    *res = RtValue::BytePtr(&var->b);
+    return true;
+  }
+  case '*': {
+    RtValue ptr;
+    if (!operand->eval(interp, &ptr)) {
+      return false;
+    }
+    if (ptr.type != type_byte_ptr) {
+      return logErrorI("can only dereference pointers");
+    }
+    *res = RtValue::Byte(*ptr.p);
+    return true;
+  }
+  default:
+    return logErrorI(string("unknown unary op: ") + op);
+  }
+}
+
+bool BinaryExprAST::eval(Interpreter& interp, RtValue* res) {
+  // && and || short-circuit, like the generated code does in branching mode.
+  // (In branchless mode, the result is the same.)
+  if (op == tok_and || op == tok_or) {
+    RtValue l;
+    if (!lhs->eval(interp, &l)) {
+      return false;
+    }
+    if (l.isTrue() == (op == tok_or)) {
+      *res = RtValue::Byte(l.isTrue());
+      return true;
+    }
+    RtValue r;
+    if (!rhs->eval(interp, &r)) {
+      return false;
+    }
+    *res = RtValue::Byte(r.isTrue());
+    return true;
+  }
+
+  // The assignment operator is a special case because we don't want to
+  // evaluate the LHS.
+  if (op == '=') {
+    VariableExprAST* varAST = dynamic_cast<VariableExprAST*>(lhs);
+    if (!varAST) {
+      return logErrorI("destination of assignment must be a variable");
+    }
+    RtValue r;
+    if (!rhs->eval(interp, &r)) {
+      return false;
+    }
+    RtValue* var = interp.lookupVar(varAST->getName());
+    if (var == nullptr) {
+      return logErrorI("unknown variable: " + varAST->getName().str());
+    }
+    if (!r.convertTo(var->type)) {
+      return logErrorI("type mismatch in assignment to " + varAST->getName().str());
+    }
+    *var = r;
+    // Return the result of the rhs.
+    *res = r;
+    return true;
+  }
+
+  RtValue l, r;
+  if (!lhs->eval(interp, &l) || !rhs->eval(interp, &r)) {
+    return false;
+  }
+  if (op == '+' && l.type == type_byte_ptr &&
+      (r.type == type_byte || r.type == type_int64)) {
+    *res = RtValue::BytePtr(l.p + (r.type == type_byte ? r.b : r.i));
+    return true;
+  }
+  if (op == tok_eq && l.type == type_byte_ptr && r.type == type_byte_ptr) {
+    *res = RtValue::Byte(l.p == r.p);
+    return true;
+  }
+  // Codegen only does integer arithmetic, on operands of the same type once
+  // bytes are widened.
+  if (l.type == type_int64 || r.type == type_int64) {
+    if (!l.convertTo(type_int64) || !r.convertTo(type_int64)) {
+      return logErrorI("invalid operands for bin op: " + BinOpString(op));
+    }
+    // Wrap around like the generated code does.
+    uint64_t ul = uint64_t(l.i), ur = uint64_t(r.i);
+    switch (op) {
+    case '+':
+      *res = RtValue::Int64(int64_t(ul + ur));
+      return true;
+    case '-':
+      *res = RtValue::Int64(int64_t(ul - ur));
+      return true;
+    case '*':
+      *res = RtValue::Int64(int64_t(ul * ur));
+      return true;
+    case '<':
+      *res = RtValue::Byte(l.i < r.i);
+      return true;
+    case tok_eq:
+      *res = RtValue::Byte(l.i == r.i);
+      return true;
+    default:
+      return logErrorI("invalid bin op: " + BinOpString(op));
+    }
+  }
+  if (l.type != r.type || l.type != type_byte) {
+    return logErrorI("invalid operands for bin op: " + BinOpString(op));
+  }
+  switch (op) {
+  case '+':
+    *res = RtValue::Byte(char(l.b + r.b));
+    return true;
+  case '-':
+    *res = RtValue::Byte(char(l.b - r.b));
+    return true;
+  case '*':
+    *res = RtValue::Byte(char(l.b * r.b));
+    return true;
+  case '<':
+    *res = RtValue::Byte(l.b < r.b);
+    return true;
+  case tok_eq:
+    *res = RtValue::Byte(l.b == r.b);
+    return true;
+  default:
+    return logErrorI("invalid bin op: " + BinOpString(op));
+  }
+}
+
+bool CallExprAST::eval(Interpreter& interp, RtValue* res) {
+  vector<RtValue> argVals;
+  for (ExprAST* a : args) {
+    RtValue v;
+    if (!a->eval(interp, &v)) {
+      return false;
+    }
+    argVals.push_back(v);
+  }
+  return interp.Call(callee, argVals, res);
+}
+
+ExecRes VariableDeclAST::exec(Interpreter& interp) {
+  RtValue initVal = RtValue::Zero(type);
+  if (val) {
+    if (!val->eval(interp, &initVal)) {
+      return ExecRes::Error();
+    }
+    if (!initVal.convertTo(type)) {
+      logErrorI("type mismatch in initialization of " + name.str());
+      return ExecRes::Error();
+    }
+  }
+  interp.setVar(name, initVal);
+  return ExecRes::Done();
+}
+
+ExecRes IfStmtAST::exec(Interpreter& interp) {
+  RtValue cond;
+  if (!condExpr->eval(interp, &cond)) {
+    return ExecRes::Error();
+  }
+  if (cond.isTrue()) {
+    return thenStmt->exec(interp);
+  }
+  return elseStmt->exec(interp);
+}
+
+// Like the generated code, the body of a double loop runs before the end
+// condition is first tested.
+ExecRes ForStmtAST::exec(Interpreter& interp) {
+  if (varType != type_double) {
+    return execInt(interp);
+  }
+  RtValue startVal;
+  if (!start->eval(interp, &startVal)) {
+    return ExecRes::Error();
+  }
+  if (startVal.type != type_double) {
+    logErrorI("for loop variable must be a double: " + varName.str());
+    return ExecRes::Error();
+  }
+
+  // If the loop variable shadows an existing variable, we have to restore it.
+  RtValue* shadowed = interp.lookupVar(varName);
+  bool hadOldVal = shadowed != nullptr;
+  RtValue oldVal = hadOldVal ? *shadowed : RtValue::Zero(type_double);
+  interp.setVar(varName, startVal);
+
+  ExecRes res = ExecRes::Done();
+  while (true) {
+    res = body->exec(interp);
+    if (!res.success || res.ret) {
+      break;
+    }
+    RtValue stepVal, endCond;
+    if (!step->eval(interp, &stepVal)) {
+      res = ExecRes::Error();
+      break;
+    }
+    RtValue* loopVar = interp.lookupVar(varName);
+    if (loopVar == nullptr || stepVal.type != type_double) {
+      logErrorI("for loop step must be a double: " + varName.str());
+      res = ExecRes::Error();
+      break;
+    }
+    loopVar->d += stepVal.d;
+    if (!end->eval(interp, &endCond)) {
+      res = ExecRes::Error();
+      break;
+    }
+    if (!endCond.isTrue()) {
+      break;
+    }
+  }
+
+  if (hadOldVal) {
+    interp.setVar(varName, oldVal);
+  } else {
+    interp.eraseVar(varName);
+  }
+  return res;
+}
+
+// The end condition of an integer loop is tested before every iteration.
+ExecRes ForStmtAST::execInt(Interpreter& interp) {
+  RtValue startVal;
+  if (!start->eval(interp, &startVal)) {
+    return ExecRes::Error();
+  }
+  if (!startVal.convertTo(varType)) {
+    logErrorI("type mismatch in for loop start: " + varName.str());
+    return ExecRes::Error();
+  }
+
+  RtValue* shadowed = interp.lookupVar(varName);
+  bool hadOldVal = shadowed != nullptr;
+  RtValue oldVal = hadOldVal ? *shadowed : RtValue::Zero(varType);
+  interp.setVar(varName, startVal);
+
+  ExecRes res = ExecRes::Done();
+  while (true) {
+    RtValue endCond;
+    if (!end->eval(interp, &endCond)) {
+      res = ExecRes::Error();
+      break;
+    }
+    if (!endCond.isTrue()) {
+      break;
+    }
+    res = body->exec(interp);
+    if (!res.success || res.ret) {
+      break;
+    }
+    RtValue stepVal;
+    if (!step->eval(interp, &stepVal)) {
+      res = ExecRes::Error();
+      break;
+    }
+    RtValue* loopVar = interp.lookupVar(varName);
+    if (loopVar == nullptr || !stepVal.convertTo(varType)) {
+      logErrorI("type mismatch in for loop step: " + varName.str());
+      res = ExecRes::Error();
+      break;
+    }
+    if (varType == type_int64) {
+      loopVar->i = int64_t(uint64_t(loopVar->i) + uint64_t(stepVal.i));
+    } else {
+      loopVar->b = char(loopVar->b + stepVal.b);
+    }
+  }
+
+  if (hadOldVal) {
+    interp.setVar(varName, oldVal);
+  } else {
+    interp.eraseVar(varName);
+  }
+  return res;
+}
+
+ExecRes BlockStmtAST::exec(Interpreter& interp) {
+  for (StatementAST* e : body) {
+    ExecRes stmtRes = e->exec(interp);
+    if (!stmtRes.success || stmtRes.ret) {
+      return stmtRes;
+    }
+  }
+  return ExecRes::Done();
+}
+
+ExecRes ReturnStmtAST::exec(Interpreter& interp) {
+  RtValue retVal;
+  if (!expr->eval(interp, &retVal)) {
+    return ExecRes::Error();
+  }
+  return ExecRes::Return(retVal);
+}
@@ -0,0 +1,115 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+#include "ast.h"
+#include "parser.h"
+
+// The interpreter is a tree walker over the AST. It's the first execution tier
+// (see tiered.h): running a program through it costs nothing to start, as
+// opposed to JIT compiling it.
+//
+// It follows the semantics of the generated code, including its limitations;
+// constructs that codegen rejects are errors here too.
+
+// RtValue is a value in the interpreter.
+struct RtValue {
+  VarType type;
+  // The value is at the start of the union, so that the address of a variable
+  // holding a byte is the address of the byte, like for an alloca.
+  union {
+    double d;   // type_double
+    char b;     // type_byte
+    bool c;     // type_bool
+    char* p;    // type_byte_ptr
+    int64_t i;  // type_int64
+  };
+
+  static RtValue Zero(VarType type);
+  static RtValue Double(double d);
+  static RtValue Byte(char b);
+  static RtValue Bool(bool c);
+  static RtValue BytePtr(char* p);
+  static RtValue Int64(int64_t i);
+
+  // isTrue returns whether the value is non-zero, which is what conditions
+  // test.
+  bool isTrue() const;
+
+  // convertTo implicitly converts the value to type, like codegen does: bytes
+  // widen to int64. Returns false on a type mismatch.
+  bool convertTo(VarType type);
+};
+
+// ExecRes is the result of executing a statement; it's the interpreter's
+// CodegenRes.
+struct ExecRes {
+  bool success, ret;
+  // The returned value, if ret.
+  RtValue val;
+
+  static ExecRes Error() { return ExecRes{false, false, RtValue::Zero(type_byte)}; }
+  static ExecRes Done() { return ExecRes{true, false, RtValue::Zero(type_byte)}; }
+  static ExecRes Return(RtValue val) { return ExecRes{true, true, val}; }
+};
+
+// InterpProgram indexes the functions of a parsed program for the interpreter.
+// It doesn't own the AST; the ParsedProgram needs to outlive it.
+class InterpProgram {
+public:
+  explicit InterpProgram(const ParsedProgram& prog);
+
+  // Returns nullptr if the function isn't defined by the program.
+  const FunctionAST* getFunction(llvm::StringRef name) const;
+  // Returns nullptr if the function isn't declared extern by the program.
+  const PrototypeAST* getExtern(llvm::StringRef name) const;
+  // Returns nullptr if the schema isn't declared by the program.
+  const SchemaAST* getSchema(llvm::StringRef name) const;
+  // The program's schema, if it declares exactly one; that's the one whose
+  // column offsets a prog_main taking them gets. nullptr otherwise.
+  const SchemaAST* getOnlySchema() const;
+
+private:
+  // The names are the AST's own, in the program's arena.
+  std::map<llvm::StringRef, const FunctionAST*> functions;
+  std::map<llvm::StringRef, const PrototypeAST*> externs;
+  std::map<llvm::StringRef, const SchemaAST*> schemas;
+};
+
+// Interpreter runs the functions of an InterpProgram. It's cheap to create and
+// holds the state of one running call, so every thread running a program
+// needs its own.
+class Interpreter {
+public:
+  explicit Interpreter(const InterpProgram& prog) : prog(prog) {}
+
+  // Call runs the named function (defined by the program, declared extern
+  // and implemented by a host builtin, or a function of a declared schema)
+  // with the given arguments. Returns false on error.
+  bool Call(llvm::StringRef name, std::vector<RtValue> args, RtValue* res);
+
+  // The variables of the running function, used by the AST nodes. lookupVar
+  // returns nullptr for unknown variables. setVar declares or overwrites a
+  // variable.
+  RtValue* lookupVar(llvm::StringRef name);
+  void setVar(llvm::StringRef name, RtValue val);
+  void eraseVar(llvm::StringRef name);
+
+private:
+  // callSchemaFunction runs the named schema function, like Call.
+  bool callSchemaFunction(
+      llvm::StringRef name, std::vector<RtValue>& args, RtValue* res);
+
+  const InterpProgram& prog;
+  // The variables of the running function. The map nodes give them stable
+  // addresses, which the & operator hands out. The names are the AST's.
+  std::map<llvm::StringRef, RtValue>* frame = nullptr;
+};
+
+#endif
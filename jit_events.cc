@@ -0,0 +1,66 @@
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Process.h"
+
+#include "jit_events.h"
+
+using llvm::object::SymbolRef;
+
+PerfMapListener::PerfMapListener() {
+  std::string path = "/tmp/perf-" +
+      std::to_string(llvm::sys::Process::getProcessId()) + ".map";
+  file = fopen(path.c_str(), "w");
+}
+
+PerfMapListener::~PerfMapListener() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+void PerfMapListener::NotifyObjectEmitted(
+    const llvm::object::ObjectFile& obj,
+    const llvm::RuntimeDyld::LoadedObjectInfo& info) {
+  if (file == nullptr) {
+    return;
+  }
+  // The object for debuggers has the symbols at the addresses the code was
+  // loaded at.
+  llvm::object::OwningBinary<llvm::object::ObjectFile> debugObj =
+      info.getObjectForDebug(obj);
+  if (debugObj.getBinary() == nullptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mu);
+  for (const auto& symSize :
+       llvm::object::computeSymbolSizes(*debugObj.getBinary())) {
+    const SymbolRef& sym = symSize.first;
+    llvm::Expected<SymbolRef::Type> type = sym.getType();
+    if (!type) {
+      llvm::consumeError(type.takeError());
+      continue;
+    }
+    if (*type != SymbolRef::ST_Function) {
+      continue;
+    }
+    llvm::Expected<llvm::StringRef> name = sym.getName();
+    if (!name) {
+      llvm::consumeError(name.takeError());
+      continue;
+    }
+    llvm::Expected<uint64_t> addr = sym.getAddress();
+    if (!addr) {
+      llvm::consumeError(addr.takeError());
+      continue;
+    }
+    fprintf(file, "%" PRIx64 " %" PRIx64 " %s\n", *addr,
+        uint64_t(symSize.second), name->str().c_str());
+  }
+  // The map needs to be complete even if the process doesn't get to exit.
+  fflush(file);
+}
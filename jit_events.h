@@ -0,0 +1,39 @@
+#ifndef JIT_EVENTS_H
+#define JIT_EVENTS_H
+
+#include <cstdio>
+#include <mutex>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+
+// PerfMapListener is a JITEventListener writing the functions of the objects
+// the JIT links to /tmp/perf-<pid>.map, where perf looks for the symbols of
+// code it can't find in a binary: perf report then shows the JIT'd functions
+// by name. Unlike a jitdump, the map only has the names and addresses, but it
+// takes nothing more than perf itself to use.
+//
+// The map is only appended to. A removed module's functions stay in it; if
+// their memory is reused by a later module, samples in it can be attributed
+// to either.
+//
+// The listener is thread safe.
+class PerfMapListener : public llvm::JITEventListener {
+public:
+  // Opens the map. Nothing is written if it can't be opened.
+  PerfMapListener();
+  ~PerfMapListener() override;
+  PerfMapListener(const PerfMapListener&) = delete;
+  PerfMapListener& operator=(const PerfMapListener&) = delete;
+
+  void NotifyObjectEmitted(
+      const llvm::object::ObjectFile& obj,
+      const llvm::RuntimeDyld::LoadedObjectInfo& info) override;
+
+private:
+  std::mutex mu;
+  FILE* file;
+};
+
+#endif
@@ -14,73 +14,433 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
-#include "llvm/ADT/iterator_range.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "code_memory.h"
+#include "jit_events.h"
+#include "object_cache.h"
 #include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+// KaleidoscopeJIT compiles modules to objects and links them into the process.
+//
+// Modules are compiled off the JIT's lock, with a TargetMachine of their own,
+// so several modules get compiled at once: either by the threads adding them,
+// or by the JIT's compile threads if there are any. In lazy mode, a module
+// isn't compiled until one of its symbols is looked up (directly or by a
+// module referencing it). Programs compiled a module per definition (see
+// CompileMode) only pay for the functions they use.
+//
+// Every module comes with an LLVMContext of its own, which the JIT owns from
+// then on: the module may be compiled on another thread, or much later.
+//
+// Symbols are looked up through an index from names to the modules defining
+// them.
+//
+// The modules' code and data are allocated from the JIT's slabs (see
+// CodeSlabMapper), and accounted per module and in total. A removed module's
+// memory is reclaimed once no module linked against it is left: the JIT
+// counts, for every module, the modules whose references were bound to it
+// when they were linked.
+//
+// The code is generated for the host's CPU and the features it has, unless
+// the JIT is given a CPU (see the constructor).
+//
+// Profilers and debuggers can be told about the code the JIT links, through
+// JITEventListeners (see JITEvents), so that the JIT'd functions show up by
+// name rather than as anonymous addresses. The code can also keep its frame
+// pointers, for profilers to walk the stack through it.
+//
+// The JIT is thread safe: modules can be added, removed and looked up from
+// several threads at once.
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
-  using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
-  using ModuleHandleT = CompileLayerT::ModuleHandleT;
+  using ModuleHandleT = uint64_t;
 
-  KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+  // JITEvents are the listeners the JIT can notify of the objects it links
+  // and frees, as a mask.
+  enum JITEvents : unsigned {
+    NoJITEvents = 0,
+    // /tmp/perf-<pid>.map, for perf (see PerfMapListener).
+    PerfMapEvents = 1 << 0,
+    // A jitdump file, for perf inject, if LLVM was built with perf support.
+    PerfJITDumpEvents = 1 << 1,
+    // GDB's JIT interface.
+    GDBEvents = 1 << 2,
+    // Intel's JIT API, for VTune, if LLVM was built with it.
+    IntelJITEvents = 1 << 3,
+  };
+
+  // If ObjectCacheDir isn't empty, the objects compiled from modules with a
+  // cache key (see SetModuleCacheKey) are cached in that directory. If
+  // NumCompileThreads isn't 0, modules are compiled in the background by that
+  // many threads. If Lazy is set, modules are compiled when they're first
+  // needed instead. Events are the JITEvents to notify of the code; if
+  // FramePointers is set, the code keeps its frame pointers.
+  //
+  // The code is generated for CPU, or for the host's CPU and features if CPU
+  // is empty or "host". Pinning a CPU keeps the code runnable on the other
+  // machines with at least its features, like the oldest one of a fleet.
+  // Features are features to enable or disable on top, like llc's -mattr:
+  // "+avx2,-avx512f".
+  KaleidoscopeJIT(CodeGenOpt::Level OptLevel = CodeGenOpt::Default,
+                  const std::string &ObjectCacheDir = "",
+                  unsigned NumCompileThreads = 0, bool Lazy = false,
+                  unsigned Events = NoJITEvents, bool FramePointers = false,
+                  const std::string &CPU = "",
+                  const std::string &Features = "")
+      : CPU(targetCPU(CPU)), Attrs(targetAttrs(CPU, Features)),
+        TM(buildTargetMachine(OptLevel, this->CPU, Attrs)),
+        DL(TM->createDataLayout()),
+        Lazy(Lazy), FramePointers(FramePointers),
+        ObjCache(ObjectCacheDir.empty()
+                     ? nullptr
+                     : std::make_unique<DiskObjectCache>(ObjectCacheDir,
+                                                         getTargetKey())),
+        ObjectLayer(
+            [this]() {
+              // The layer asks for a memory manager per object, while emit
+              // adds it; emit takes it from LastMemMgr to account for the
+              // module.
+              auto MemMgr =
+                  std::make_shared<TrackingMemoryManager>(&Slabs, &MemTotals);
+              LastMemMgr = MemMgr;
+              return MemMgr;
+            },
+            [this](ObjLayerT::ObjHandleT, const ObjLayerT::ObjectPtr &Obj,
+                   const RuntimeDyld::LoadedObjectInfo &Info) {
+              for (JITEventListener *L : Listeners)
+                L->NotifyObjectEmitted(*Obj->getBinary(), Info);
+            }),
+        CompilePool(NumCompileThreads == 0
+                        ? nullptr
+                        : std::make_unique<ThreadPool>(NumCompileThreads)) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    addListeners(Events);
   }
 
+  // The JIT's own TargetMachine. It's not used for compiling, and it's only to
+  // be used for queries that don't change it, like the data layout;
+  // TargetMachines aren't thread safe. Whoever needs a TargetMachine for
+  // anything else gets their own through createTargetMachine().
   TargetMachine &getTargetMachine() { return *TM; }
 
-  ModuleHandleT addModule(std::unique_ptr<Module> M) {
-    // We need a memory manager to allocate memory and resolve symbols for this
-    // new module. Create one that resolves symbols by looking back into the
-    // JIT.
-    auto Resolver = createLambdaResolver(
-        [&](const std::string &Name) {
-          if (auto Sym = findMangledSymbol(Name))
-            return Sym;
-          return JITSymbol(nullptr);
-        },
-        [](const std::string &S) { return nullptr; });
-    auto H = cantFail(CompileLayer.addModule(std::move(M),
-                                             std::move(Resolver)));
+  // createTargetMachine returns a new TargetMachine, configured like the JIT's.
+  std::unique_ptr<TargetMachine> createTargetMachine() const {
+    return buildTargetMachine(TM->getOptLevel(), CPU, Attrs);
+  }
+
+  // The object cache, or nullptr if objects aren't cached.
+  DiskObjectCache *getObjectCache() { return ObjCache.get(); }
+
+  // getTargetKey identifies the code the TargetMachine generates for a given
+  // module: the target triple, CPU, features and optimization level, and
+  // whether frame pointers are kept. The features being detected, objects
+  // cached on a machine aren't used by the JIT of one with other features.
+  std::string getTargetKey() const {
+    return TM->getTargetTriple().str() + "/" + TM->getTargetCPU().str() + "/" +
+           TM->getTargetFeatureString().str() + "/O" +
+           std::to_string(static_cast<int>(TM->getOptLevel())) +
+           (FramePointers ? "/fp" : "");
+  }
+
+  // getJITEvents returns the JITEvents notified of the code: the ones asked
+  // for that are available.
+  unsigned getJITEvents() const { return Events; }
+
+  // addModule hands M, and Ctx with it, to the JIT. Nobody else can use Ctx
+  // afterwards. Unless the JIT is lazy, M is compiled right away, in the
+  // background if there are compile threads.
+  //
+  // The module's references to symbols it doesn't define are bound to the
+  // definitions in the SearchFirst modules, newest first, if there are any, and
+  // otherwise to the newest definition in the JIT or in the host process. A
+  // compilation passes its own earlier modules as SearchFirst, so that it
+  // doesn't bind to other compilations' definitions.
+  ModuleHandleT addModule(std::unique_ptr<Module> M,
+                          std::unique_ptr<LLVMContext> Ctx,
+                          std::vector<ModuleHandleT> SearchFirst = {}) {
+    auto E = std::make_unique<ModuleEntry>();
+    E->SearchFirst = std::move(SearchFirst);
+    for (const GlobalValue &GV : M->global_values())
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+        E->Symbols.insert(mangle(GV.getName()));
+    // The module keeps its context alive.
+    std::shared_ptr<LLVMContext> SharedCtx(std::move(Ctx));
+    E->M = std::shared_ptr<Module>(M.release(), [SharedCtx](Module *Mod) {
+      delete Mod;
+    });
 
-    ModuleHandles.push_back(H);
+    if (CompilePool) {
+      if (!Lazy) {
+        auto Obj = std::make_shared<std::promise<CompiledObject>>();
+        E->Obj = Obj->get_future().share();
+        std::shared_ptr<Module> PM = std::move(E->M);
+        CompilePool->async([this, Obj, PM]() { Obj->set_value(compile(*PM)); });
+      }
+    } else if (!Lazy) {
+      // Compile on this thread, before taking the lock.
+      std::promise<CompiledObject> Obj;
+      Obj.set_value(compile(*E->M));
+      E->M.reset();
+      E->Obj = Obj.get_future().share();
+    }
+
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    ModuleHandleT H = NextHandle++;
+    for (const auto &Sym : E->Symbols)
+      SymbolIndex[Sym.getKey()].push_back(H);
+    Modules[H] = std::move(E);
     return H;
   }
 
+  // removeModule takes the module's definitions out of the JIT: nothing
+  // binds to them anymore, and H can't be looked up. The module's code and
+  // data stay around as long as modules linked against it do.
   void removeModule(ModuleHandleT H) {
-    ModuleHandles.erase(find(ModuleHandles, H));
-    cantFail(CompileLayer.removeModule(H));
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    auto It = Modules.find(H);
+    assert(It != Modules.end() && "unknown module");
+    ModuleEntry &E = *It->second;
+    assert(!E.Removed && "module removed twice");
+    for (const auto &Sym : E.Symbols) {
+      auto IdxIt = SymbolIndex.find(Sym.getKey());
+      IdxIt->second.erase(find(IdxIt->second, H));
+      if (IdxIt->second.empty())
+        SymbolIndex.erase(IdxIt);
+    }
+    E.Removed = true;
+    if (E.Dependents == 0)
+      release(H);
+  }
+
+  // ModuleStats are the JIT's counters for a module.
+  struct ModuleStats {
+    // Whether the module has been compiled. Lazy modules only are once one
+    // of their symbols is needed, and modules compiled in the background might
+    // not be done yet.
+    bool Compiled = false;
+    // The time the compilation took, on whatever thread it ran.
+    uint64_t CompileNanos = 0;
+    // The size of the object file.
+    uint64_t ObjectBytes = 0;
+    // The memory taken by the module's code and data sections, once it's
+    // been linked.
+    uint64_t CodeBytes = 0;
+    uint64_t DataBytes = 0;
+  };
+
+  ModuleStats getModuleStats(ModuleHandleT H) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    auto It = Modules.find(H);
+    assert(It != Modules.end() && "unknown module");
+    ModuleStats Stats;
+    if (const auto &MemMgr = It->second->MemMgr) {
+      Stats.CodeBytes = MemMgr->codeBytes();
+      Stats.DataBytes = MemMgr->dataBytes();
+    }
+    const std::shared_future<CompiledObject> &Obj = It->second->Obj;
+    if (!Obj.valid() ||
+        Obj.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return Stats;
+    const CompiledObject &C = Obj.get();
+    Stats.Compiled = true;
+    Stats.CompileNanos = C.CompileNanos;
+    if (C.Obj->getBinary())
+      Stats.ObjectBytes = C.Obj->getBinary()->getData().size();
+    return Stats;
+  }
+
+  // MemoryStats are the JIT's counters for the memory of all its modules.
+  struct MemoryStats {
+    // The modules added and not removed, and the removed modules kept for
+    // the modules linked against them.
+    uint64_t Modules = 0;
+    uint64_t RemovedModules = 0;
+    // The memory taken by the linked modules' code and data sections.
+    uint64_t CodeBytes = 0;
+    uint64_t DataBytes = 0;
+    // The memory of the slabs, and the part of it handed to the modules
+    // (their sections, rounded up to pages).
+    uint64_t MappedBytes = 0;
+    uint64_t UsedBytes = 0;
+  };
+
+  MemoryStats getMemoryStats() {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    MemoryStats Stats;
+    for (const auto &KV : Modules) {
+      if (KV.second->Removed)
+        Stats.RemovedModules++;
+      else
+        Stats.Modules++;
+    }
+    Stats.CodeBytes = MemTotals.codeBytes;
+    Stats.DataBytes = MemTotals.dataBytes;
+    Stats.MappedBytes = Slabs.mappedBytes();
+    Stats.UsedBytes = Slabs.usedBytes();
+    return Stats;
   }
 
+  // The symbols returned by findSymbol and findSymbolIn have their address
+  // resolved already: getting the address of a symbol for the first time
+  // links the module defining it, which can't happen outside of the lock.
   JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    return resolved(findMangledSymbol(mangle(Name)));
+  }
+
+  // Like findSymbol, but only looks at the definitions in module H.
+  JITSymbol findSymbolIn(ModuleHandleT H, const std::string Name) {
+    std::lock_guard<std::recursive_mutex> Lock(Mutex);
+    return resolved(findMangledSymbolIn(H, mangle(Name)));
   }
 
 private:
-  std::string mangle(const std::string &Name) {
+  using ObjectPtr = ObjLayerT::ObjectPtr;
+
+  // Not a module handle; NextHandle never gets there.
+  static constexpr ModuleHandleT NoModule = ~ModuleHandleT(0);
+
+  struct CompiledObject {
+    ObjectPtr Obj;
+    uint64_t CompileNanos;
+  };
+
+  struct ModuleEntry {
+    // The module, for lazy modules that haven't been compiled yet.
+    std::shared_ptr<Module> M;
+    // The module's object, once its compilation has started.
+    std::shared_future<CompiledObject> Obj;
+    // Set once the object has been added to the ObjectLayer.
+    Optional<ObjLayerT::ObjHandleT> ObjH;
+    std::vector<ModuleHandleT> SearchFirst;
+    // The (mangled) symbols the module defines.
+    StringSet<> Symbols;
+    // The module's memory manager, once it's been added to the ObjectLayer.
+    std::shared_ptr<TrackingMemoryManager> MemMgr;
+    // The modules the module's references were bound to, and the number of
+    // modules bound to this one, which need it to stay linked.
+    std::vector<ModuleHandleT> LinkedTo;
+    unsigned Dependents = 0;
+    // Set by removeModule, if the module is kept for its dependents.
+    bool Removed = false;
+  };
+
+  // addListeners sets up the listeners for Requested, the JITEvents asked
+  // for. The perf jitdump and GDB listeners are LLVM's singletons; the
+  // others are the JIT's own.
+  void addListeners(unsigned Requested) {
+    if (Requested & PerfMapEvents) {
+      OwnedListeners.push_back(std::make_unique<PerfMapListener>());
+      Listeners.push_back(OwnedListeners.back().get());
+      Events |= PerfMapEvents;
+    }
+    if (Requested & PerfJITDumpEvents) {
+      // Null unless LLVM was built with perf support.
+      if (JITEventListener *L =
+              JITEventListener::createPerfJITEventListener()) {
+        Listeners.push_back(L);
+        Events |= PerfJITDumpEvents;
+      }
+    }
+    if (Requested & GDBEvents) {
+      Listeners.push_back(JITEventListener::createGDBRegistrationListener());
+      Events |= GDBEvents;
+    }
+    if (Requested & IntelJITEvents) {
+      // Null unless LLVM was built with Intel JIT events.
+      if (JITEventListener *L =
+              JITEventListener::createIntelJITEventListener()) {
+        OwnedListeners.emplace_back(L);
+        Listeners.push_back(L);
+        Events |= IntelJITEvents;
+      }
+    }
+  }
+
+  static bool isHostCPU(const std::string &CPU) {
+    return CPU.empty() || CPU == "host";
+  }
+
+  // targetCPU returns the name of the CPU to generate code for.
+  static std::string targetCPU(const std::string &CPU) {
+    return isHostCPU(CPU) ? sys::getHostCPUName().str() : CPU;
+  }
+
+  // targetAttrs returns the features to generate code for, as +/- attributes.
+  // For the host, those are its detected features: the CPU name alone doesn't
+  // tell them when the hardware or the VM disables some. They're sorted, for
+  // the target key not to depend on the order of detection. Features come
+  // last, to override them.
+  static std::vector<std::string> targetAttrs(const std::string &CPU,
+                                              const std::string &Features) {
+    std::vector<std::string> Attrs;
+    StringMap<bool> HostFeatures;
+    if (isHostCPU(CPU) && sys::getHostCPUFeatures(HostFeatures)) {
+      for (const auto &F : HostFeatures)
+        Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+      std::sort(Attrs.begin(), Attrs.end());
+    }
+    SmallVector<StringRef, 8> Extra;
+    StringRef(Features).split(Extra, ',', -1 /* MaxSplit */,
+                              false /* KeepEmpty */);
+    for (StringRef F : Extra)
+      Attrs.push_back(F.str());
+    return Attrs;
+  }
+
+  static std::unique_ptr<TargetMachine>
+  buildTargetMachine(CodeGenOpt::Level OptLevel, const std::string &CPU,
+                     const std::vector<std::string> &Attrs) {
+    return std::unique_ptr<TargetMachine>(EngineBuilder()
+                                              .setOptLevel(OptLevel)
+                                              .setMCPU(CPU)
+                                              .setMAttrs(Attrs)
+                                              .selectTarget());
+  }
+
+  static JITSymbol resolved(JITSymbol Sym) {
+    if (!Sym)
+      return Sym;
+    JITSymbolFlags Flags = Sym.getFlags();
+    return JITSymbol(cantFail(Sym.getAddress()), Flags);
+  }
+
+  std::string mangle(StringRef Name) const {
     std::string MangledName;
     {
       raw_string_ostream MangledNameStream(MangledName);
@@ -89,26 +449,139 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
-#ifdef LLVM_ON_WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
-#else
-    const bool ExportedSymbolsOnly = true;
-#endif
+  // compile generates the object for M. It can run on any thread and doesn't
+  // take the lock.
+  CompiledObject compile(Module &M) {
+    auto Start = std::chrono::steady_clock::now();
+    std::unique_ptr<TargetMachine> CompileTM;
+    {
+      std::lock_guard<std::mutex> Lock(TMPoolMutex);
+      if (!TMPool.empty()) {
+        CompileTM = std::move(TMPool.back());
+        TMPool.pop_back();
+      }
+    }
+    if (!CompileTM)
+      CompileTM = createTargetMachine();
+    if (FramePointers) {
+      // Part of the target key: the module's cache key doesn't cover it.
+      for (Function &F : M)
+        F.addFnAttr("no-frame-pointer-elim", "true");
+    }
+    SimpleCompiler Compile(*CompileTM, ObjCache.get());
+    auto Obj = std::make_shared<SimpleCompiler::CompileResult>(Compile(M));
+    {
+      std::lock_guard<std::mutex> Lock(TMPoolMutex);
+      TMPool.push_back(std::move(CompileTM));
+    }
+    uint64_t Nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - Start)
+                         .count();
+    return CompiledObject{std::move(Obj), Nanos};
+  }
+
+  // release frees removed module H, which nothing is linked against anymore,
+  // and then the removed modules it was linked against that were only kept
+  // for it. Called with the lock held.
+  void release(ModuleHandleT H) {
+    auto It = Modules.find(H);
+    ModuleEntry &E = *It->second;
+    if (E.ObjH) {
+      // The listeners were notified when the object was linked, which it
+      // was by the time it got a handle.
+      for (JITEventListener *L : Listeners)
+        L->NotifyFreeingObject(*E.Obj.get().Obj->getBinary());
+      cantFail(ObjectLayer.removeObject(*E.ObjH));
+    }
+    std::vector<ModuleHandleT> LinkedTo = std::move(E.LinkedTo);
+    // A background compilation still running for the module finishes on its
+    // own; its result is dropped.
+    Modules.erase(It);
+    for (ModuleHandleT D : LinkedTo) {
+      auto DIt = Modules.find(D);
+      if (DIt == Modules.end())
+        continue;
+      ModuleEntry &DE = *DIt->second;
+      if (--DE.Dependents == 0 && DE.Removed)
+        release(D);
+    }
+  }
+
+  // linkedTo records that module H has a reference bound to module D.
+  // Called with the lock held.
+  void linkedTo(ModuleHandleT H, ModuleHandleT D) {
+    if (H == D)
+      return;
+    auto It = Modules.find(H);
+    auto DIt = Modules.find(D);
+    if (It == Modules.end() || DIt == Modules.end())
+      return;
+    std::vector<ModuleHandleT> &LinkedTo = It->second->LinkedTo;
+    if (find(LinkedTo, D) != LinkedTo.end())
+      return;
+    LinkedTo.push_back(D);
+    DIt->second->Dependents++;
+  }
+
+  // emit makes sure the module's object is in the ObjectLayer, compiling it
+  // first if the module is lazy. Called with the lock held.
+  void emit(ModuleHandleT H, ModuleEntry &E) {
+    if (E.ObjH)
+      return;
+    if (!E.Obj.valid()) {
+      std::promise<CompiledObject> Obj;
+      Obj.set_value(compile(*E.M));
+      E.M.reset();
+      E.Obj = Obj.get_future().share();
+    }
+    // We need a memory manager to allocate memory and resolve symbols for this
+    // new module. Create one that resolves symbols by looking back into the
+    // JIT, and keeps the modules it binds to linked.
+    std::vector<ModuleHandleT> SearchFirst = E.SearchFirst;
+    auto Resolver = createLambdaResolver(
+        [this, H, SearchFirst](const std::string &Name) {
+          for (auto D : make_range(SearchFirst.rbegin(), SearchFirst.rend()))
+            if (auto Sym = findMangledSymbolIn(D, Name)) {
+              linkedTo(H, D);
+              return Sym;
+            }
+          ModuleHandleT D = NoModule;
+          if (auto Sym = findMangledSymbol(Name, &D)) {
+            if (D != NoModule)
+              linkedTo(H, D);
+            return Sym;
+          }
+          return JITSymbol(nullptr);
+        },
+        [](const std::string &S) { return nullptr; });
+    E.ObjH = cantFail(ObjectLayer.addObject(E.Obj.get().Obj, std::move(Resolver)));
+    E.MemMgr = std::move(LastMemMgr);
+  }
+
+  JITSymbol findMangledSymbolIn(ModuleHandleT H, const std::string &Name) {
+    auto It = Modules.find(H);
+    if (It == Modules.end() || It->second->Removed ||
+        !It->second->Symbols.count(Name))
+      return nullptr;
+    emit(H, *It->second);
+    return ObjectLayer.findSymbolIn(*It->second->ObjH, Name,
+                                    ExportedSymbolsOnly);
+  }
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleHandles.rbegin(), ModuleHandles.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+  // findMangledSymbol sets Definer, if it isn't null, to the module defining
+  // the symbol it returns, or NoModule for the host process's symbols.
+  JITSymbol findMangledSymbol(const std::string &Name,
+                              ModuleHandleT *Definer = nullptr) {
+    // Bind to the module that defined the symbol last. This is the opposite of
+    // the usual search order for dlsym, but makes more sense in a REPL where
+    // we want to bind to the newest available definition.
+    auto It = SymbolIndex.find(Name);
+    if (It != SymbolIndex.end())
+      if (auto Sym = findMangledSymbolIn(It->second.back(), Name)) {
+        if (Definer)
+          *Definer = It->second.back();
         return Sym;
+      }
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -127,11 +600,56 @@ private:
     return nullptr;
   }
 
+#ifdef LLVM_ON_WIN32
+  // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
+  // flag to decide whether a symbol will be visible or not, when we call
+  // ObjectLinkingLayer::findSymbolIn with ExportedSymbolsOnly set to true.
+  //
+  // But for Windows COFF objects, this flag is currently never set.
+  // For a potential solution see: https://reviews.llvm.org/rL258665
+  // For now, we allow non-exported symbols on Windows as a workaround.
+  static constexpr bool ExportedSymbolsOnly = false;
+#else
+  static constexpr bool ExportedSymbolsOnly = true;
+#endif
+
+  // The CPU and the features the code is generated for, as given to the
+  // TargetMachines.
+  const std::string CPU;
+  const std::vector<std::string> Attrs;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  const bool Lazy;
+  const bool FramePointers;
+  std::unique_ptr<DiskObjectCache> ObjCache;
+  // The listeners notified of the objects the ObjectLayer links, and the
+  // ones the JIT owns among them. Set up by the constructor, and only read
+  // afterwards.
+  std::vector<JITEventListener *> Listeners;
+  std::vector<std::unique_ptr<JITEventListener>> OwnedListeners;
+  unsigned Events = NoJITEvents;
+  // The memory of the modules. Declared before the ObjectLayer, whose memory
+  // managers use them.
+  CodeSlabMapper Slabs;
+  CodeMemoryCounters MemTotals;
   ObjLayerT ObjectLayer;
-  CompileLayerT CompileLayer;
-  std::vector<ModuleHandleT> ModuleHandles;
+  // The memory manager the ObjectLayer created last (see emit). Guarded by
+  // Mutex.
+  std::shared_ptr<TrackingMemoryManager> LastMemMgr;
+  // Guards ObjectLayer, the modules and the index. It's recursive because
+  // linking a module resolves its symbols by calling back into the JIT.
+  std::recursive_mutex Mutex;
+  ModuleHandleT NextHandle = 0;
+  std::unordered_map<ModuleHandleT, std::unique_ptr<ModuleEntry>> Modules;
+  // Symbol name to the modules defining it, oldest first.
+  StringMap<std::vector<ModuleHandleT>> SymbolIndex;
+
+  // TargetMachines for compile(), one per concurrent compilation.
+  std::mutex TMPoolMutex;
+  std::vector<std::unique_ptr<TargetMachine>> TMPool;
+  // Declared last, so that it's destroyed (waiting for the compilations in
+  // flight) before the rest of the JIT.
+  std::unique_ptr<ThreadPool> CompilePool;
 };
 
 } // end namespace orc
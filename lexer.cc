@@ -1,14 +1,17 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSwitch.h"
+
+#include "diag.h"
 #include "lexer.h"
 
 using std::string;
 
-std::string IdentifierStr; // Filled in if tok_identifier
-long int IntVal;           // Filled in if tok_int_literal
-double FPVal;              // Filled in if tok_fp_literal
-std::string StrVal;        // Filled in if tok_str_literal
-
+using llvm::StringRef;
 
 const std::string hexDigits("0123456789ABCDEF");
 
@@ -17,89 +20,100 @@ char hexDigitToNum(char ch) {
   return char(value);
 }
 
-string ConvertHexString(string s) {
-  if (s.length() < 2) return s;
+// ConvertHexString decodes s into *buf if it's a \x hex string and returns the
+// literal's value, which is s itself otherwise.
+StringRef ConvertHexString(StringRef s, string* buf) {
+  if (s.size() < 2) return s;
   if (s[0] == '\\' && s[1] == 'x') {
-    if (s.length() % 2 != 0) {
-      fprintf(stderr, "invalid hex string\n");
+    if (s.size() % 2 != 0) {
+      Diag(diag_error, "invalid hex string");
       return "";
     }
-    string res = "";
-    for (size_t i = 2; i < s.length();) {
+    buf->clear();
+    for (size_t i = 2; i < s.size();) {
       char hi = s[i];
       char lo = s[i+1];
       char c = ((hexDigitToNum(hi) << 4) + hexDigitToNum(lo));
-      res += c;
+      *buf += c;
       i += 2;
     }
-    return res;
+    return *buf;
   }
   return s;
 }
 
-/// gettok - Return the next token from standard input.
-int gettok(std::function<char()> getch) {
-  // static because a previous call may leave a character not consumed.
-  static int lastCh = ' ';
+Lexer::Lexer(std::function<char()> getch) {
+  for (char c = getch(); c != EOF; c = getch()) {
+    owned += c;
+  }
+  cur = owned.data();
+  end = cur + owned.size();
+}
+
+static bool isIdentifierChar(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
 
+/// gettok - Return the next token from the input.
+int Lexer::gettok() {
   // Skip white space.
-  while (isspace(lastCh)) {
-    lastCh = getch();
+  while (cur != end && isspace(static_cast<unsigned char>(*cur))) {
+    cur++;
+  }
+  // Check for end of file.
+  if (cur == end) {
+    return tok_eof;
   }
 
-  if (isalpha(lastCh) || (lastCh == '_')) {  // identifier: [a-zA-Z][a-zA-Z0-9]_*
-    IdentifierStr = lastCh;
-
-    while (isalnum(lastCh = getch()) || (lastCh == '_')) {
-      IdentifierStr += lastCh;
-    }
-    if (IdentifierStr == "def") {
-      return tok_def;
-    }
-    if (IdentifierStr == "extern") {
-      return tok_extern;
-    }
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "return")
-      return tok_return;
-    if (IdentifierStr == "var")
-      return tok_var;
-    // !!! did I get rid of "in"?
-    if (IdentifierStr == "in")
-      return tok_in;
-    return tok_identifier;
+  const char* start = cur;
+  char c = *cur;
+  if (isalpha(static_cast<unsigned char>(c)) || c == '_') {  // identifier: [a-zA-Z][a-zA-Z0-9]_*
+    do {
+      cur++;
+    } while (cur != end && isIdentifierChar(*cur));
+    IdentifierStr = StringRef(start, cur - start);
+    return llvm::StringSwitch<int>(IdentifierStr)
+        .Case("def", tok_def)
+        .Case("extern", tok_extern)
+        .Case("schema", tok_schema)
+        .Case("state", tok_state)
+        .Case("output", tok_output)
+        .Case("param", tok_param)
+        .Case("if", tok_if)
+        .Case("then", tok_then)
+        .Case("else", tok_else)
+        .Case("for", tok_for)
+        .Case("return", tok_return)
+        .Case("var", tok_var)
+        // !!! did I get rid of "in"?
+        .Case("in", tok_in)
+        .Default(tok_identifier);
   }
 
-  if (lastCh == '{') {
-    lastCh = getch();
+  if (c == '{') {
+    cur++;
     return tok_block_open;
   }
-  if (lastCh == '}') {
-    lastCh = getch();
+  if (c == '}') {
+    cur++;
     return tok_block_close;
   }
-  if (lastCh == ';') {
-    lastCh = getch();
+  if (c == ';') {
+    cur++;
     return tok_semi;
   }
 
-  bool found_dec = false;
-  if (isdigit(lastCh) || lastCh == '.') { // Number: [0-9.]+
-    std::string num;
+  if (isdigit(static_cast<unsigned char>(c)) || c == '.') { // Number: [0-9.]+
+    bool found_dec = false;
     do {
-      num += lastCh;
-      lastCh = getch();
-      if (lastCh == '.') {
+      if (*cur == '.') {
         found_dec = true;
       }
-    } while (isdigit(lastCh) || lastCh == '.');
+      cur++;
+    } while (cur != end &&
+             (isdigit(static_cast<unsigned char>(*cur)) || *cur == '.'));
+    // strtod and strtol need a NUL terminated string, which the buffer isn't.
+    llvm::SmallString<32> num(StringRef(start, cur - start));
     if (found_dec) {
       FPVal = strtod(num.c_str(), nullptr /* endptr */);
       return tok_fp_literal;
@@ -110,36 +124,45 @@ int gettok(std::function<char()> getch) {
   }
 
   // parse a string literal
-  if (lastCh == '"') {
-    lastCh = getch();
-    std::string lit;
-    while (lastCh != '"') {
-      lit += lastCh;
-      lastCh = getch();
+  if (c == '"') {
+    cur++;  // eat the opening "
+    start = cur;
+    while (cur != end && *cur != '"') {
+      cur++;
+    }
+    StringRef lit(start, cur - start);
+    if (cur != end) {
+      cur++;  // eat the closing "
     }
-    lastCh = getch(); // eat the closing "
-    StrVal = ConvertHexString(lit);
+    StrVal = ConvertHexString(lit, &hexBuf);
     return tok_str_literal;
   }
-  
-  if (lastCh == '#') {
-    // Comment until end of line.
-    do {
-      lastCh = getch();
-    } while (lastCh != EOF && lastCh != '\n' && lastCh != '\r');
-    if (lastCh != EOF) {
-      return gettok(getch);
+
+  if (cur + 1 != end) {
+    char next = cur[1];
+    int op = 0;
+    if (c == '&' && next == '&') {
+      op = tok_and;
+    } else if (c == '|' && next == '|') {
+      op = tok_or;
+    } else if (c == '=' && next == '=') {
+      op = tok_eq;
+    }
+    if (op != 0) {
+      cur += 2;
+      return op;
     }
   }
-  
-  // Check for end of file. Don't eat the EOF.
-  if (lastCh == EOF) {
-    return tok_eof;
+
+  if (c == '#') {
+    // Comment until end of line.
+    while (cur != end && *cur != '\n' && *cur != '\r') {
+      cur++;
+    }
+    return gettok();
   }
 
   // Otherwise, just return the character as its ascii value.
-  int thisCh = lastCh;
-  lastCh = getch();
-  return thisCh;
+  cur++;
+  return static_cast<unsigned char>(c);
 }
-
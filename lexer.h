@@ -4,6 +4,8 @@
 #include <functional>
 #include <string>
 
+#include "llvm/ADT/StringRef.h"
+
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things.
 enum Token {
@@ -12,6 +14,10 @@ enum Token {
   // commands
   tok_def = -2,
   tok_extern = -3,
+  tok_schema = -18,
+  tok_state = -22,
+  tok_output = -23,
+  tok_param = -24,
 
   // primary
   tok_identifier = -4,
@@ -31,16 +37,48 @@ enum Token {
   tok_return = -14,
 
   // variable definition
-  tok_var = -15
+  tok_var = -15,
+
+  // operators of more than one character
+  tok_and = -19,  // &&
+  tok_or = -20,   // ||
+  tok_eq = -21,   // ==
 };
 
+// Lexer splits its input into tokens. Every compilation has its own.
+//
+// The lexer works over a buffer holding the whole program and doesn't copy
+// it: the text of the identifier and string literal tokens points into the
+// buffer (the parser interns what it keeps, see ASTArena).
+class Lexer {
+public:
+  // Lexes buf, which needs to outlive the lexer.
+  explicit Lexer(llvm::StringRef buf) : cur(buf.begin()), end(buf.end()) {}
+  // Lexing a temporary would leave the tokens dangling.
+  explicit Lexer(std::string&& buf) = delete;
+  // Lexes the characters returned by getch, until it returns EOF. They're
+  // all read, into a buffer of the lexer's own, before the first token.
+  explicit Lexer(std::function<char()> getch);
+  Lexer(const Lexer&) = delete;
+  Lexer& operator=(const Lexer&) = delete;
 
-/// gettok - Return the next token from standard input.
-int gettok(std::function<char()>);
+  /// gettok - Return the next token from the input.
+  int gettok();
 
-extern std::string IdentifierStr; // Filled in if tok_identifier
-extern long int IntVal;           // Filled in if tok_int_literal
-extern double FPVal;              // Filled in if tok_fp_literal
-extern std::string StrVal;        // Filled in if tok_str_literal
+  // The token values are valid until the next call to gettok.
+  llvm::StringRef IdentifierStr; // Filled in if tok_identifier
+  long int IntVal;               // Filled in if tok_int_literal
+  double FPVal;                  // Filled in if tok_fp_literal
+  llvm::StringRef StrVal;        // Filled in if tok_str_literal
+
+private:
+  // The input, for the getch constructor.
+  std::string owned;
+  // The rest of the input.
+  const char* cur;
+  const char* end;
+  // The decoded hex string literal StrVal points to.
+  std::string hexBuf;
+};
 
 #endif
@@ -1,88 +1,35 @@
-#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
-#include <streambuf>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
-#include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/IR/Verifier.h"
 
-#include "parser.h"
+#include "diag.h"
 #include "global.h"
+#include "compiler_main.h"
+#include "filter_cache.h"
+#include "tiered.h"
 #include "kaleidoscpe_jit.h"
+#include "row_source.h"
+#include "scan.h"
 
 using std::string;
 
-void InitLLVM() {
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
-
-  TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
-
-  ResetModule();
-}
-
-void ResetModule() {
-  // Open a new module.
-  TheModule = std::make_unique<llvm::Module>("my cool jit", TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-  // Create a new pass manager attached to it.
-  TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
-  // Promote allocas to registers.
-  TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(llvm::createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(llvm::createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(llvm::createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(llvm::createCFGSimplificationPass());
-  // !!!
-  TheFPM->add(llvm::createVerifierPass(true /* fatalErrors */));
-
-  TheFPM->doInitialization();
-}
-
-class StringReader {
-private:
-  string prog;
-  size_t idx;
-public:
-  StringReader(const string& prog) : prog(prog), idx(0) {}
-  ~StringReader() {}
-
-  char GetNextChar() {
-    if (idx < prog.length()) {
-      return prog[idx++];
-    }
-    return EOF;
-  }
-};
-
-StringReader* SR;
-
-void CompileStr(const std::string& prog) {
-  // TODO(andrei): sr leaks
-  SR = new StringReader(prog);
-  //auto sr = new StringReader(prog);
-  std::function<char()> nextCh = []() {
-    return SR->GetNextChar();
-  };
-  GetNextChar = nextCh;
-}
-
 string FileToString(const string& path) {
-  std::ifstream t(path);
-  string str((std::istreambuf_iterator<char>(t)),
-              std::istreambuf_iterator<char>());
-  fprintf(stderr, "program: %s\n", str.c_str());
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    fprintf(stderr, "can't read %s: %s\n", path.c_str(), strerror(errno));
+    return "";
+  }
+  std::ostringstream buf;
+  buf << in.rdbuf();
+  string str = buf.str();
+  Diag(diag_ir, "program: %s", str.c_str());
   return str;
 }
 
@@ -109,40 +56,396 @@ std::string hex_to_string(const std::string& input)
     return output;
 }
 
-void RunProgMain() {
-  llvm::JITSymbol exprSymbol = TheJIT->findSymbol("prog_main");
-  assert(exprSymbol && "Function not found");
+// PrintState prints the values of a filter's state variables.
+void PrintState(const CompiledFilter& filter,
+                const std::vector<int64_t>& state) {
+  for (size_t i = 0; i < filter.state.size(); i++) {
+    fprintf(stderr, "  %s = %ld\n", filter.state[i].name.c_str(),
+        (long)state[i]);
+  }
+}
+
+// PrintOutputs prints the output columns of the first few matching rows.
+void PrintOutputs(const CompiledFilter& filter,
+                  const std::vector<std::vector<int64_t>>& columns) {
+  if (filter.outputs.empty()) {
+    return;
+  }
+  const size_t maxRows = 3;
+  for (size_t r = 0; r < maxRows && r < columns[0].size(); r++) {
+    fprintf(stderr, "  row %lu:", (unsigned long)r);
+    for (size_t j = 0; j < filter.outputs.size(); j++) {
+      fprintf(stderr, " %s = %ld", filter.outputs[j].c_str(),
+          (long)columns[j][r]);
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+// ParseParamValues converts the -param flags to values of filter's
+// parameters: an int64 is a number, a byte_ptr the bytes of the flag, or the
+// bytes spelled by hex digits after \x, like in a string literal. Returns
+// false if they don't fit.
+bool ParseParamValues(const CompiledFilter& filter,
+                      const std::vector<string>& flags, ParamValues* values) {
+  if (flags.size() != filter.params.size()) {
+    fprintf(stderr, "the program has %lu parameters, got %lu -param flags\n",
+        (unsigned long)filter.params.size(), (unsigned long)flags.size());
+    return false;
+  }
+  for (size_t i = 0; i < flags.size(); i++) {
+    const string& flag = flags[i];
+    try {
+      if (filter.params[i].type == type_int64) {
+        values->push_back(ParamValue::Int64(std::stoll(flag)));
+      } else if (flag.compare(0, 2, "\\x") == 0) {
+        values->push_back(ParamValue::Bytes(hex_to_string(flag.substr(2))));
+      } else {
+        values->push_back(ParamValue::Bytes(flag));
+      }
+    } catch (const std::exception&) {
+      fprintf(stderr, "bad value for parameter %s: %s\n",
+          filter.params[i].name.c_str(), flag.c_str());
+      return false;
+    }
+  }
+  return true;
+}
 
-  // Get the symbol's address and cast it to the right type (takes no
-  // arguments, returns a double) so we can call it as a native function.
-  // !!! double (*fp)() = (double (*)())(intptr_t)(*exprSymbol.getAddress());
-  // double res = fp();
-  // fprintf(stderr, "Evaluated to: %f\n", res);
-  char (*fp)(const char*,const char*) = (char(*)(const char*, const char*))(intptr_t)(*exprSymbol.getAddress());
-  char* k = (char*)malloc(100);
-  // char* v = (char*)malloc(100);
+// RunProgMain runs the row through filter, and then a batch of copies of it.
+// params are the arguments for the filter's parameters, if it takes them.
+void RunProgMain(const CompiledFilter& filter,
+                 const int64_t* params = nullptr) {
+  const char* k = "";
 
   string hexStr = "87200EEC0A130213ECF81213B47813021504348A06A41505348D204CD71503288904150328890216014E16014F13C095011384950113D29501161144454C4956455220494E20504552534F4E1605545255434B16176567756C617220636F757274732061626F766520746865";
-  char res = fp(k, hex_to_string(hexStr).c_str());
-  fprintf(stderr, "Evaluated to: %d\n", int(res));
+  string row = hex_to_string(hexStr);
+  // Programs with state, outputs or parameters only run in batches.
+  if (filter.rowFn != nullptr) {
+    char res = filter.rowFn(k, row.c_str());
+    fprintf(stderr, "Evaluated to: %d\n", int(res));
+  }
+
+  // Run the same row through the batch entry point, as a scan would.
+  const uint32_t numRows = 1024;
+  std::vector<const char*> keys(numRows, k);
+  std::vector<const char*> vals(numRows, row.c_str());
+  std::vector<uint8_t> bitmap((numRows + 7) / 8);
+  std::vector<int64_t> state(filter.state.size());
+  filter.initState(state.data());
+  std::vector<std::vector<int64_t>> columns(
+      filter.outputs.size(), std::vector<int64_t>(numRows));
+  std::vector<int64_t*> outCols;
+  for (auto& col : columns) {
+    outCols.push_back(col.data());
+  }
+  uint32_t matches = filter.batchFn(
+      keys.data(), vals.data(), numRows, bitmap.data(),
+      state.empty() ? nullptr : state.data(),
+      outCols.empty() ? nullptr : outCols.data(), params);
+  fprintf(stderr, "Batch of %u rows matched %u\n", numRows, matches);
+  PrintState(filter, state);
+  for (auto& col : columns) {
+    col.resize(matches);
+  }
+  PrintOutputs(filter, columns);
 }
 
-int main() {
-  GetNextChar = &getchar;
+// RunScan runs blocks of the row through a ScanExecutor, on all the cores.
+void RunScan(const CompiledFilter& filter, const int64_t* params) {
+  string hexStr = "87200EEC0A130213ECF81213B47813021504348A06A41505348D204CD71503288904150328890216014E16014F13C095011384950113D29501161144454C4956455220494E20504552534F4E1605545255434B16176567756C617220636F757274732061626F766520746865";
+  string row = hex_to_string(hexStr);
+  const uint32_t rowsPerBlock = 1024;
+  const size_t numBlocks = 256;
+  std::vector<const char*> vals(rowsPerBlock, row.c_str());
+  std::vector<RowBlock> blocks(
+      numBlocks, RowBlock{nullptr /* keys */, vals.data(), rowsPerBlock});
+  ScanExecutor executor;
+  ScanResult res =
+      executor.Scan(filter, blocks, true /* wantSelection */, params);
+  fprintf(stderr, "Scan of %lu rows on %u threads matched %lu\n",
+      (unsigned long)(numBlocks * rowsPerBlock), executor.numThreads(),
+      (unsigned long)res.matches);
+  PrintState(filter, res.state);
+  PrintOutputs(filter, res.columns);
+}
 
-  string progStr = FileToString("prog_real.in");
-  CompileStr(progStr);
+// RunRowsFile filters the rows of a file (see RowSource), streaming them
+// through the batch entry point, and then again on all the cores.
+void RunRowsFile(const CompiledFilter& filter, const string& path,
+                 const int64_t* params) {
+  const uint32_t rowsPerBlock = 1024;
+  std::unique_ptr<RowSource> source = RowSource::Open(path);
+  if (source == nullptr) {
+    return;
+  }
+  std::vector<int64_t> state;
+  std::vector<std::vector<int64_t>> columns;
+  uint64_t matches =
+      FilterRows(filter, *source, rowsPerBlock, &state, &columns, params);
+  fprintf(stderr, "Rows of %s matched %lu\n", path.c_str(),
+      (unsigned long)matches);
+  PrintState(filter, state);
+  PrintOutputs(filter, columns);
 
-  InitParser();
-  InitLLVM();
-  
-  MainLoop();
+  source = RowSource::Open(path);
+  std::vector<RowBlockBuffer> buffers;
+  RowBlockBuffer rows;
+  while (source->Next(rowsPerBlock, &rows)) {
+    buffers.push_back(std::move(rows));
+  }
+  std::vector<RowBlock> blocks;
+  for (auto& b : buffers) {
+    blocks.push_back(b.block());
+  }
+  ScanExecutor executor;
+  ScanResult res =
+      executor.Scan(filter, blocks, false /* wantSelection */, params);
+  fprintf(stderr, "Scan of %s on %u threads matched %lu\n", path.c_str(),
+      executor.numThreads(), (unsigned long)res.matches);
+  PrintState(filter, res.state);
+  PrintOutputs(filter, res.columns);
+}
 
-  // Print out all of the generated code.
-  TheModule->print(llvm::errs(), nullptr);
+// RunTiered runs the row through a TieredFilter, which interprets the program
+// until it has seen promoteThreshold rows and then switches to instrumented
+// native code, and to native code compiled with the profile after
+// profileRows more. With printProfile, the profile is printed at the end.
+void RunTiered(const string& progStr, bool printProfile) {
+  const uint64_t promoteThreshold = 1000;
+  const uint64_t profileRows = 2000;
+  std::unique_ptr<TieredFilter> filter = TieredFilter::Create(
+      *TheJIT, progStr, promoteThreshold, profileRows);
+  if (filter == nullptr) {
+    return;
+  }
+  string hexStr = "87200EEC0A130213ECF81213B47813021504348A06A41505348D204CD71503288904150328890216014E16014F13C095011384950113D29501161144454C4956455220494E20504552534F4E1605545255434B16176567756C617220636F757274732061626F766520746865";
+  string row = hex_to_string(hexStr);
+  const uint32_t numRows = 1024;
+  std::vector<const char*> keys(numRows, "");
+  std::vector<const char*> vals(numRows, row.c_str());
+  std::vector<uint8_t> bitmap((numRows + 7) / 8);
+  for (int i = 0; i < 8; i++) {
+    // Check the tier first: it may change while the batch runs.
+    string tier = "interpreted";
+    if (filter->isProfiled()) {
+      tier = "native, profiled";
+    } else if (filter->isCompiled()) {
+      tier = "native, instrumented";
+    }
+    if (filter->isCompiled() && filter->predicateMode() == pred_branchless) {
+      tier += ", branchless";
+    }
+    uint32_t matches = filter->RunBatch(
+        keys.data(), vals.data(), numRows, bitmap.data());
+    fprintf(stderr, "Tiered batch of %u rows matched %u (%s)\n", numRows,
+        matches, tier.c_str());
+  }
+  if (printProfile) {
+    fprintf(stderr, "tiered profile: %s\n",
+        filter->profile()->toJSON().c_str());
+  }
+}
 
-  RunProgMain();
+// CompileParallel compiles the program on several threads at once, each
+// through its own CompilerSession, into the shared JIT.
+void CompileParallel(const string& progStr, const int64_t* params) {
+  const int numThreads = 4;
+  std::vector<std::shared_ptr<const CompiledFilter>> filters(numThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back([&filters, &progStr, i]() {
+      filters[i] = CompileFilter(*TheJIT, progStr);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (const auto& f : filters) {
+    if (f != nullptr) {
+      RunProgMain(*f, params);
+    }
+  }
+}
 
-  return 0;
+// ParseJITEvents parses a comma separated list of the JIT event listeners to
+// register the code with into a mask of KaleidoscopeJIT::JITEvents.
+bool ParseJITEvents(const string& list, unsigned* events) {
+  using llvm::orc::KaleidoscopeJIT;
+  *events = KaleidoscopeJIT::NoJITEvents;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = std::min(list.find(',', start), list.size());
+    string name = list.substr(start, end - start);
+    if (name == "perf-map") {
+      *events |= KaleidoscopeJIT::PerfMapEvents;
+    } else if (name == "jitdump") {
+      *events |= KaleidoscopeJIT::PerfJITDumpEvents;
+    } else if (name == "gdb") {
+      *events |= KaleidoscopeJIT::GDBEvents;
+    } else if (name == "intel") {
+      *events |= KaleidoscopeJIT::IntelJITEvents;
+    } else {
+      fprintf(stderr, "unknown JIT event listener: %s\n", name.c_str());
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
 }
 
+int main(int argc, char** argv) {
+  // -O0 compiles fast for short ad-hoc queries, -O3 optimizes aggressively
+  // for long running scans.
+  unsigned optLevel = 2;
+  // -object-cache-dir=<dir> keeps compiled objects across restarts.
+  string objectCacheDir;
+  const string objectCacheFlag = "-object-cache-dir=";
+  // -compile-threads=<n> compiles modules in the background on n threads.
+  unsigned numCompileThreads = 0;
+  const string compileThreadsFlag = "-compile-threads=";
+  // -lazy only compiles the functions that get used.
+  bool lazy = false;
+  // -jit-events=<listeners> registers the JIT'd code with profilers and
+  // debuggers: a comma separated list of perf-map (for perf report), jitdump
+  // (for perf inject), gdb and intel (for VTune).
+  unsigned jitEvents = 0;
+  const string jitEventsFlag = "-jit-events=";
+  // -frame-pointers keeps the frame pointers in the JIT'd code, for
+  // profilers to unwind through it.
+  bool framePointers = false;
+  // -target-cpu=<cpu> generates code for cpu rather than for the host, so
+  // that it runs on every machine with at least cpu's features.
+  string targetCPU;
+  const string targetCPUFlag = "-target-cpu=";
+  // -target-features=<features> enables or disables features of the target,
+  // like "+avx2,-avx512f".
+  string targetFeatures;
+  const string targetFeaturesFlag = "-target-features=";
+  // -v=<n> sets the verbosity of the compiler: 0 only reports errors, 1 what
+  // it's doing, 2 also dumps the program and its IR.
+  const string verbosityFlag = "-v=";
+  // -stats prints the compilation stats as JSON.
+  bool printStats = false;
+  // -branchless compiles the conditions without branches, for predicates
+  // matching about half of the rows.
+  PredicateMode predicateMode = pred_branching;
+  // -rows=<path> is a file of rows to filter, in the format RowSource reads.
+  string rowsPath;
+  const string rowsFlag = "-rows=";
+  // -prog=<path> is the program to run.
+  string progPath = "prog_real.in";
+  const string progFlag = "-prog=";
+  // -code-budget=<bytes> bounds the memory of the filters the cache keeps.
+  uint64_t codeBudget = 0;
+  const string codeBudgetFlag = "-code-budget=";
+  // -param=<value> is the value of the program's next parameter (see
+  // ParseParamValues).
+  std::vector<string> paramFlags;
+  const string paramFlag = "-param=";
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' &&
+        arg[2] >= '0' && arg[2] <= '3') {
+      optLevel = arg[2] - '0';
+    } else if (arg.compare(0, objectCacheFlag.size(), objectCacheFlag) == 0) {
+      objectCacheDir = arg.substr(objectCacheFlag.size());
+    } else if (arg.compare(
+                   0, compileThreadsFlag.size(), compileThreadsFlag) == 0) {
+      numCompileThreads = std::stoul(arg.substr(compileThreadsFlag.size()));
+    } else if (arg == "-lazy") {
+      lazy = true;
+    } else if (arg.compare(0, jitEventsFlag.size(), jitEventsFlag) == 0) {
+      if (!ParseJITEvents(arg.substr(jitEventsFlag.size()), &jitEvents)) {
+        return 1;
+      }
+    } else if (arg == "-frame-pointers") {
+      framePointers = true;
+    } else if (arg.compare(0, targetCPUFlag.size(), targetCPUFlag) == 0) {
+      targetCPU = arg.substr(targetCPUFlag.size());
+    } else if (arg.compare(
+                   0, targetFeaturesFlag.size(), targetFeaturesFlag) == 0) {
+      targetFeatures = arg.substr(targetFeaturesFlag.size());
+    } else if (arg.compare(0, verbosityFlag.size(), verbosityFlag) == 0) {
+      unsigned v = std::stoul(arg.substr(verbosityFlag.size()));
+      SetDiagVerbosity(DiagLevel(std::min(v, unsigned(diag_ir))));
+    } else if (arg == "-stats") {
+      printStats = true;
+    } else if (arg == "-branchless") {
+      predicateMode = pred_branchless;
+    } else if (arg.compare(0, rowsFlag.size(), rowsFlag) == 0) {
+      rowsPath = arg.substr(rowsFlag.size());
+    } else if (arg.compare(0, progFlag.size(), progFlag) == 0) {
+      progPath = arg.substr(progFlag.size());
+    } else if (arg.compare(0, codeBudgetFlag.size(), codeBudgetFlag) == 0) {
+      codeBudget = std::stoull(arg.substr(codeBudgetFlag.size()));
+    } else if (arg.compare(0, paramFlag.size(), paramFlag) == 0) {
+      paramFlags.push_back(arg.substr(paramFlag.size()));
+    } else {
+      fprintf(stderr, "unknown argument: %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  string progStr = FileToString(progPath);
+
+  InitLLVM(optLevel, objectCacheDir, numCompileThreads, lazy, jitEvents,
+           framePointers, targetCPU, targetFeatures);
+  if ((TheJIT->getJITEvents() & jitEvents) != jitEvents) {
+    // jitdump and intel depend on how LLVM was built.
+    fprintf(stderr, "some JIT event listeners are unavailable\n");
+  }
+
+  // Parameter values used twice get specialized.
+  FilterCache cache(
+      *TheJIT, 64 /* capacity */, 2 /* hotParamUses */, codeBudget);
+  std::shared_ptr<const CompiledFilter> filter =
+      cache.Get(progStr, predicateMode);
+  if (filter == nullptr) {
+    return 1;
+  }
+  ParamValues values;
+  if (!ParseParamValues(*filter, paramFlags, &values)) {
+    return 1;
+  }
+  std::vector<int64_t> paramArgs = ParamArgs(values);
+  const int64_t* params = paramArgs.empty() ? nullptr : paramArgs.data();
+  RunProgMain(*filter, params);
+  RunScan(*filter, params);
+  if (!rowsPath.empty()) {
+    RunRowsFile(*filter, rowsPath, params);
+  }
+  if (printStats) {
+    fprintf(stderr, "compile stats: %s\n", filter->stats.toJSON().c_str());
+  }
+
+  // Running the same program again doesn't compile it again. With the same
+  // parameter values, it runs the code specialized for them once it's ready.
+  for (int i = 0; i < 3; i++) {
+    BoundFilter bound = cache.Bind(progStr, values, predicateMode);
+    if (bound.filter == nullptr) {
+      return 1;
+    }
+    if (bound.filter->specialized) {
+      fprintf(stderr, "Running the specialized filter\n");
+    }
+    RunProgMain(*bound.filter, bound.params());
+    cache.WaitForSpecializations();
+  }
+  fprintf(stderr, "filter cache: %lu hits, %lu misses, %lu specializations\n",
+      (unsigned long)cache.hits(), (unsigned long)cache.misses(),
+      (unsigned long)cache.specializations());
+
+  CompileParallel(progStr, params);
+  RunTiered(progStr, printStats);
+  if (printStats) {
+    llvm::orc::KaleidoscopeJIT::MemoryStats m = TheJIT->getMemoryStats();
+    fprintf(stderr, "jit memory: %lu modules (%lu removed, kept linked), "
+        "%lu code bytes, %lu data bytes, %lu of %lu slab bytes used\n",
+        (unsigned long)m.Modules, (unsigned long)m.RemovedModules,
+        (unsigned long)m.CodeBytes, (unsigned long)m.DataBytes,
+        (unsigned long)m.UsedBytes, (unsigned long)m.MappedBytes);
+  }
+
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <cstdio>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "diag.h"
+#include "object_cache.h"
+
+using std::string;
+
+// Prefix of the module identifiers set by SetModuleCacheKey.
+static const char kKeyPrefix[] = "kjit-";
+
+static string md5Hex(llvm::StringRef data) {
+  llvm::MD5 hash;
+  hash.update(data);
+  llvm::MD5::MD5Result res;
+  hash.final(res);
+  llvm::SmallString<32> hex;
+  llvm::MD5::stringifyResult(res, hex);
+  return hex.str();
+}
+
+void SetModuleCacheKey(llvm::Module* m) {
+  string ir;
+  {
+    llvm::raw_string_ostream irStream(ir);
+    m->print(irStream, nullptr /* AAW */);
+  }
+  m->setModuleIdentifier(kKeyPrefix + md5Hex(ir));
+}
+
+DiskObjectCache::DiskObjectCache(string dir, string targetKey)
+  : dir(std::move(dir)), targetKey(std::move(targetKey)) {
+  if (std::error_code ec = llvm::sys::fs::create_directories(this->dir)) {
+    Diag(diag_error, "failed to create object cache dir %s: %s",
+        this->dir.c_str(), ec.message().c_str());
+  }
+}
+
+string DiskObjectCache::objectPath(const llvm::Module& m) const {
+  llvm::StringRef id = m.getModuleIdentifier();
+  if (!id.startswith(kKeyPrefix)) {
+    return "";
+  }
+  llvm::SmallString<256> path(dir);
+  llvm::sys::path::append(path, md5Hex(id.str() + "/" + targetKey) + ".o");
+  return path.str();
+}
+
+void DiskObjectCache::notifyObjectCompiled(
+    const llvm::Module* m, llvm::MemoryBufferRef obj) {
+  string path = objectPath(*m);
+  if (path.empty()) {
+    return;
+  }
+  // Write to a temporary file and rename it into place, so that concurrent
+  // readers (possibly in other processes) never see a partial object.
+  int fd;
+  llvm::SmallString<256> tmpPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmpPath)) {
+    return;
+  }
+  {
+    llvm::raw_fd_ostream os(fd, true /* shouldClose */);
+    os << obj.getBuffer();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tmpPath);
+      return;
+    }
+  }
+  if (llvm::sys::fs::rename(tmpPath, path)) {
+    llvm::sys::fs::remove(tmpPath);
+  }
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::getObject(
+    const llvm::Module* m) {
+  string path = objectPath(*m);
+  if (path.empty()) {
+    return nullptr;
+  }
+  // Large files get mmapped.
+  auto buf = llvm::MemoryBuffer::getFile(
+      path, -1 /* FileSize */, false /* RequiresNullTerminator */);
+  if (!buf) {
+    numMisses++;
+    return nullptr;
+  }
+  numHits++;
+  return std::move(*buf);
+}
+
+bool DiskObjectCache::hasObject(const llvm::Module& m) const {
+  string path = objectPath(m);
+  return !path.empty() && llvm::sys::fs::exists(path);
+}
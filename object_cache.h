@@ -0,0 +1,54 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// DiskObjectCache keeps the object files the JIT emits in a directory, so that
+// a restarted process links the objects it compiled before instead of running
+// codegen again.
+//
+// Only modules whose identifier was set by SetModuleCacheKey are cached. The
+// identifier is a hash of the module's IR; the file an object is stored in is
+// named after that hash and the target key given to the constructor, which
+// needs to identify everything else that determines the generated code (the
+// target triple, CPU, features and the optimization level).
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  DiskObjectCache(std::string dir, std::string targetKey);
+
+  void notifyObjectCompiled(
+      const llvm::Module* m, llvm::MemoryBufferRef obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* m) override;
+
+  // hasObject returns true if there is a cached object for the module. The
+  // caller can then skip the IR optimizations; they don't affect the object
+  // that's going to be linked.
+  bool hasObject(const llvm::Module& m) const;
+
+  uint64_t hits() const { return numHits; }
+  uint64_t misses() const { return numMisses; }
+
+private:
+  // Returns the path of the file caching the module's object, or "" if the
+  // module shouldn't be cached.
+  std::string objectPath(const llvm::Module& m) const;
+
+  std::string dir;
+  std::string targetKey;
+  std::atomic<uint64_t> numHits{0};
+  std::atomic<uint64_t> numMisses{0};
+};
+
+// SetModuleCacheKey sets the module's identifier to a hash of its IR. It needs
+// to be called before the module is optimized, so that the key of a module
+// can be computed without running the optimizations.
+void SetModuleCacheKey(llvm::Module* m);
+
+#endif
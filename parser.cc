@@ -4,38 +4,54 @@
 #include <map>
 #include <set>
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "lexer.h"
 #include "ast.h"
-#include "global.h"
+#include "diag.h"
 
 using std::string;
 using std::unique_ptr;
 using std::vector;
-using std::move;
 
 using llvm::Value;
 
-std::set<char> UnaryOps;
-std::function<char()> GetNextChar;
+// The unary operators.
+static const std::set<char> UnaryOps = {'&', '*'};
+
+// The standard binary operators, by token. 1 is lowest precedence.
+static const std::map<int, int> BinopPrecedence = {
+  {'=', 2},
+  {tok_or, 4},
+  {tok_and, 6},
+  {tok_eq, 8},
+  {'<', 10},
+  {'+', 20},
+  {'-', 20},
+  {'*', 40},  // highest.
+};
+
+Parser::Parser(Lexer& lexer, ASTArena& arena) : lexer(lexer), arena(arena) {
+  // Prime the first token.
+  getNextToken();
+}
 
 // CurTok/getNextToken - Provide a simple token buffer. CurTok is the current
-// token the parser is looking at. getNextToken reads another token from the /
+// token the parser is looking at. getNextToken reads another token from the
 // lexer and updates CurTok with its results.
-int CurTok;
-int getNextToken() {
-  CurTok = gettok(GetNextChar);
+int Parser::getNextToken() {
+  CurTok = lexer.gettok();
   return CurTok;
 }
 
 /// logError* - These are little helper functions for error handling.
-unique_ptr<ExprAST> logError(const char* str) {
-  fprintf(stderr, "logError: %s\n", str);
+ExprAST* logError(const char* str) {
+  Diag(diag_error, "logError: %s", str);
   return nullptr;
 }
 
-unique_ptr<PrototypeAST> logErrorP(const char* str) {
+PrototypeAST* logErrorP(const char* str) {
   logError(str);
   return nullptr;
 }
@@ -46,29 +62,23 @@ Value* logErrorV(const char* str) {
 }
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr(bool fp) {
-  auto res = std::make_unique<NumberExprAST>(); 
-  if (fp) {
-   *res = NumberExprAST::FromFP(FPVal);
-  } else {
-   *res = NumberExprAST::FromInt(IntVal);
-  }
+ExprAST* Parser::ParseNumberExpr(bool fp) {
+  NumberExprAST* res = fp
+      ? arena.New<NumberExprAST>(NumberExprAST::FromFP(lexer.FPVal))
+      : arena.New<NumberExprAST>(NumberExprAST::FromInt(lexer.IntVal));
   getNextToken(); // eat the literal
-  return std::move(res);
+  return res;
 }
 
-static std::unique_ptr<ExprAST> ParseStringLiteral() {
-  auto res = std::make_unique<NumberExprAST>(); 
-  *res = NumberExprAST::FromStr(StrVal);
+ExprAST* Parser::ParseStringLiteral() {
+  NumberExprAST* res = arena.New<NumberExprAST>(
+      NumberExprAST::FromStr(arena.intern(lexer.StrVal)));
   getNextToken(); // eat the literal
-  return std::move(res);
+  return res;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
-static std::unique_ptr<StatementAST> ParseStmt();
-
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprAST* Parser::ParseParenExpr() {
   getNextToken(); // eat '('
   auto ret = ParseExpression();
   if (!ret) {
@@ -84,18 +94,18 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  string id = IdentifierStr;
+ExprAST* Parser::ParseIdentifierExpr() {
+  llvm::StringRef id = arena.intern(lexer.IdentifierStr);
   getNextToken();  // eat the identifier name
 
   // Is this a variable reference?
   if (CurTok != '(') {
-    return std::make_unique<VariableExprAST>(id);
+    return arena.New<VariableExprAST>(id);
   }
 
   // Continue paring a function call.
   getNextToken();  // eat '('
-  vector<unique_ptr<ExprAST>> args;
+  llvm::SmallVector<ExprAST*, 8> args;
   auto first = true;
   while (true) {
     if (CurTok == ')') {
@@ -113,27 +123,30 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     if (arg == nullptr) {
       return nullptr;
     }
-    args.push_back(move(arg));
+    args.push_back(arg);
   }
-  return std::make_unique<CallExprAST>(id, std::move(args));
+  auto* call = arena.New<CallExprAST>(id, arena.copy<ExprAST*>(args));
+  call->callSite = newProfileSite(site_call);
+  return call;
 }
 
 // ifstmt ::= 'if' expression 'then' stmt 'else' stmt
-static std::unique_ptr<StatementAST> ParseIfStmt() {
+StatementAST* Parser::ParseIfStmt() {
   getNextToken(); // eat the if
 
   // parse the condition
-  unique_ptr<ExprAST> cond = ParseExpression();
+  ExprAST* cond = ParseExpression();
   if (!cond) {
     return nullptr;
   }
+  cond->condSite = newProfileSite(site_if);
   
   // parse the then stmt
   if (CurTok != tok_then) {
     return logError("expected then");
   }
   getNextToken();  // eat the then
-  unique_ptr<StatementAST> then = ParseStmt();
+  StatementAST* then = ParseStmt();
   if (!then) {
     return nullptr;
   }
@@ -143,33 +156,49 @@ static std::unique_ptr<StatementAST> ParseIfStmt() {
     return logError("expected else");
   }
   getNextToken();  // eat the else 
-  unique_ptr<StatementAST> elseStmt = ParseStmt();
+  StatementAST* elseStmt = ParseStmt();
   if (!then) {
     return nullptr;
   }
-  auto up = std::make_unique<IfStmtAST>(
-      std::move(cond), std::move(then), std::move(elseStmt));
-  return up;
+  auto* ifStmt = arena.New<IfStmtAST>(cond, then, elseStmt);
+  if (ifStmt->canSelect()) {
+    numBranchlessConds++;
+  }
+  return ifStmt;
 }
 
-/// forstmt ::= 'for' identifier '=' expr ',' expr (',' expr)? stmt
-static unique_ptr<StatementAST> ParseForStmt() {
+/// forstmt ::= 'for' identifier type? '=' expr ',' expr (',' expr)? stmt
+StatementAST* Parser::ParseForStmt() {
   getNextToken();  // eat the "for"
 
   if (CurTok != tok_identifier) {
     return logError("expected identifier after for");
   }
 
-  std::string varName = IdentifierStr;
+  llvm::StringRef varName = arena.intern(lexer.IdentifierStr);
   getNextToken();  // eat identifier.
 
+  // The loop variable is a double, unless it's given a type.
+  VarType varType = type_double;
+  if (CurTok == tok_identifier) {
+    unique_ptr<VarType> type = ParseDataType();
+    if (type == nullptr) {
+      return logError("failed to parse type");
+    }
+    if (*type != type_double && *type != type_byte && *type != type_int64) {
+      return logError("for loop variable must be a double, byte or int64");
+    }
+    varType = *type;
+    getNextToken();  // eat the data type.
+  }
+
   if (CurTok != '=') {
     return logError("expected '=' after for");
   }
   getNextToken();  // eat '='.
 
 
-  unique_ptr<ExprAST> start = ParseExpression();
+  ExprAST* start = ParseExpression();
   if (!start) {
     return nullptr;
   }
@@ -178,42 +207,44 @@ static unique_ptr<StatementAST> ParseForStmt() {
   }
   getNextToken();
 
-  unique_ptr<ExprAST> end = ParseExpression();
+  ExprAST* end = ParseExpression();
   if (!end) {
     return nullptr;
   }
+  end->condSite = newProfileSite(site_loop);
 
   // The step value is optional.
-  std::unique_ptr<ExprAST> step;
+  ExprAST* step;
   if (CurTok == ',') {
     getNextToken();
     step = ParseExpression();
     if (!step) return nullptr;
-  } else {
+  } else if (varType == type_double) {
     // If a step is not specified, the default is 1.0.
-    step = std::make_unique<NumberExprAST>(NumberExprAST::FromFP(1.0));
+    step = arena.New<NumberExprAST>(NumberExprAST::FromFP(1.0));
+  } else {
+    step = arena.New<NumberExprAST>(NumberExprAST::FromInt(1));
   }
 
-  unique_ptr<StatementAST> body = ParseStmt();
+  StatementAST* body = ParseStmt();
   if (!body) return nullptr; 
 
-  return std::make_unique<ForStmtAST>(
-      varName, std::move(start), std::move(end), std::move(step), std::move(body));
+  return arena.New<ForStmtAST>(varName, varType, start, end, step, body);
 }
 
 /// returnStmt ::= 'return' expr
-static unique_ptr<StatementAST> ParseReturnStmt() {
+StatementAST* Parser::ParseReturnStmt() {
   getNextToken();  // eat the "return"
-  std::unique_ptr<ExprAST> expr;
+  ExprAST* expr;
   expr = ParseExpression();
   if (!expr) return nullptr;
-  return std::make_unique<ReturnStmtAST>(std::move(expr));
+  return arena.New<ReturnStmtAST>(expr);
 }
 
 /// blockStmt ::= '{' (expr ';')* '}'
-static unique_ptr<StatementAST> ParseBlockStmt() {
+StatementAST* Parser::ParseBlockStmt() {
   getNextToken();  // eat '{'.
-  std::vector<unique_ptr<StatementAST>> stmts;
+  llvm::SmallVector<StatementAST*, 16> stmts;
   while (true) {
     if (CurTok == tok_semi) {
       getNextToken();  // eat ';'.
@@ -222,43 +253,47 @@ static unique_ptr<StatementAST> ParseBlockStmt() {
       getNextToken();  // eat '}'.
       break;
     }
-    std::unique_ptr<StatementAST> stmt;
+    StatementAST* stmt;
     stmt = ParseStmt();
     if (!stmt) return nullptr;
-    stmts.push_back(std::move(stmt));
+    stmts.push_back(stmt);
   }
-  return std::make_unique<BlockStmtAST>(std::move(stmts));
+  return arena.New<BlockStmtAST>(arena.copy<StatementAST*>(stmts));
 }
 
-static std::unique_ptr<VarType> ParseDataType() {
+std::unique_ptr<VarType> Parser::ParseDataType() {
   if (CurTok != tok_identifier) {
-    fprintf(stderr, "expected type but found token: %d\n", CurTok);
+    Diag(diag_error, "expected type but found token: %d", CurTok);
     return nullptr;
   }
-  if (IdentifierStr == "double") {
+  if (lexer.IdentifierStr == "double") {
     return std::make_unique<VarType>(type_double);
   }
-  if (IdentifierStr == "byte") {
+  if (lexer.IdentifierStr == "byte") {
     return std::make_unique<VarType>(type_byte);
   }
-  if (IdentifierStr == "byte_ptr") {
+  if (lexer.IdentifierStr == "byte_ptr") {
     return std::make_unique<VarType>(type_byte_ptr);
   }
-  fprintf(stderr, "didn't recognize type: %s\n", IdentifierStr.c_str());
+  if (lexer.IdentifierStr == "int64") {
+    return std::make_unique<VarType>(type_int64);
+  }
+  Diag(diag_error, "didn't recognize type: %.*s",
+      int(lexer.IdentifierStr.size()), lexer.IdentifierStr.data());
   return nullptr;
 }
 
 /// ::= 'var' <identifier> <type> ('=' expression)?
-static std::unique_ptr<StatementAST> ParseVariableDeclStmt() {
+StatementAST* Parser::ParseVariableDeclStmt() {
   getNextToken();  // eat the var.
-  string name;
+  llvm::StringRef name;
   // Initial value. Stays null if not specified.
-  unique_ptr<ExprAST> val;
+  ExprAST* val = nullptr;
   
   if (CurTok != tok_identifier) {
     return logError("expected identifier after var");
   }
-  name = IdentifierStr;
+  name = arena.intern(lexer.IdentifierStr);
 
   getNextToken();  // eat the identifier.
 
@@ -276,7 +311,7 @@ static std::unique_ptr<StatementAST> ParseVariableDeclStmt() {
     }
   }
 
-  return std::make_unique<VariableDeclAST>(name, *type, std::move(val));
+  return arena.New<VariableDeclAST>(name, *type, val);
 }
 
 /// primary
@@ -288,7 +323,7 @@ static std::unique_ptr<StatementAST> ParseVariableDeclStmt() {
 //    ::= blockexpr
 //    ::= VariableDeclExpr
 //    ::= returnexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST* Parser::ParsePrimary() {
   switch (CurTok) {
   case tok_identifier:
     return ParseIdentifierExpr();
@@ -307,18 +342,18 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
       getNextToken();  // eat the unary operator
       auto operand = ParsePrimary();
       if (!operand) return nullptr;
-      return std::make_unique<UnaryExprAST>(op, std::move(operand));
+      return arena.New<UnaryExprAST>(op, operand);
     }
   }
 
-  fprintf(stderr, "unknown token when expecting an expression: %d\n", CurTok);
+  Diag(diag_error, "unknown token when expecting an expression: %d", CurTok);
   return logError("unknown token when expecting an expression");
 }
 
-static std::unique_ptr<StatementAST> ParseStmt() {
+StatementAST* Parser::ParseStmt() {
   switch (CurTok) {
   default:
-    fprintf(stderr, "unknown token when expecting an expression: %d\n", CurTok);
+    Diag(diag_error, "unknown token when expecting an expression: %d", CurTok);
     return logError("unknown token when expecting an expression");
   case tok_identifier:
     return ParseExpression();
@@ -341,56 +376,27 @@ static std::unique_ptr<StatementAST> ParseStmt() {
   }
 }
 
-std::map<char, int> BinopPrecedence;
-
-int GetTokPrecedence() {
-  if (!isascii(CurTok)) {
-    // We use a really low precedence so that the token is always rejected by
-    // operator-precedence parsing.
-    return -1;
-  }
-
-    // Make sure it's a declared binop.
-  int tokPrec = BinopPrecedence[CurTok];
-  if (tokPrec <= 0) return -1;
-  return tokPrec;
+int Parser::GetTokPrecedence() {
+  // Make sure it's a declared binop. Other tokens get a really low precedence
+  // so that they're always rejected by operator-precedence parsing.
+  auto it = BinopPrecedence.find(CurTok);
+  if (it == BinopPrecedence.end() || it->second <= 0) return -1;
+  return it->second;
 }
 
-void InitParser() {
-  UnaryOps.insert('&');
-  UnaryOps.insert('*');
-
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;  // highest.
-
-  // Prime the first token.
-  fprintf(stderr, "ready> ");
-  getNextToken();
-}
-
-static unique_ptr<ExprAST> ParseBinOpRHS(
-  int exprPrec,
-  unique_ptr<ExprAST> lhs
-);
-
 /// expression
 ///   ::= primary binoprhs
-static unique_ptr<ExprAST> ParseExpression() {
+ExprAST* Parser::ParseExpression() {
   auto lhs = ParsePrimary();
   if (!lhs) return nullptr;
-  return ParseBinOpRHS(0 /* exprPrec */, std::move(lhs));
+  return ParseBinOpRHS(0 /* exprPrec */, lhs);
 }
 
 /// binoprhs
 ///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(
+ExprAST* Parser::ParseBinOpRHS(
   int exprPrec,
-  unique_ptr<ExprAST> lhs
+  ExprAST* lhs
 ) {
   // Keep consuming binops until we find one whose precedence is too low.
   // lhs keeps growing as lower and lower priority operators are encountered.
@@ -414,20 +420,33 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(
     // the pending operator take RHS as its LHS.
     int nextPrec = GetTokPrecedence();
     if (tokPrec < nextPrec) {
-      rhs = ParseBinOpRHS(tokPrec+1, std::move(rhs));
+      rhs = ParseBinOpRHS(tokPrec+1, rhs);
       if (!rhs) {
         return nullptr;
       }
     }
 
     // Merge lhs/rhs and continue parsing.
-    lhs = std::make_unique<BinaryExprAST>(binOp, std::move(lhs), std::move(rhs));
+    if (binOp == tok_and || binOp == tok_or) {
+      lhs->condSite = newProfileSite(site_logical);
+      rhs->condSite = newProfileSite(site_logical);
+    }
+    auto* binExpr = arena.New<BinaryExprAST>(binOp, lhs, rhs);
+    if (binExpr->canEvaluateBoth()) {
+      numBranchlessConds++;
+    }
+    lhs = binExpr;
   }
 }
 
+int Parser::newProfileSite(ProfileSiteKind kind) {
+  profileSites.push_back(kind);
+  return int(profileSites.size()) - 1;
+}
+
 /// prototype
 ///   ::= <type> id '(' id type* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+PrototypeAST* Parser::ParsePrototype() {
   if (CurTok != tok_identifier) {
     return logErrorP("Expected type in prototype");
   }
@@ -440,7 +459,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     return logErrorP("Expected function name in prototype");
   }
 
-  std::string fnName = IdentifierStr;
+  llvm::StringRef fnName = arena.intern(lexer.IdentifierStr);
   getNextToken();  // eat the function name
 
   if (CurTok != '(') {
@@ -448,8 +467,8 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   }
 
   // Read the list of argument names.
-  std::vector<std::string> argNames;
-  std::vector<VarType> argTypes;
+  llvm::SmallVector<llvm::StringRef, 8> argNames;
+  llvm::SmallVector<VarType, 8> argTypes;
   while (true) {
     int tok = getNextToken();
     if (tok != tok_identifier) {
@@ -465,7 +484,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
       return logErrorP("expected arg name");
     }
 
-    argNames.push_back(IdentifierStr);
+    argNames.push_back(arena.intern(lexer.IdentifierStr));
 
     tok = getNextToken();
     if (tok != ',') {
@@ -479,133 +498,227 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 
   getNextToken();  // eat ')'.
 
-  return std::make_unique<PrototypeAST>(
-      fnName, *type, std::move(argNames), std::move(argTypes));
+  return arena.New<PrototypeAST>(
+      fnName, *type, arena.copy<llvm::StringRef>(argNames),
+      arena.copy<VarType>(argTypes));
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+FunctionAST* Parser::ParseDefinition() {
   getNextToken();  // eat def.
   auto proto = ParsePrototype();
   if (!proto) {
     return nullptr;
   }
   if (auto e = ParseStmt()) {
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
+    return arena.New<FunctionAST>(proto, e);
   }
   return nullptr;
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+PrototypeAST* Parser::ParseExtern() {
   getNextToken();  // eat extern.
   return ParsePrototype();
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto e = ParseExpression()) {
-    // Make an anonymous prototype.
-    auto proto = std::make_unique<PrototypeAST>(
-        "__anon_expr", type_byte, 
-        std::vector<std::string>(), std::vector<VarType>());
-    // Generate a return statement.
-    auto ret = std::make_unique<ReturnStmtAST>(std::move(e));
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(ret));
+/// schema ::= 'schema' identifier '(' column_type (',' column_type)* ')'
+/// column_type ::= 'int' | 'decimal' | 'bytes'
+SchemaAST* Parser::ParseSchema() {
+  getNextToken();  // eat schema.
+  if (CurTok != tok_identifier) {
+    logError("Expected schema name");
+    return nullptr;
+  }
+  llvm::StringRef name = arena.intern(lexer.IdentifierStr);
+  getNextToken();  // eat the name.
+  if (CurTok != '(') {
+    logError("Expected '(' in schema");
+    return nullptr;
   }
-  return nullptr;
-}
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing
-//===----------------------------------------------------------------------===//
-
-static void HandleDefinition() {
-  if (auto fnAST = ParseDefinition()) {
-    if (auto* fnIR = fnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      fnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
-      // Add a module with this function and create a new module for future
-      // code.
-      TheJIT->addModule(std::move(TheModule));
-      ResetModule();
-    }
-  } else {
-    // Skip token for error recovery.
+  llvm::SmallVector<ColumnType, 16> columns;
+  while (true) {
     getNextToken();
+    if (CurTok != tok_identifier) {
+      logError("Expected column type in schema");
+      return nullptr;
+    }
+    if (lexer.IdentifierStr == "int") {
+      columns.push_back(col_int);
+    } else if (lexer.IdentifierStr == "decimal") {
+      columns.push_back(col_decimal);
+    } else if (lexer.IdentifierStr == "bytes") {
+      columns.push_back(col_bytes);
+    } else {
+      Diag(diag_error, "didn't recognize column type: %.*s",
+          int(lexer.IdentifierStr.size()), lexer.IdentifierStr.data());
+      return nullptr;
+    }
+    getNextToken();  // eat the type.
+    if (CurTok != ',') {
+      break;
+    }
   }
+
+  if (CurTok != ')') {
+    logError("Expected ')' in schema");
+    return nullptr;
+  }
+  getNextToken();  // eat ')'.
+  return arena.New<SchemaAST>(name, arena.copy<ColumnType>(columns));
 }
 
-static void HandleExtern() {
-  if (auto protoAST = ParseExtern()) {
-    if (auto* fnIR = protoAST->codegen()) {
-      fprintf(stderr, "Read extern:");
-      fnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
-      // Add the signature to the list of functions.
-      FunctionProtos[protoAST->getName()] = std::move(protoAST);
-    }
+StateAST* Parser::ParseState() {
+  getNextToken();  // eat state.
+  if (CurTok != tok_identifier) {
+    logError("Expected state variable name");
+    return nullptr;
+  }
+  llvm::StringRef name = arena.intern(lexer.IdentifierStr);
+  getNextToken();  // eat the name.
+
+  unique_ptr<VarType> type = ParseDataType();
+  if (type == nullptr) {
+    return nullptr;
+  }
+  if (*type != type_int64) {
+    logError("state variables must be int64");
+    return nullptr;
+  }
+  getNextToken();  // eat the data type.
+
+  if (CurTok != tok_identifier) {
+    logError("Expected merge function (sum, min or max) of state variable");
+    return nullptr;
+  }
+  StateMerge merge;
+  if (lexer.IdentifierStr == "sum") {
+    merge = merge_sum;
+  } else if (lexer.IdentifierStr == "min") {
+    merge = merge_min;
+  } else if (lexer.IdentifierStr == "max") {
+    merge = merge_max;
   } else {
-    // Skip token for error recovery.
-    getNextToken();
+    Diag(diag_error, "didn't recognize merge function: %.*s",
+        int(lexer.IdentifierStr.size()), lexer.IdentifierStr.data());
+    return nullptr;
   }
+  getNextToken();  // eat the merge function.
+  return arena.New<StateAST>(name, *type, merge);
 }
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto fnAST = ParseTopLevelExpr()) {
-    if (auto* fnIR = fnAST->codegen()) {
-      fprintf(stderr, "Read a top-level expr:");
-      fnIR->print(llvm::errs());
-
-      // JIT the module containing the anonymous expression, keeping a handle
-      // so we can free it later.
-      llvm::orc::KaleidoscopeJIT::ModuleHandleT modHandle = TheJIT->addModule(
-          std::move(TheModule));
-      // Prepare for creating a future module.
-      ResetModule();
-
-      llvm::JITSymbol exprSymbol = TheJIT->findSymbol("__anon_expr");
-      assert(exprSymbol && "Function not found");
-
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      // !!! double (*fp)() = (double (*)())(intptr_t)(*exprSymbol.getAddress());
-      // double res = fp();
-      // fprintf(stderr, "Evaluated to: %f\n", res);
-      char (*fp)() = (char(*)())(intptr_t)(*exprSymbol.getAddress());
-      char res = fp();
-      fprintf(stderr, "Evaluated to: %d\n", int(res));
-
-      // Remove the module with the anonymous function.
-      TheJIT->removeModule(modHandle);
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+OutputAST* Parser::ParseOutput() {
+  getNextToken();  // eat output.
+  if (CurTok != tok_identifier) {
+    logError("Expected output variable name");
+    return nullptr;
+  }
+  llvm::StringRef name = arena.intern(lexer.IdentifierStr);
+  getNextToken();  // eat the name.
+
+  unique_ptr<VarType> type = ParseDataType();
+  if (type == nullptr) {
+    return nullptr;
   }
+  if (*type != type_int64) {
+    logError("output variables must be int64");
+    return nullptr;
+  }
+  getNextToken();  // eat the data type.
+  return arena.New<OutputAST>(name, *type);
 }
 
-/// top ::= definition | external | expression | ';'
-void MainLoop() {
-  while (1) {
-    fprintf(stderr, "ready> ");
+ParamAST* Parser::ParseParam() {
+  getNextToken();  // eat param.
+  if (CurTok != tok_identifier) {
+    logError("Expected parameter name");
+    return nullptr;
+  }
+  llvm::StringRef name = arena.intern(lexer.IdentifierStr);
+  getNextToken();  // eat the name.
+
+  unique_ptr<VarType> type = ParseDataType();
+  if (type == nullptr) {
+    return nullptr;
+  }
+  if (*type != type_int64 && *type != type_byte_ptr) {
+    logError("parameters must be int64 or byte_ptr");
+    return nullptr;
+  }
+  getNextToken();  // eat the data type.
+  return arena.New<ParamAST>(name, *type);
+}
+
+/// toplevelexpr ::= expression
+FunctionAST* Parser::ParseTopLevelExpr() {
+  if (auto e = ParseExpression()) {
+    // Make an anonymous prototype.
+    auto* proto = arena.New<PrototypeAST>(
+        "__anon_expr", type_byte,
+        llvm::ArrayRef<llvm::StringRef>(), llvm::ArrayRef<VarType>());
+    // Generate a return statement.
+    auto* ret = arena.New<ReturnStmtAST>(e);
+    return arena.New<FunctionAST>(proto, ret);
+  }
+  return nullptr;
+}
+
+bool Parser::ParseProgram(ParsedProgram* prog) {
+  while (true) {
     switch (CurTok) {
     case tok_eof:
-      return;
+      prog->profileSites = profileSites;
+      prog->numBranchlessConds = numBranchlessConds;
+      return true;
     case tok_semi: // ignore top-level semicolons.
       getNextToken();
       break;
     case tok_def:
-      HandleDefinition();
+      if (auto fnAST = ParseDefinition()) {
+        prog->functions.push_back(fnAST);
+      } else {
+        return false;
+      }
       break;
     case tok_extern:
-      HandleExtern();
+      if (auto protoAST = ParseExtern()) {
+        prog->externs.push_back(protoAST);
+      } else {
+        return false;
+      }
       break;
-    default:
-      HandleTopLevelExpression();
+    case tok_schema:
+      if (auto schemaAST = ParseSchema()) {
+        prog->schemas.push_back(schemaAST);
+      } else {
+        return false;
+      }
       break;
+    case tok_state:
+      if (auto stateAST = ParseState()) {
+        prog->states.push_back(stateAST);
+      } else {
+        return false;
+      }
+      break;
+    case tok_output:
+      if (auto outputAST = ParseOutput()) {
+        prog->outputs.push_back(outputAST);
+      } else {
+        return false;
+      }
+      break;
+    case tok_param:
+      if (auto paramAST = ParseParam()) {
+        prog->params.push_back(paramAST);
+      } else {
+        return false;
+      }
+      break;
+    default:
+      logError("top-level expressions are not supported in programs");
+      return false;
     }
   }
 }
@@ -1,19 +1,112 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <memory>
+#include <vector>
+
 #include "llvm/IR/Value.h"
 
-void InitParser();
-void MainLoop();
-llvm::Value* logErrorV(const char* str);
+#include "ast_arena.h"
+#include "lexer.h"
+#include "profile.h"
 
-extern std::function<char()> GetNextChar;
+class ExprAST;
+class StatementAST;
+class PrototypeAST;
+class FunctionAST;
+class SchemaAST;
+class StateAST;
+class OutputAST;
+class ParamAST;
 
 enum VarType {
   type_double = 0,
   type_byte = 1,
   type_byte_ptr = 2,
   type_bool = 3,
+  type_int64 = 4,
+};
+
+// ParsedProgram is a program's AST, as parsed by ParseProgram. The nodes are
+// in the parser's arena.
+struct ParsedProgram {
+  std::vector<PrototypeAST*> externs;
+  std::vector<FunctionAST*> functions;
+  std::vector<SchemaAST*> schemas;
+  std::vector<StateAST*> states;
+  std::vector<OutputAST*> outputs;
+  std::vector<ParamAST*> params;
+  // The kinds of the AST's profile sites, by number (see ProfileSiteKind).
+  std::vector<ProfileSiteKind> profileSites;
+  // The number of the AST's &&, || and ifs that branchless code evaluates
+  // without branching (see BinaryExprAST::canEvaluateBoth and
+  // IfStmtAST::canSelect).
+  unsigned numBranchlessConds = 0;
 };
 
+// Parser builds ASTs out of the tokens of a Lexer. Every compilation has its
+// own. The ASTs are allocated in arena, which needs to outlive their users.
+class Parser {
+public:
+  // Reads the first token.
+  Parser(Lexer& lexer, ASTArena& arena);
+
+  // The current token, i.e. the one the parser is looking at.
+  int CurTok;
+  int getNextToken();
+
+  /// definition ::= 'def' prototype expression
+  FunctionAST* ParseDefinition();
+  /// external ::= 'extern' prototype
+  PrototypeAST* ParseExtern();
+  /// schema ::= 'schema' identifier '(' column_type (',' column_type)* ')'
+  SchemaAST* ParseSchema();
+  /// state ::= 'state' identifier type ('sum' | 'min' | 'max')
+  StateAST* ParseState();
+  /// output ::= 'output' identifier type
+  OutputAST* ParseOutput();
+  /// param ::= 'param' identifier type
+  ParamAST* ParseParam();
+  /// toplevelexpr ::= expression
+  FunctionAST* ParseTopLevelExpr();
+  // ParseProgram parses the whole input into prog, without generating any
+  // code. The program can only contain definitions, externs, schemas, states,
+  // outputs and params.
+  // Returns false on error.
+  bool ParseProgram(ParsedProgram* prog);
+
+  // The kinds of the profile sites of the ASTs built so far, by number.
+  const std::vector<ProfileSiteKind>& getProfileSites() const {
+    return profileSites;
+  }
+
+private:
+  ExprAST* ParseNumberExpr(bool fp);
+  ExprAST* ParseStringLiteral();
+  ExprAST* ParseParenExpr();
+  ExprAST* ParseIdentifierExpr();
+  StatementAST* ParseIfStmt();
+  StatementAST* ParseForStmt();
+  StatementAST* ParseReturnStmt();
+  StatementAST* ParseBlockStmt();
+  std::unique_ptr<VarType> ParseDataType();
+  StatementAST* ParseVariableDeclStmt();
+  ExprAST* ParsePrimary();
+  StatementAST* ParseStmt();
+  int GetTokPrecedence();
+  ExprAST* ParseExpression();
+  ExprAST* ParseBinOpRHS(
+      int exprPrec, ExprAST* lhs);
+  PrototypeAST* ParsePrototype();
+  // newProfileSite numbers a new profile site of the given kind.
+  int newProfileSite(ProfileSiteKind kind);
+
+  Lexer& lexer;
+  ASTArena& arena;
+  std::vector<ProfileSiteKind> profileSites;
+  unsigned numBranchlessConds = 0;
+};
+
+llvm::Value* logErrorV(const char* str);
+
 #endif
@@ -0,0 +1,53 @@
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "profile.h"
+
+const char* ProfileSiteKindName(ProfileSiteKind kind) {
+  switch (kind) {
+  case site_if:
+    return "if";
+  case site_loop:
+    return "loop";
+  case site_logical:
+    return "logical";
+  case site_call:
+    return "call";
+  }
+  return "unknown";
+}
+
+FilterProfile::FilterProfile(std::vector<ProfileSiteKind> sites)
+  : sites(std::move(sites)),
+    ctrs(new std::atomic<uint64_t>[2 * this->sites.size()]) {
+  for (size_t i = 0; i < 2 * this->sites.size(); i++) {
+    ctrs[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+SiteCounts FilterProfile::counts(unsigned site) const {
+  SiteCounts c;
+  c.entries = ctrs[2 * site].load(std::memory_order_relaxed);
+  c.taken = ctrs[2 * site + 1].load(std::memory_order_relaxed);
+  return c;
+}
+
+std::string FilterProfile::toJSON() const {
+  std::ostringstream s;
+  s << "{\"rows\": " << rows() << ", \"sites\": [";
+  for (unsigned i = 0; i < sites.size(); i++) {
+    if (i > 0) {
+      s << ", ";
+    }
+    SiteCounts c = counts(i);
+    s << "{\"kind\": \"" << ProfileSiteKindName(sites[i])
+      << "\", \"entries\": " << c.entries;
+    if (sites[i] != site_call) {
+      s << ", \"taken\": " << c.taken;
+    }
+    s << "}";
+  }
+  s << "]}";
+  return s.str();
+}
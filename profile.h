@@ -0,0 +1,90 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// ProfileSiteKind is what a profile site counts. The parser numbers the sites
+// as it builds the AST, so two compilations of the same program agree on
+// them: the counts collected by the code of one can be used by the other.
+enum ProfileSiteKind {
+  // The condition of an if.
+  site_if,
+  // The end condition of a loop, tested before every iteration.
+  site_loop,
+  // An operand of && or ||.
+  site_logical,
+  // A function call.
+  site_call,
+};
+
+// ProfileSiteKindName returns the name of kind, as used in the JSON of the
+// profiles.
+const char* ProfileSiteKindName(ProfileSiteKind kind);
+
+// ProfileMode is what a compilation does with a FilterProfile.
+enum ProfileMode {
+  profile_none,
+  // The code counts how many times every condition is tested and how many of
+  // these it's true, and how many times every call is made, into the
+  // profile's counters. The counters are updated with plain (relaxed) loads
+  // and stores rather than locked adds, which would have the scan threads
+  // fight over them: concurrent increments can get lost, and the counts are a
+  // sample.
+  profile_instrument,
+  // The code is generated with the profile's counts: the branches on the
+  // conditions get weights, so that the hot paths are laid out as fall
+  // throughs, the calls never made are cold, and the operands of && and ||
+  // that can be evaluated in either order are tested in the order most
+  // likely to decide the result early. The conditions about as often true as
+  // false are tested without branching, one by one, where branchless mode
+  // would (see PredicateMode).
+  profile_use,
+};
+
+// SiteCounts are the counts of a site: a condition was tested entries times,
+// and true taken times of them. A call was made entries times.
+struct SiteCounts {
+  uint64_t entries = 0;
+  uint64_t taken = 0;
+
+  // The fraction of the tests the condition was true for.
+  double rate() const { return entries == 0 ? 0 : double(taken) / entries; }
+};
+
+// FilterProfile is the profile of a program, as collected by its instrumented
+// code: the counters of every site, and the number of rows run. It's thread
+// safe, and needs to outlive the code incrementing its counters.
+class FilterProfile {
+public:
+  // sites are the kinds of the program's sites, by number (see
+  // ParsedProgram::profileSites).
+  explicit FilterProfile(std::vector<ProfileSiteKind> sites);
+  FilterProfile(const FilterProfile&) = delete;
+  FilterProfile& operator=(const FilterProfile&) = delete;
+
+  size_t numSites() const { return sites.size(); }
+  ProfileSiteKind siteKind(unsigned site) const { return sites[site]; }
+  SiteCounts counts(unsigned site) const;
+  // counters returns the site's counters, for the instrumented code to
+  // increment: entries, then taken.
+  std::atomic<uint64_t>* counters(unsigned site) { return &ctrs[2 * site]; }
+
+  // addRows records that the instrumented code ran n more rows, and returns
+  // the number of rows so far.
+  uint64_t addRows(uint64_t n) { return numRows.fetch_add(n) + n; }
+  uint64_t rows() const { return numRows.load(); }
+
+  // toJSON renders the rows and the counts of the sites, in order.
+  std::string toJSON() const;
+
+private:
+  const std::vector<ProfileSiteKind> sites;
+  std::unique_ptr<std::atomic<uint64_t>[]> ctrs;
+  std::atomic<uint64_t> numRows{0};
+};
+
+#endif
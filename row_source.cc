@@ -0,0 +1,145 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "llvm/Support/ErrorOr.h"
+
+#include "diag.h"
+#include "row_source.h"
+
+RowSource::RowSource(llvm::StringRef buf)
+  : start(buf.begin()), cur(start), end(buf.end()), prefetched(end) {}
+
+RowSource::RowSource(std::unique_ptr<llvm::MemoryBuffer> f)
+  : file(std::move(f)),
+    start(file->getBufferStart()),
+    cur(start),
+    end(file->getBufferEnd()),
+    prefetched(start) {}
+
+std::unique_ptr<RowSource> RowSource::Open(const std::string& path) {
+  // Big files get mapped rather than read.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buf =
+      llvm::MemoryBuffer::getFile(path, -1 /* FileSize */,
+                                  false /* RequiresNullTerminator */);
+  if (!buf) {
+    Diag(diag_error, "can't read rows from %s: %s",
+        path.c_str(), buf.getError().message().c_str());
+    return nullptr;
+  }
+  return std::unique_ptr<RowSource>(new RowSource(std::move(*buf)));
+}
+
+bool RowSource::readLen(uint64_t* len) {
+  uint64_t res = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (cur == end) {
+      return false;
+    }
+    uint8_t b = uint8_t(*cur++);
+    res |= uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      if (res > uint64_t(end - cur)) {
+        return false;
+      }
+      *len = res;
+      return true;
+    }
+  }
+  return false;
+}
+
+void RowSource::prefetch(size_t ahead) {
+  const char* target = ahead < size_t(end - cur) ? cur + ahead : end;
+  if (target <= prefetched) {
+    return;
+  }
+#ifndef _WIN32
+  // madvise wants a page aligned start.
+  static const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+  uintptr_t start = uintptr_t(prefetched) & ~(pageSize - 1);
+  // Not being able to prefetch (say the file was read rather than mapped)
+  // only costs the overlap.
+  madvise(reinterpret_cast<void*>(start),
+          uintptr_t(target) - start, MADV_WILLNEED);
+#endif
+  prefetched = target;
+}
+
+bool RowSource::Next(uint32_t maxRows, RowBlockBuffer* out) {
+  out->keys.clear();
+  out->vals.clear();
+  const char* blockStart = cur;
+  while (!error && cur != end && out->vals.size() < maxRows) {
+    const char* row = cur;
+    uint64_t keyLen, valLen;
+    if (!readLen(&keyLen)) {
+      error = true;
+    } else {
+      const char* key = cur;
+      cur += keyLen;
+      if (!readLen(&valLen)) {
+        error = true;
+      } else {
+        out->keys.push_back(key);
+        out->vals.push_back(cur);
+        cur += valLen;
+      }
+    }
+    if (error) {
+      Diag(diag_error, "malformed row at offset %lu of the row data",
+          (unsigned long)(row - start));
+    }
+  }
+  if (error) {
+    out->keys.clear();
+    out->vals.clear();
+    cur = end;
+    return false;
+  }
+  // The next block is probably about as big as this one.
+  prefetch(size_t(cur - blockStart));
+  return !out->vals.empty();
+}
+
+uint64_t FilterRows(const CompiledFilter& filter, RowSource& source,
+                    uint32_t rowsPerBlock, std::vector<int64_t>* state,
+                    std::vector<std::vector<int64_t>>* columns,
+                    const int64_t* params) {
+  RowBlockBuffer rows;
+  std::vector<uint8_t> bitmap((rowsPerBlock + 7) / 8);
+  std::vector<int64_t> acc(filter.state.size());
+  filter.initState(acc.data());
+  // Every block's outputs go to the scratch columns first.
+  size_t numOutputs = filter.outputs.size();
+  std::vector<int64_t> scratch(numOutputs * rowsPerBlock);
+  std::vector<int64_t*> outCols(numOutputs);
+  for (size_t j = 0; j < numOutputs; j++) {
+    outCols[j] = &scratch[j * rowsPerBlock];
+  }
+  std::vector<std::vector<int64_t>> cols(numOutputs);
+  uint64_t matches = 0;
+  while (source.Next(rowsPerBlock, &rows)) {
+    RowBlock block = rows.block();
+    uint32_t blockMatches = filter.batchFn(
+        block.keys, block.vals, block.n, bitmap.data(),
+        acc.empty() ? nullptr : acc.data(),
+        outCols.empty() ? nullptr : outCols.data(), params);
+    matches += blockMatches;
+    for (size_t j = 0; j < numOutputs; j++) {
+      cols[j].insert(cols[j].end(), outCols[j], outCols[j] + blockMatches);
+    }
+  }
+  if (state != nullptr) {
+    *state = std::move(acc);
+  }
+  if (columns != nullptr) {
+    *columns = std::move(cols);
+  }
+  return matches;
+}
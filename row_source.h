@@ -0,0 +1,84 @@
+#ifndef ROW_SOURCE_H
+#define ROW_SOURCE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "filter_cache.h"
+#include "scan.h"
+
+// RowBlockBuffer holds the row pointers of a block read from a RowSource.
+struct RowBlockBuffer {
+  std::vector<const char*> keys;
+  std::vector<const char*> vals;
+
+  // The block, for prog_main_batch or a ScanExecutor. It points into the
+  // buffer, which needs to stay as it is while the block is used.
+  RowBlock block() {
+    return RowBlock{keys.data(), vals.data(), uint32_t(vals.size())};
+  }
+};
+
+// RowSource reads rows out of a buffer holding length prefixed key/value
+// pairs, one after the other:
+//
+//   uvarint key length, key, uvarint value length, value
+//
+// It doesn't copy the rows: the keys and values it returns point into the
+// buffer. The buffer either belongs to the caller (a block of an SST, say) or
+// is a file the source maps, and the rows stay valid as long as the buffer
+// does, so blocks can be kept and scanned later.
+//
+// When the source maps a file, it asks the kernel to read ahead the data of
+// the next block while the current one is being filtered.
+class RowSource {
+public:
+  // Reads the rows in buf, which needs to outlive the source and the rows.
+  explicit RowSource(llvm::StringRef buf);
+  // Open maps the file at path. Returns nullptr, having reported the error, if
+  // it can't be read.
+  static std::unique_ptr<RowSource> Open(const std::string& path);
+  RowSource(const RowSource&) = delete;
+  RowSource& operator=(const RowSource&) = delete;
+
+  // Next replaces the rows in out with the next (up to) maxRows rows. Returns
+  // false, with out empty, once there are no rows left or if the data is
+  // malformed; failed() tells the two apart.
+  bool Next(uint32_t maxRows, RowBlockBuffer* out);
+  bool failed() const { return error; }
+
+private:
+  explicit RowSource(std::unique_ptr<llvm::MemoryBuffer> file);
+  // readLen decodes the uvarint length at cur, which the data needs to hold.
+  bool readLen(uint64_t* len);
+  // prefetch asks for the bytes up to cur + ahead to be read in.
+  void prefetch(size_t ahead);
+
+  // The mapped file, if the source reads one.
+  std::unique_ptr<llvm::MemoryBuffer> file;
+  const char* start;
+  const char* cur;
+  const char* end;
+  // The data up to here has been prefetched (or is the caller's).
+  const char* prefetched;
+  bool error = false;
+};
+
+// FilterRows runs all the rows of source through filter's batch entry point,
+// rowsPerBlock at a time, on the calling thread. Returns the number of
+// matches. If state isn't null, it's set to the values of the filter's state
+// variables over all the rows. If columns isn't null, it's set to the
+// filter's output columns of the matching rows (like ScanResult::columns).
+// params are the filter's arguments for its parameters, if it takes them.
+uint64_t FilterRows(const CompiledFilter& filter, RowSource& source,
+                    uint32_t rowsPerBlock,
+                    std::vector<int64_t>* state = nullptr,
+                    std::vector<std::vector<int64_t>>* columns = nullptr,
+                    const int64_t* params = nullptr);
+
+#endif
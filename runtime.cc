@@ -0,0 +1,725 @@
+#include <cassert>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "runtime.h"
+
+using std::string;
+using std::vector;
+
+using llvm::BasicBlock;
+using llvm::Function;
+using llvm::IRBuilder;
+using llvm::Type;
+using llvm::Value;
+
+// The decoding loop is:
+//   loop:
+//     ptr = phi [p, entry], [next, loop]
+//     acc = phi [0, entry], [acc | (*ptr & 127) << shift, loop]
+//     shift = phi [0, entry], [shift + 7, loop]
+//     next = ptr + 1
+//     br (*ptr & 128), loop, exit
+Value* EmitReadUvarint(Function* f, IRBuilder<>& b, Value* p, Value** end) {
+  BasicBlock* entryBB = b.GetInsertBlock();
+  BasicBlock* loopBB = BasicBlock::Create(f->getContext(), "varint", f);
+  BasicBlock* exitBB = BasicBlock::Create(f->getContext(), "varint_end", f);
+  b.CreateBr(loopBB);
+
+  b.SetInsertPoint(loopBB);
+  llvm::PHINode* ptr = b.CreatePHI(b.getInt8PtrTy(), 2, "ptr");
+  llvm::PHINode* acc = b.CreatePHI(b.getInt64Ty(), 2, "acc");
+  llvm::PHINode* shift = b.CreatePHI(b.getInt64Ty(), 2, "shift");
+  ptr->addIncoming(p, entryBB);
+  acc->addIncoming(b.getInt64(0), entryBB);
+  shift->addIncoming(b.getInt64(0), entryBB);
+  Value* byte = b.CreateLoad(ptr, "byte");
+  Value* bits = b.CreateZExt(b.CreateAnd(byte, b.getInt8(127)), b.getInt64Ty());
+  Value* nextAcc = b.CreateOr(acc, b.CreateShl(bits, shift), "next_acc");
+  Value* next = b.CreateInBoundsGEP(ptr, b.getInt32(1), "next");
+  ptr->addIncoming(next, loopBB);
+  acc->addIncoming(nextAcc, loopBB);
+  shift->addIncoming(b.CreateAdd(shift, b.getInt64(7)), loopBB);
+  Value* cont = b.CreateICmpNE(
+      b.CreateAnd(byte, b.getInt8(128)), b.getInt8(0), "cont");
+  b.CreateCondBr(cont, loopBB, exitBB);
+
+  b.SetInsertPoint(exitBB);
+  *end = next;
+  return nextAcc;
+}
+
+namespace {
+
+struct Builtin {
+  // Builds the type the builtin has in builtin.cc.
+  std::function<llvm::FunctionType*(llvm::LLVMContext& c)> type;
+  // Emits the body into f, whose type is type().
+  std::function<void(Function* f, IRBuilder<>& b)> emit;
+  // For the builtins with vector code, emit is null and emitVector emits the
+  // body for vectors of vectorBytes bytes (0 if the target has none).
+  std::function<void(Function* f, IRBuilder<>& b, unsigned vectorBytes)>
+      emitVector = nullptr;
+};
+
+Type* i8Ty(llvm::LLVMContext& c) { return Type::getInt8Ty(c); }
+Type* i8PtrTy(llvm::LLVMContext& c) { return Type::getInt8PtrTy(c); }
+
+vector<Value*> args(Function* f) {
+  vector<Value*> res;
+  for (auto& arg : f->args()) {
+    res.push_back(&arg);
+  }
+  return res;
+}
+
+// emitSkip emits a function returning s + delta.
+void emitSkip(Function* f, IRBuilder<>& b, int delta) {
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  b.CreateRet(b.CreateInBoundsGEP(args(f)[0], b.getInt32(delta)));
+}
+
+// skip_bytes: s + numBytes, with numBytes a signed char like in builtin.cc.
+void emitSkipBytes(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  b.CreateRet(b.CreateInBoundsGEP(a[0], b.CreateSExt(a[1], b.getInt32Ty())));
+}
+
+// skip_int: advance past the byte without the continuation bit set.
+//   entry:
+//     br loop
+//   loop:
+//     p = phi [s, entry], [next, loop]
+//     next = p + 1
+//     br (*p & 128), loop, exit
+//   exit:
+//     ret next
+void emitSkipInt(Function* f, IRBuilder<>& b) {
+  BasicBlock* entryBB = BasicBlock::Create(f->getContext(), "entry", f);
+  BasicBlock* loopBB = BasicBlock::Create(f->getContext(), "loop", f);
+  BasicBlock* exitBB = BasicBlock::Create(f->getContext(), "exit", f);
+  b.SetInsertPoint(entryBB);
+  b.CreateBr(loopBB);
+
+  b.SetInsertPoint(loopBB);
+  llvm::PHINode* p = b.CreatePHI(b.getInt8PtrTy(), 2, "p");
+  p->addIncoming(args(f)[0], entryBB);
+  Value* next = b.CreateInBoundsGEP(p, b.getInt32(1), "next");
+  p->addIncoming(next, loopBB);
+  Value* cont = b.CreateICmpNE(
+      b.CreateAnd(b.CreateLoad(p, "byte"), b.getInt8(128)), b.getInt8(0),
+      "cont");
+  b.CreateCondBr(cont, loopBB, exitBB);
+
+  b.SetInsertPoint(exitBB);
+  b.CreateRet(next);
+}
+
+// decode_int: the zigzag varint at s, (u >> 1) ^ -(u & 1).
+void emitDecodeInt(Function* f, IRBuilder<>& b) {
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* end;
+  Value* u = EmitReadUvarint(f, b, args(f)[0], &end);
+  Value* sign = b.CreateNeg(b.CreateAnd(u, b.getInt64(1)), "sign");
+  b.CreateRet(b.CreateXor(b.CreateLShr(u, 1), sign));
+}
+
+// decode_bytes_len: the uvarint length at s.
+void emitDecodeBytesLen(Function* f, IRBuilder<>& b) {
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* end;
+  b.CreateRet(EmitReadUvarint(f, b, args(f)[0], &end));
+}
+
+// decode_bytes_data: the bytes after the uvarint length at s.
+void emitDecodeBytesData(Function* f, IRBuilder<>& b) {
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* end;
+  EmitReadUvarint(f, b, args(f)[0], &end);
+  b.CreateRet(end);
+}
+
+// skip_len_prefixed: the end of the bytes after the uvarint length at s.
+void emitSkipLenPrefixed(Function* f, IRBuilder<>& b) {
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* end;
+  Value* len = EmitReadUvarint(f, b, args(f)[0], &end);
+  b.CreateRet(b.CreateInBoundsGEP(end, len));
+}
+
+// skip_cols: skip past 2k bytes without the continuation bit (k tags and k
+// varints), a vector of bytes at a time, like skipColsSSE2 in builtin.cc:
+//   entry:
+//     br (k <= 0), none, vec
+//   vec:
+//     p = phi [s, entry], [p + W, vec_next]
+//     rem = phi [2k, entry], [rem - n, vec_next]
+//     br (p's page offset > 4096 - W), scalar, vec_load
+//   vec_load:
+//     bits = movemask(~load <W x i8> p)
+//     n = ctpop(bits)
+//     br (n >= rem), found, vec_next
+//   found:
+//     ret p + (index of the rem'th set bit of bits) + 1
+//   scalar:
+//     the rest, a byte at a time
+// With vectorBytes == 0 it's only the scalar loop.
+void emitSkipCols(Function* f, IRBuilder<>& b, unsigned vectorBytes) {
+  llvm::LLVMContext& c = f->getContext();
+  llvm::Module* m = f->getParent();
+  vector<Value*> a = args(f);
+  Value* s = a[0];
+  Value* k = a[1];
+  BasicBlock* entryBB = BasicBlock::Create(c, "entry", f);
+  BasicBlock* noneBB = BasicBlock::Create(c, "none", f);
+  BasicBlock* scalarBB = BasicBlock::Create(c, "scalar", f);
+  BasicBlock* scalarEndBB = BasicBlock::Create(c, "scalar_end", f);
+  Type* i64Ty = b.getInt64Ty();
+
+  b.SetInsertPoint(entryBB);
+  Value* ends = b.CreateShl(k, 1, "ends");
+  b.SetInsertPoint(noneBB);
+  b.CreateRet(s);
+
+  BasicBlock* vecBB = nullptr;
+  llvm::PHINode* p = nullptr;
+  llvm::PHINode* rem = nullptr;
+  if (vectorBytes == 0) {
+    b.SetInsertPoint(entryBB);
+    b.CreateCondBr(b.CreateICmpSLE(k, b.getInt64(0)), noneBB, scalarBB);
+  } else {
+    vecBB = BasicBlock::Create(c, "vec", f);
+    BasicBlock* vecLoadBB = BasicBlock::Create(c, "vec_load", f);
+    BasicBlock* vecNextBB = BasicBlock::Create(c, "vec_next", f);
+    BasicBlock* foundBB = BasicBlock::Create(c, "found", f);
+    BasicBlock* nthBB = BasicBlock::Create(c, "nth", f);
+    BasicBlock* nthEndBB = BasicBlock::Create(c, "nth_end", f);
+    b.SetInsertPoint(entryBB);
+    b.CreateCondBr(b.CreateICmpSLE(k, b.getInt64(0)), noneBB, vecBB);
+
+    b.SetInsertPoint(vecBB);
+    p = b.CreatePHI(b.getInt8PtrTy(), 2, "p");
+    rem = b.CreatePHI(i64Ty, 2, "rem");
+    p->addIncoming(s, entryBB);
+    rem->addIncoming(ends, entryBB);
+    // Don't load across the page boundary.
+    Value* pageOff = b.CreateAnd(b.CreatePtrToInt(p, i64Ty), 4095, "page_off");
+    b.CreateCondBr(
+        b.CreateICmpUGT(pageOff, b.getInt64(4096 - vectorBytes)),
+        scalarBB, vecLoadBB);
+
+    b.SetInsertPoint(vecLoadBB);
+    llvm::Type* vecTy = llvm::VectorType::get(b.getInt8Ty(), vectorBytes);
+    Value* block = b.CreateAlignedLoad(
+        b.CreateBitCast(p, vecTy->getPointerTo()), 1, "block");
+    // The bytes without the continuation bit; codegen makes a movemask out
+    // of the compare and the bitcast.
+    Value* isEnd = b.CreateICmpSGT(
+        block, llvm::Constant::getAllOnesValue(vecTy), "is_end");
+    Value* bits = b.CreateZExt(
+        b.CreateBitCast(isEnd, b.getIntNTy(vectorBytes)), i64Ty, "bits");
+    Function* ctpop = llvm::Intrinsic::getDeclaration(
+        m, llvm::Intrinsic::ctpop, {i64Ty});
+    Value* n = b.CreateCall(ctpop, {bits}, "n");
+    b.CreateCondBr(b.CreateICmpUGE(n, rem), foundBB, vecNextBB);
+
+    b.SetInsertPoint(vecNextBB);
+    p->addIncoming(
+        b.CreateInBoundsGEP(p, b.getInt32(vectorBytes), "p_next"), vecNextBB);
+    rem->addIncoming(b.CreateSub(rem, n, "rem_next"), vecNextBB);
+    b.CreateBr(vecBB);
+
+    // Clear the lowest set bit rem-1 times; the lowest one left is the last
+    // end.
+    b.SetInsertPoint(foundBB);
+    b.CreateBr(nthBB);
+    b.SetInsertPoint(nthBB);
+    llvm::PHINode* nthBits = b.CreatePHI(i64Ty, 2, "nth_bits");
+    llvm::PHINode* j = b.CreatePHI(i64Ty, 2, "j");
+    nthBits->addIncoming(bits, foundBB);
+    j->addIncoming(rem, foundBB);
+    nthBits->addIncoming(
+        b.CreateAnd(nthBits, b.CreateSub(nthBits, b.getInt64(1))), nthBB);
+    j->addIncoming(b.CreateSub(j, b.getInt64(1)), nthBB);
+    b.CreateCondBr(b.CreateICmpUGT(j, b.getInt64(1)), nthBB, nthEndBB);
+
+    b.SetInsertPoint(nthEndBB);
+    Function* cttz = llvm::Intrinsic::getDeclaration(
+        m, llvm::Intrinsic::cttz, {i64Ty});
+    Value* idx = b.CreateCall(cttz, {nthBits, b.getTrue()}, "idx");
+    b.CreateRet(b.CreateInBoundsGEP(
+        b.CreateInBoundsGEP(p, idx), b.getInt32(1)));
+  }
+
+  // The byte at a time loop, for the tail of the row and for the targets
+  // without vectors.
+  b.SetInsertPoint(scalarBB);
+  llvm::PHINode* q = b.CreatePHI(b.getInt8PtrTy(), 3, "q");
+  llvm::PHINode* r = b.CreatePHI(i64Ty, 3, "r");
+  if (vectorBytes == 0) {
+    q->addIncoming(s, entryBB);
+    r->addIncoming(ends, entryBB);
+  } else {
+    q->addIncoming(p, vecBB);
+    r->addIncoming(rem, vecBB);
+  }
+  Value* byte = b.CreateLoad(q, "byte");
+  Value* isEnd = b.CreateZExt(
+      b.CreateICmpSGT(byte, b.getInt8(-1)), i64Ty, "is_end");
+  Value* rNext = b.CreateSub(r, isEnd, "r_next");
+  Value* qNext = b.CreateInBoundsGEP(q, b.getInt32(1), "q_next");
+  q->addIncoming(qNext, scalarBB);
+  r->addIncoming(rNext, scalarBB);
+  b.CreateCondBr(
+      b.CreateICmpEQ(rNext, b.getInt64(0)), scalarEndBB, scalarBB);
+
+  b.SetInsertPoint(scalarEndBB);
+  b.CreateRet(qNext);
+}
+
+// vectorBytes returns the width of the vector registers of the target the
+// skip kernels can use: 32 bytes with AVX2, 16 with SSE2, 0 otherwise.
+unsigned vectorBytes(const llvm::TargetMachine& tm) {
+  llvm::Triple::ArchType arch = tm.getTargetTriple().getArch();
+  if (arch != llvm::Triple::x86_64 && arch != llvm::Triple::x86) {
+    return 0;
+  }
+  const llvm::MCSubtargetInfo* sti = tm.getMCSubtargetInfo();
+  if (sti->checkFeatures("+avx2")) {
+    return 32;
+  }
+  if (sti->checkFeatures("+sse2")) {
+    return 16;
+  }
+  return 0;
+}
+
+// cmpLens returns -1, 0 or 1 as l1 is less, equal or greater than l2, as a
+// byte.
+Value* cmpLens(IRBuilder<>& b, Value* l1, Value* l2) {
+  Value* zero = llvm::ConstantInt::get(b.getInt8Ty(), 0);
+  Value* greater = b.CreateSelect(
+      b.CreateICmpSGT(l1, l2), b.getInt8(1), zero);
+  return b.CreateSelect(b.CreateICmpSLT(l1, l2), b.getInt8(-1), greater);
+}
+
+// getMemcmp returns memcmp, declared in f's module, and sets sizeTy to the
+// type of its length.
+llvm::Constant* getMemcmp(Function* f, IRBuilder<>& b, Type** sizeTy) {
+  llvm::Module* m = f->getParent();
+  *sizeTy = m->getDataLayout().getIntPtrType(f->getContext());
+  return m->getOrInsertFunction(
+      "memcmp", b.getInt32Ty(), b.getInt8PtrTy(), b.getInt8PtrTy(), *sizeTy);
+}
+
+// minLen returns min(l1, l2) as a signed 32 bit value. The lengths are
+// signed chars, like in builtin.cc.
+Value* minLen(IRBuilder<>& b, Value* l1, Value* l2) {
+  Value* l = b.CreateSelect(b.CreateICmpSLT(l2, l1), l2, l1, "l");
+  return b.CreateSExt(l, b.getInt32Ty(), "len");
+}
+
+// my_strcmp: compare the first min(l1, l2) chars, as signed chars.
+//   entry:
+//     br (len > 0), loop, equal
+//   loop:
+//     i = phi [0, entry], [i+1, next]
+//     br (str1[i] < str2[i]), less, notless
+//   notless:
+//     br (str1[i] > str2[i]), greater, next
+//   next:
+//     br (i+1 < len), loop, equal
+//   less: ret -1    greater: ret 1
+//   equal:
+//     ret (l1 < l2 ? -1 : l1 > l2 ? 1 : 0)
+void emitMyStrcmp(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  BasicBlock* entryBB = BasicBlock::Create(f->getContext(), "entry", f);
+  BasicBlock* loopBB = BasicBlock::Create(f->getContext(), "loop", f);
+  BasicBlock* notLessBB = BasicBlock::Create(f->getContext(), "notless", f);
+  BasicBlock* nextBB = BasicBlock::Create(f->getContext(), "next", f);
+  BasicBlock* lessBB = BasicBlock::Create(f->getContext(), "less", f);
+  BasicBlock* greaterBB = BasicBlock::Create(f->getContext(), "greater", f);
+  BasicBlock* equalBB = BasicBlock::Create(f->getContext(), "equal", f);
+
+  b.SetInsertPoint(entryBB);
+  Value* len = minLen(b, a[1], a[3]);
+  b.CreateCondBr(b.CreateICmpSGT(len, b.getInt32(0)), loopBB, equalBB);
+
+  b.SetInsertPoint(loopBB);
+  llvm::PHINode* i = b.CreatePHI(b.getInt32Ty(), 2, "i");
+  i->addIncoming(b.getInt32(0), entryBB);
+  Value* c1 = b.CreateLoad(b.CreateInBoundsGEP(a[0], i), "c1");
+  Value* c2 = b.CreateLoad(b.CreateInBoundsGEP(a[2], i), "c2");
+  b.CreateCondBr(b.CreateICmpSLT(c1, c2), lessBB, notLessBB);
+
+  b.SetInsertPoint(notLessBB);
+  b.CreateCondBr(b.CreateICmpSGT(c1, c2), greaterBB, nextBB);
+
+  b.SetInsertPoint(nextBB);
+  Value* nextI = b.CreateAdd(i, b.getInt32(1), "next_i");
+  i->addIncoming(nextI, nextBB);
+  b.CreateCondBr(b.CreateICmpSLT(nextI, len), loopBB, equalBB);
+
+  b.SetInsertPoint(lessBB);
+  b.CreateRet(b.getInt8(-1));
+  b.SetInsertPoint(greaterBB);
+  b.CreateRet(b.getInt8(1));
+  b.SetInsertPoint(equalBB);
+  b.CreateRet(cmpLens(b, a[1], a[3]));
+}
+
+// streq: equal lengths, and memcmp over them. With constant lengths, the
+// memcmp gets expanded into a few wide loads by codegen.
+void emitStreq(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  Type* sizeTy;
+  llvm::Constant* memcmpFn = getMemcmp(f, b, &sizeTy);
+
+  BasicBlock* entryBB = BasicBlock::Create(f->getContext(), "entry", f);
+  BasicBlock* lenBB = BasicBlock::Create(f->getContext(), "len", f);
+  BasicBlock* cmpBB = BasicBlock::Create(f->getContext(), "cmp", f);
+  BasicBlock* equalBB = BasicBlock::Create(f->getContext(), "equal", f);
+  BasicBlock* notEqualBB = BasicBlock::Create(f->getContext(), "not_equal", f);
+
+  b.SetInsertPoint(entryBB);
+  b.CreateCondBr(b.CreateICmpEQ(a[1], a[3]), lenBB, notEqualBB);
+
+  b.SetInsertPoint(lenBB);
+  Value* len = minLen(b, a[1], a[3]);
+  b.CreateCondBr(b.CreateICmpSGT(len, b.getInt32(0)), cmpBB, equalBB);
+
+  b.SetInsertPoint(cmpBB);
+  Value* res = b.CreateCall(
+      memcmpFn, {a[0], a[2], b.CreateZExt(len, sizeTy)}, "memcmp");
+  b.CreateRet(b.CreateZExt(b.CreateICmpEQ(res, b.getInt32(0)), b.getInt8Ty()));
+
+  b.SetInsertPoint(equalBB);
+  b.CreateRet(b.getInt8(1));
+  b.SetInsertPoint(notEqualBB);
+  b.CreateRet(b.getInt8(0));
+}
+
+// The bytes_* comparisons have 64 bit lengths and go through memcmp, which
+// codegen expands inline for constant lengths (a literal's) and which is the
+// libc vector implementation otherwise.
+
+// bytes_eq:
+//   entry:
+//     br (l1 == l2), cmp, not_equal
+//   cmp:
+//     ret memcmp(s1, s2, l1) == 0
+//   not_equal:
+//     ret 0
+void emitBytesEq(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  Type* sizeTy;
+  llvm::Constant* memcmpFn = getMemcmp(f, b, &sizeTy);
+  BasicBlock* entryBB = BasicBlock::Create(f->getContext(), "entry", f);
+  BasicBlock* cmpBB = BasicBlock::Create(f->getContext(), "cmp", f);
+  BasicBlock* notEqualBB = BasicBlock::Create(f->getContext(), "not_equal", f);
+
+  b.SetInsertPoint(entryBB);
+  b.CreateCondBr(b.CreateICmpEQ(a[1], a[3]), cmpBB, notEqualBB);
+
+  b.SetInsertPoint(cmpBB);
+  Value* res = b.CreateCall(
+      memcmpFn, {a[0], a[2], b.CreateZExtOrTrunc(a[1], sizeTy)}, "memcmp");
+  b.CreateRet(b.CreateZExt(b.CreateICmpEQ(res, b.getInt32(0)), b.getInt8Ty()));
+
+  b.SetInsertPoint(notEqualBB);
+  b.CreateRet(b.getInt8(0));
+}
+
+// bytes_cmp:
+//   res = memcmp(s1, s2, min(l1, l2))
+//   ret res < 0 ? -1 : res > 0 ? 1 : (l1 < l2 ? -1 : l1 > l2 ? 1 : 0)
+void emitBytesCmp(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  Type* sizeTy;
+  llvm::Constant* memcmpFn = getMemcmp(f, b, &sizeTy);
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* len = b.CreateSelect(b.CreateICmpSLT(a[3], a[1]), a[3], a[1], "len");
+  Value* res = b.CreateCall(
+      memcmpFn, {a[0], a[2], b.CreateZExtOrTrunc(len, sizeTy)}, "memcmp");
+  Value* byBytes = cmpLens(b, res, b.getInt32(0));
+  b.CreateRet(b.CreateSelect(
+      b.CreateICmpEQ(res, b.getInt32(0)), cmpLens(b, a[1], a[3]), byBytes));
+}
+
+// bytes_prefix:
+//   entry:
+//     br (l >= prefix_len), cmp, no
+//   cmp:
+//     ret memcmp(s, prefix, prefix_len) == 0
+//   no:
+//     ret 0
+void emitBytesPrefix(Function* f, IRBuilder<>& b) {
+  vector<Value*> a = args(f);
+  Type* sizeTy;
+  llvm::Constant* memcmpFn = getMemcmp(f, b, &sizeTy);
+  BasicBlock* entryBB = BasicBlock::Create(f->getContext(), "entry", f);
+  BasicBlock* cmpBB = BasicBlock::Create(f->getContext(), "cmp", f);
+  BasicBlock* noBB = BasicBlock::Create(f->getContext(), "no", f);
+
+  b.SetInsertPoint(entryBB);
+  b.CreateCondBr(b.CreateICmpSGE(a[1], a[3]), cmpBB, noBB);
+
+  b.SetInsertPoint(cmpBB);
+  Value* res = b.CreateCall(
+      memcmpFn, {a[0], a[2], b.CreateZExtOrTrunc(a[3], sizeTy)}, "memcmp");
+  b.CreateRet(b.CreateZExt(b.CreateICmpEQ(res, b.getInt32(0)), b.getInt8Ty()));
+
+  b.SetInsertPoint(noBB);
+  b.CreateRet(b.getInt8(0));
+}
+
+// The signatures of the builtins.
+llvm::FunctionType* skipTy(llvm::LLVMContext& c) {
+  return llvm::FunctionType::get(i8PtrTy(c), {i8PtrTy(c)}, false);
+}
+llvm::FunctionType* skipBytesTy(llvm::LLVMContext& c) {
+  return llvm::FunctionType::get(i8PtrTy(c), {i8PtrTy(c), i8Ty(c)}, false);
+}
+llvm::FunctionType* skipColsTy(llvm::LLVMContext& c) {
+  return llvm::FunctionType::get(
+      i8PtrTy(c), {i8PtrTy(c), Type::getInt64Ty(c)}, false);
+}
+llvm::FunctionType* decodeTy(llvm::LLVMContext& c) {
+  return llvm::FunctionType::get(Type::getInt64Ty(c), {i8PtrTy(c)}, false);
+}
+llvm::FunctionType* strCmpTy(llvm::LLVMContext& c) {
+  return llvm::FunctionType::get(
+      i8Ty(c), {i8PtrTy(c), i8Ty(c), i8PtrTy(c), i8Ty(c)}, false);
+}
+
+llvm::FunctionType* bytesCmpTy(llvm::LLVMContext& c) {
+  Type* i64Ty = Type::getInt64Ty(c);
+  return llvm::FunctionType::get(
+      i8Ty(c), {i8PtrTy(c), i64Ty, i8PtrTy(c), i64Ty}, false);
+}
+
+const std::map<string, Builtin>& builtins() {
+  static const std::map<string, Builtin> res = {
+    {"skip_checksum", {
+      skipTy,
+      [](Function* f, IRBuilder<>& b) { emitSkip(f, b, 4); },
+    }},
+    {"skip_byte", {
+      skipTy,
+      [](Function* f, IRBuilder<>& b) { emitSkip(f, b, 1); },
+    }},
+    {"skip_bytes", {skipBytesTy, emitSkipBytes}},
+    {"skip_int", {skipTy, emitSkipInt}},
+    {"skip_cols", {skipColsTy, nullptr, emitSkipCols}},
+    {"my_strcmp", {strCmpTy, emitMyStrcmp}},
+    {"streq", {strCmpTy, emitStreq}},
+    // bytes_contains is left to the host version, a memchr loop.
+    {"bytes_eq", {bytesCmpTy, emitBytesEq}},
+    {"bytes_cmp", {bytesCmpTy, emitBytesCmp}},
+    {"bytes_prefix", {bytesCmpTy, emitBytesPrefix}},
+    {"decode_int", {decodeTy, emitDecodeInt}},
+    {"decode_bytes_len", {decodeTy, emitDecodeBytesLen}},
+    {"decode_bytes_data", {skipTy, emitDecodeBytesData}},
+    {"skip_len_prefixed", {skipTy, emitSkipLenPrefixed}},
+  };
+  return res;
+}
+
+}  // namespace
+
+bool IsRuntimeBuiltin(const string& name) {
+  return builtins().count(name) != 0;
+}
+
+bool DefineRuntimeBuiltin(Function* f, const llvm::TargetMachine& tm) {
+  assert(f->isDeclaration());
+  auto it = builtins().find(f->getName().str());
+  if (it == builtins().end()) {
+    return false;
+  }
+  if (f->getFunctionType() != it->second.type(f->getContext())) {
+    // Somebody declared the builtin with a different signature; leave it to
+    // the host process version.
+    return false;
+  }
+
+  IRBuilder<> b(f->getContext());
+  if (it->second.emit) {
+    it->second.emit(f, b);
+  } else {
+    it->second.emitVector(f, b, vectorBytes(tm));
+  }
+  f->setLinkage(llvm::GlobalValue::InternalLinkage);
+  f->addFnAttr(llvm::Attribute::AlwaysInline);
+  assert(!llvm::verifyFunction(*f, &llvm::errs()));
+  return true;
+}
+
+namespace {
+
+// The comparisons SpecializeLiteralCompares rewrites. They take two (pointer,
+// length) pairs; the literal can be the first or the second one, except for
+// bytes_prefix, where it's the prefix.
+struct LiteralCompare {
+  const char* name;
+  bool literalFirst;
+  // Whether the other string only needs to start with the literal.
+  bool prefix;
+};
+
+const LiteralCompare literalCompares[] = {
+  {"streq", true, false},
+  {"bytes_eq", true, false},
+  {"bytes_prefix", false, true},
+};
+
+// Longer literals are left to memcmp.
+const uint64_t maxLiteralLen = 64;
+
+// emitLiteralEq emits the comparison of the lit.size() bytes at p with lit
+// and returns the i1 result. The bytes are loaded in chunks of the widest
+// integer up to 8 bytes that fits; a chunk that doesn't fit at the end
+// overlaps the one before it instead of reading past the string. Each chunk
+// is xor'ed with the literal's bytes as an immediate.
+Value* emitLiteralEq(
+    IRBuilder<>& b, const llvm::DataLayout& dl, Value* p,
+    llvm::StringRef lit) {
+  uint64_t len = lit.size();
+  if (len == 0) {
+    return b.getTrue();
+  }
+  uint64_t width = 8;
+  while (width > len) {
+    width /= 2;
+  }
+  vector<uint64_t> offsets;
+  for (uint64_t off = 0; off + width <= len; off += width) {
+    offsets.push_back(off);
+  }
+  if (len % width != 0) {
+    offsets.push_back(len - width);
+  }
+
+  Type* chunkTy = b.getIntNTy(width * 8);
+  Value* acc = nullptr;
+  for (uint64_t off : offsets) {
+    uint64_t imm = 0;
+    for (uint64_t i = 0; i < width; i++) {
+      uint64_t byte = uint8_t(lit[off + i]);
+      unsigned shift = dl.isLittleEndian() ? i * 8 : (width - 1 - i) * 8;
+      imm |= byte << shift;
+    }
+    Value* ptr = b.CreateBitCast(
+        b.CreateInBoundsGEP(p, b.getInt64(off)), chunkTy->getPointerTo());
+    Value* chunk = b.CreateAlignedLoad(ptr, 1, "chunk");
+    Value* diff = b.CreateZExt(
+        b.CreateXor(chunk, llvm::ConstantInt::get(chunkTy, imm)),
+        b.getInt64Ty(), "diff");
+    acc = acc ? b.CreateOr(acc, diff) : diff;
+  }
+  return b.CreateICmpEQ(acc, b.getInt64(0), "lit_eq");
+}
+
+// specializeLiteralCompare rewrites call, a call to c, if one of its strings
+// is a literal with a constant length. Returns false if it isn't.
+bool specializeLiteralCompare(const LiteralCompare& c, llvm::CallInst* call) {
+  if (call->getCalledFunction()->arg_size() != 4) {
+    return false;
+  }
+  // Try the literal as the second string, then as the first one.
+  for (int litIdx : {2, 0}) {
+    if (litIdx == 0 && !c.literalFirst) {
+      continue;
+    }
+    auto* litLen = llvm::dyn_cast<llvm::ConstantInt>(
+        call->getArgOperand(litIdx + 1));
+    llvm::StringRef lit;
+    if (litLen == nullptr ||
+        !llvm::getConstantStringInfo(
+            call->getArgOperand(litIdx), lit, 0, false /* TrimAtNul */)) {
+      continue;
+    }
+    int64_t len = litLen->getSExtValue();
+    if (len < 0 || uint64_t(len) > maxLiteralLen ||
+        uint64_t(len) > lit.size()) {
+      continue;
+    }
+    lit = lit.substr(0, len);
+    int otherIdx = 2 - litIdx;
+    Value* other = call->getArgOperand(otherIdx);
+    Value* otherLen = call->getArgOperand(otherIdx + 1);
+    Type* resTy = call->getType();
+    const llvm::DataLayout& dl = call->getModule()->getDataLayout();
+
+    // The other string's bytes are only loaded if it's long enough.
+    IRBuilder<> b(call);
+    Value* l = llvm::ConstantInt::get(otherLen->getType(), len);
+    Value* lenOk = c.prefix
+        ? b.CreateICmpSGE(otherLen, l) : b.CreateICmpEQ(otherLen, l);
+    Value* res;
+    if (auto* lenOkConst = llvm::dyn_cast<llvm::ConstantInt>(lenOk)) {
+      res = lenOkConst->isZero()
+          ? llvm::ConstantInt::get(resTy, 0)
+          : b.CreateZExt(emitLiteralEq(b, dl, other, lit), resTy);
+    } else {
+      BasicBlock* head = call->getParent();
+      llvm::Instruction* thenTerm =
+          llvm::SplitBlockAndInsertIfThen(lenOk, call, false /* Unreachable */);
+      b.SetInsertPoint(thenTerm);
+      Value* eq = b.CreateZExt(emitLiteralEq(b, dl, other, lit), resTy);
+      b.SetInsertPoint(call);
+      llvm::PHINode* phi = b.CreatePHI(resTy, 2, "lit_cmp");
+      phi->addIncoming(llvm::ConstantInt::get(resTy, 0), head);
+      phi->addIncoming(eq, thenTerm->getParent());
+      res = phi;
+    }
+    call->replaceAllUsesWith(res);
+    call->eraseFromParent();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+bool SpecializeLiteralCompares(Function& f) {
+  vector<std::pair<const LiteralCompare*, llvm::CallInst*>> calls;
+  for (BasicBlock& bb : f) {
+    for (llvm::Instruction& inst : bb) {
+      auto* call = llvm::dyn_cast<llvm::CallInst>(&inst);
+      Function* callee = call ? call->getCalledFunction() : nullptr;
+      if (callee == nullptr) {
+        continue;
+      }
+      for (const LiteralCompare& c : literalCompares) {
+        if (callee->getName() == c.name) {
+          calls.push_back({&c, call});
+        }
+      }
+    }
+  }
+  bool changed = false;
+  for (const auto& c : calls) {
+    changed |= specializeLiteralCompare(*c.first, c.second);
+  }
+  return changed;
+}
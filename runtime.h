@@ -0,0 +1,43 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <string>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+
+// The runtime library is an IR version of the decoding helpers in builtin.cc.
+// Instead of calling out to the host process, a call to one of these is bound
+// to a body emitted in the calling module, which the optimizer can inline and
+// fold into the caller.
+
+// IsRuntimeBuiltin returns true if the runtime library has an IR body for the
+// function with this name.
+bool IsRuntimeBuiltin(const std::string& name);
+
+// DefineRuntimeBuiltin emits the body of a runtime builtin into f, which must
+// be a declaration. The body gets internal linkage and is marked
+// always-inline. The vector builtins use the widest vectors tm's CPU has.
+// Returns false (leaving f an external declaration resolved through the host
+// process) if the function's signature doesn't match the one the runtime
+// library expects.
+bool DefineRuntimeBuiltin(llvm::Function* f, const llvm::TargetMachine& tm);
+
+// SpecializeLiteralCompares rewrites the equality and prefix compares in f
+// (streq, bytes_eq, bytes_prefix) against a string literal of constant
+// length into loads of the other string compared with the literal's bytes as
+// integer immediates: one load for literals of up to 8 bytes, an unrolled
+// sequence of loads for longer ones. It's meant to run after mem2reg, which
+// lets the literals assigned to variables reach their compares. Returns true
+// if anything changed.
+bool SpecializeLiteralCompares(llvm::Function& f);
+
+// EmitReadUvarint emits the decoding of the uvarint at p into f, starting at
+// the builder's insertion point, and returns the (64 bit) value. end is set
+// to the pointer past the varint. The builder is left positioned after the
+// decoding.
+llvm::Value* EmitReadUvarint(llvm::Function* f, llvm::IRBuilder<>& b,
+                             llvm::Value* p, llvm::Value** end);
+
+#endif
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "scan.h"
+
+ScanExecutor::ScanExecutor(unsigned numThreads) {
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < numThreads; i++) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i]->thread = std::thread([this, i]() { workerLoop(i); });
+  }
+}
+
+ScanExecutor::~ScanExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    stopping = true;
+  }
+  start.notify_all();
+  for (auto& w : workers) {
+    w->thread.join();
+  }
+}
+
+ScanResult ScanExecutor::Scan(const CompiledFilter& filter,
+                              const std::vector<RowBlock>& blocks,
+                              bool wantSelection,
+                              const int64_t* params) {
+  std::lock_guard<std::mutex> scanLock(scanMu);
+  std::vector<uint64_t> bases(blocks.size());
+  uint64_t numRows = 0;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    bases[b] = numRows;
+    numRows += blocks[b].n;
+  }
+  std::vector<uint32_t> matches(blocks.size());
+  std::vector<std::vector<uint32_t>> selections;
+  if (wantSelection) {
+    selections.resize(blocks.size());
+  }
+  ScanResult res;
+  res.columns.resize(filter.outputs.size());
+  for (std::vector<int64_t>& col : res.columns) {
+    col.resize(numRows);
+  }
+  batchFn = filter.batchFn;
+  hasState = !filter.state.empty();
+  this->params = params;
+  this->blocks = &blocks;
+  blockBases = &bases;
+  blockMatches = &matches;
+  blockSelections = wantSelection ? &selections : nullptr;
+  columns = filter.outputs.empty() ? nullptr : &res.columns;
+
+  // Give every worker an even share of the blocks.
+  size_t numWorkers = workers.size();
+  for (size_t i = 0; i < numWorkers; i++) {
+    Worker& w = *workers[i];
+    std::lock_guard<std::mutex> lock(w.mu);
+    w.begin = blocks.size() * i / numWorkers;
+    w.end = blocks.size() * (i + 1) / numWorkers;
+    w.matches = 0;
+    w.state.resize(filter.state.size());
+    filter.initState(w.state.data());
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mu);
+    numRunning = numWorkers;
+    generation++;
+    start.notify_all();
+    done.wait(lock, [this]() { return numRunning == 0; });
+  }
+
+  res.state.resize(filter.state.size());
+  filter.initState(res.state.data());
+  for (const auto& w : workers) {
+    res.matches += w->matches;
+    filter.mergeState(res.state.data(), w->state.data());
+  }
+  if (wantSelection) {
+    res.selection.reserve(res.matches);
+    for (size_t b = 0; b < blocks.size(); b++) {
+      for (uint32_t row : selections[b]) {
+        res.selection.push_back(bases[b] + row);
+      }
+    }
+  }
+  for (std::vector<int64_t>& col : res.columns) {
+    uint64_t next = 0;
+    for (size_t b = 0; b < blocks.size(); b++) {
+      if (next != bases[b] && matches[b] > 0) {
+        memmove(&col[next], &col[bases[b]], matches[b] * sizeof(int64_t));
+      }
+      next += matches[b];
+    }
+    col.resize(next);
+  }
+  this->blocks = nullptr;
+  blockBases = nullptr;
+  blockMatches = nullptr;
+  blockSelections = nullptr;
+  columns = nullptr;
+  return res;
+}
+
+void ScanExecutor::workerLoop(size_t w) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      start.wait(lock, [&]() { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+    }
+    runBlocks(w);
+    std::lock_guard<std::mutex> lock(mu);
+    if (--numRunning == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+void ScanExecutor::runBlocks(size_t w) {
+  Worker& worker = *workers[w];
+  while (true) {
+    size_t b;
+    {
+      std::lock_guard<std::mutex> lock(worker.mu);
+      if (worker.begin == worker.end) {
+        b = SIZE_MAX;
+      } else {
+        b = worker.begin++;
+      }
+    }
+    if (b != SIZE_MAX) {
+      runBlock(worker, b);
+    } else if (!steal(w)) {
+      return;
+    }
+  }
+}
+
+void ScanExecutor::runBlock(Worker& worker, size_t b) {
+  const RowBlock& block = (*blocks)[b];
+  if (block.n == 0) {
+    return;
+  }
+  size_t bitmapBytes = (block.n + 7) / 8;
+  if (worker.bitmap.size() < bitmapBytes) {
+    worker.bitmap.resize(bitmapBytes);
+  }
+  const char** keys = block.keys;
+  if (keys == nullptr) {
+    if (worker.emptyKeys.size() < block.n) {
+      worker.emptyKeys.resize(block.n, "");
+    }
+    keys = worker.emptyKeys.data();
+  }
+  int64_t** outCols = nullptr;
+  if (columns != nullptr) {
+    worker.outCols.resize(columns->size());
+    for (size_t j = 0; j < columns->size(); j++) {
+      worker.outCols[j] = (*columns)[j].data() + (*blockBases)[b];
+    }
+    outCols = worker.outCols.data();
+  }
+  uint32_t matches = batchFn(keys, block.vals, block.n, worker.bitmap.data(),
+                             hasState ? worker.state.data() : nullptr,
+                             outCols, params);
+  worker.matches += matches;
+  (*blockMatches)[b] = matches;
+  if (blockSelections != nullptr && matches > 0) {
+    std::vector<uint32_t>& sel = (*blockSelections)[b];
+    sel.reserve(matches);
+    for (size_t i = 0; i < bitmapBytes; i++) {
+      uint32_t bits = worker.bitmap[i];
+      while (bits != 0) {
+        sel.push_back(uint32_t(i * 8 + __builtin_ctz(bits)));
+        bits &= bits - 1;
+      }
+    }
+  }
+}
+
+bool ScanExecutor::steal(size_t w) {
+  // Start with the next worker, so that the thieves spread out.
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker& victim = *workers[(w + i) % workers.size()];
+    size_t begin, end;
+    {
+      std::lock_guard<std::mutex> lock(victim.mu);
+      size_t left = victim.end - victim.begin;
+      if (left == 0) {
+        continue;
+      }
+      end = victim.end;
+      begin = end - (left + 1) / 2;
+      victim.end = begin;
+    }
+    Worker& worker = *workers[w];
+    std::lock_guard<std::mutex> lock(worker.mu);
+    worker.begin = begin;
+    worker.end = end;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,127 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "filter_cache.h"
+
+// RowBlock is a block of rows to filter, in the layout prog_main_batch takes.
+// keys can be null for rows without keys; the rows then get empty keys.
+struct RowBlock {
+  const char** keys;
+  const char** vals;
+  uint32_t n;
+};
+
+// ScanResult is the result of filtering a set of blocks.
+struct ScanResult {
+  uint64_t matches = 0;
+  // The matching rows, if asked for, in order. Rows are numbered across the
+  // blocks: the first row of a block comes after the last one of the block
+  // before it.
+  std::vector<uint64_t> selection;
+  // The values of the filter's state variables over all the rows (see
+  // CompiledFilter::state).
+  std::vector<int64_t> state;
+  // The filter's output columns (see CompiledFilter::outputs): columns[j][r]
+  // is output j of the r-th matching row, in the order of selection. Their
+  // capacity is the number of rows scanned.
+  std::vector<std::vector<int64_t>> columns;
+};
+
+// ScanExecutor runs a compiled filter over a set of row blocks on a pool of
+// threads. The blocks are split between the threads up front; a thread that
+// runs out of blocks steals half of the remaining blocks of another one, so
+// uneven blocks (or threads) don't leave the others idle.
+//
+// Every thread has its own scratch buffers (the match bitmap and the empty
+// keys), kept from one block and one scan to the next, and its own partial
+// state for filters with state variables, merged at the end of the scan.
+// Filters with output variables write every block's outputs straight into
+// the result's columns, from the block's first row on: a block can't match
+// more rows than it has. The columns are compacted at the end, moving every
+// block's outputs down to follow the matches of the blocks before it.
+class ScanExecutor {
+public:
+  // numThreads of 0 means one per core.
+  explicit ScanExecutor(unsigned numThreads = 0);
+  // Waits for the scan in progress, if any.
+  ~ScanExecutor();
+  ScanExecutor(const ScanExecutor&) = delete;
+  ScanExecutor& operator=(const ScanExecutor&) = delete;
+
+  // Scan filters blocks through filter's batch entry point and returns the
+  // number of matches and, if wantSelection, the matching rows. params are
+  // the filter's arguments for its parameters (see ParamArgs), if it takes
+  // them. The blocks are only read during the call. Scans from several
+  // threads are run one at a time.
+  ScanResult Scan(const CompiledFilter& filter,
+                  const std::vector<RowBlock>& blocks, bool wantSelection,
+                  const int64_t* params = nullptr);
+
+  unsigned numThreads() const { return unsigned(workers.size()); }
+
+private:
+  struct Worker {
+    // Guards begin and end, the blocks the worker has left.
+    std::mutex mu;
+    size_t begin = 0;
+    size_t end = 0;
+
+    // Scratch, only used by the worker's thread.
+    std::vector<uint8_t> bitmap;
+    std::vector<const char*> emptyKeys;
+    uint64_t matches = 0;
+    std::vector<int64_t> state;
+    // Where the block being run writes its outputs.
+    std::vector<int64_t*> outCols;
+    std::thread thread;
+  };
+
+  void workerLoop(size_t w);
+  // runBlocks runs whatever blocks worker w has or can steal.
+  void runBlocks(size_t w);
+  void runBlock(Worker& worker, size_t b);
+  // steal moves half of the blocks another worker has left to worker w, which
+  // has none. Returns false if there are none left anywhere.
+  bool steal(size_t w);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+
+  // Serializes Scan.
+  std::mutex scanMu;
+
+  // The scan the workers are running. Set up by Scan before it bumps
+  // generation, and only read by the workers until they're done.
+  CompiledFilter::BatchFn batchFn = nullptr;
+  // Whether the filter has state variables.
+  bool hasState = false;
+  const int64_t* params = nullptr;
+  const std::vector<RowBlock>* blocks = nullptr;
+  // The number of the first row of each block, across the blocks.
+  const std::vector<uint64_t>* blockBases = nullptr;
+  // The number of matches of each block.
+  std::vector<uint32_t>* blockMatches = nullptr;
+  // The matching rows of each block, if the scan wants them.
+  std::vector<std::vector<uint32_t>>* blockSelections = nullptr;
+  // The result's output columns, sized to all the rows, if the filter has
+  // outputs.
+  std::vector<std::vector<int64_t>>* columns = nullptr;
+
+  // Guards generation, numRunning and stopping.
+  std::mutex mu;
+  // Signaled when a scan starts, and when the executor stops.
+  std::condition_variable start;
+  // Signaled when the last worker is done with a scan.
+  std::condition_variable done;
+  uint64_t generation = 0;
+  size_t numRunning = 0;
+  bool stopping = false;
+};
+
+#endif
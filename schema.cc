@@ -0,0 +1,228 @@
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "builtin.h"
+#include "runtime.h"
+#include "schema.h"
+
+using std::string;
+
+using llvm::BasicBlock;
+using llvm::Function;
+using llvm::IRBuilder;
+using llvm::Type;
+using llvm::Value;
+
+namespace {
+
+// The value of column 0 starts after the checksum, the tuple tag and the
+// column's own tag.
+const int firstColumnOffset = 4 + 1 + 1;
+
+struct SchemaFunctionSuffix {
+  const char* suffix;
+  SchemaFunction fn;
+};
+
+const SchemaFunctionSuffix schemaFunctionSuffixes[] = {
+  {"_col", schema_col},
+  {"_index", schema_index},
+  {"_col_at", schema_col_at},
+};
+
+// emitSkipColumn emits the skipping of the value at p of a column of type t
+// and returns the pointer past it.
+Value* emitSkipColumn(Function* f, IRBuilder<>& b, ColumnType t, Value* p) {
+  Value* end;
+  Value* u = EmitReadUvarint(f, b, p, &end);
+  if (t == col_int) {
+    return end;
+  }
+  // Decimals and bytes are length prefixed.
+  return b.CreateInBoundsGEP(end, u, "col_end");
+}
+
+// <schema>_col:
+//   entry:
+//     p0 = v + 6
+//     br col0
+//   col<i>:
+//     br (k == i), found<i>, skip<i>
+//   found<i>:
+//     ret p<i>
+//   skip<i>:
+//     p<i+1> = skip column i at p<i>, + 1 for the next column's tag
+//     br col<i+1>
+//   col<n>:
+//     ret null
+void emitCol(const SchemaAST& schema, Function* f, IRBuilder<>& b) {
+  auto argIt = f->arg_begin();
+  Value* v = &*argIt++;
+  Value* k = &*argIt++;
+  v->setName("v");
+  k->setName("k");
+
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* p = b.CreateInBoundsGEP(v, b.getInt32(firstColumnOffset), "p");
+  const auto& columns = schema.getColumns();
+  for (size_t i = 0; i < columns.size(); i++) {
+    BasicBlock* foundBB = BasicBlock::Create(f->getContext(), "found", f);
+    BasicBlock* skipBB = BasicBlock::Create(f->getContext(), "skip", f);
+    b.CreateCondBr(b.CreateICmpEQ(k, b.getInt64(i)), foundBB, skipBB);
+    b.SetInsertPoint(foundBB);
+    b.CreateRet(p);
+    b.SetInsertPoint(skipBB);
+    if (i + 1 < columns.size()) {
+      Value* end = emitSkipColumn(f, b, columns[i], p);
+      p = b.CreateInBoundsGEP(end, b.getInt32(1), "p");
+    }
+  }
+  b.CreateRet(llvm::ConstantPointerNull::get(b.getInt8PtrTy()));
+}
+
+// <schema>_index: the walk of <schema>_col over all the columns, storing
+// p<i> - v into offsets[i].
+void emitIndex(const SchemaAST& schema, Function* f, IRBuilder<>& b) {
+  auto argIt = f->arg_begin();
+  Value* v = &*argIt++;
+  Value* offsets = &*argIt++;
+  v->setName("v");
+  offsets->setName("offsets");
+
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* table = b.CreateBitCast(
+      offsets, b.getInt32Ty()->getPointerTo(), "table");
+  Value* vInt = b.CreatePtrToInt(v, b.getInt64Ty());
+  Value* p = b.CreateInBoundsGEP(v, b.getInt32(firstColumnOffset), "p");
+  const auto& columns = schema.getColumns();
+  for (size_t i = 0; i < columns.size(); i++) {
+    Value* off = b.CreateTrunc(
+        b.CreateSub(b.CreatePtrToInt(p, b.getInt64Ty()), vInt),
+        b.getInt32Ty(), "off");
+    b.CreateStore(off, b.CreateInBoundsGEP(table, b.getInt32(i)));
+    if (i + 1 < columns.size()) {
+      Value* end = emitSkipColumn(f, b, columns[i], p);
+      p = b.CreateInBoundsGEP(end, b.getInt32(1), "p");
+    }
+  }
+  b.CreateRet(offsets);
+}
+
+// <schema>_col_at: v + offsets[k].
+void emitColAt(Function* f, IRBuilder<>& b) {
+  auto argIt = f->arg_begin();
+  Value* v = &*argIt++;
+  Value* offsets = &*argIt++;
+  Value* k = &*argIt++;
+  v->setName("v");
+  offsets->setName("offsets");
+  k->setName("k");
+
+  b.SetInsertPoint(BasicBlock::Create(f->getContext(), "entry", f));
+  Value* table = b.CreateBitCast(
+      offsets, b.getInt32Ty()->getPointerTo(), "table");
+  Value* off = b.CreateLoad(b.CreateInBoundsGEP(table, k), "off");
+  b.CreateRet(b.CreateInBoundsGEP(v, b.CreateSExt(off, b.getInt64Ty())));
+}
+
+}  // namespace
+
+bool ParseSchemaFunctionName(
+    llvm::StringRef name, string* schema, SchemaFunction* fn) {
+  for (const auto& s : schemaFunctionSuffixes) {
+    size_t len = strlen(s.suffix);
+    if (name.size() > len && name.endswith(s.suffix)) {
+      *schema = name.drop_back(len).str();
+      *fn = s.fn;
+      return true;
+    }
+  }
+  return false;
+}
+
+Function* DefineSchemaFunction(
+    const SchemaAST& schema, SchemaFunction fn, llvm::Module* m) {
+  llvm::LLVMContext& c = m->getContext();
+  Type* i8PtrTy = Type::getInt8PtrTy(c);
+  Type* i64Ty = Type::getInt64Ty(c);
+  llvm::FunctionType* ft = nullptr;
+  string name = schema.getName().str();
+  switch (fn) {
+  case schema_col:
+    ft = llvm::FunctionType::get(i8PtrTy, {i8PtrTy, i64Ty}, false);
+    name += "_col";
+    break;
+  case schema_index:
+    ft = llvm::FunctionType::get(i8PtrTy, {i8PtrTy, i8PtrTy}, false);
+    name += "_index";
+    break;
+  case schema_col_at:
+    ft = llvm::FunctionType::get(i8PtrTy, {i8PtrTy, i8PtrTy, i64Ty}, false);
+    name += "_col_at";
+    break;
+  }
+
+  Function* f = Function::Create(ft, Function::InternalLinkage, name, m);
+  IRBuilder<> b(c);
+  switch (fn) {
+  case schema_col:
+    emitCol(schema, f, b);
+    break;
+  case schema_index:
+    emitIndex(schema, f, b);
+    break;
+  case schema_col_at:
+    emitColAt(f, b);
+    break;
+  }
+  f->addFnAttr(llvm::Attribute::AlwaysInline);
+  assert(!llvm::verifyFunction(*f, &llvm::errs()));
+  return f;
+}
+
+//===----------------------------------------------------------------------===//
+// Host versions
+//===----------------------------------------------------------------------===//
+
+static char* skipColumn(ColumnType t, char* p) {
+  return t == col_int ? skip_int(p) : skip_len_prefixed(p);
+}
+
+char* SchemaCol(const SchemaAST& schema, char* v, int64_t k) {
+  const auto& columns = schema.getColumns();
+  if (k < 0 || k >= int64_t(columns.size())) {
+    return nullptr;
+  }
+  char* p = v + firstColumnOffset;
+  for (int64_t i = 0; i < k; i++) {
+    p = skipColumn(columns[i], p) + 1;
+  }
+  return p;
+}
+
+char* SchemaIndex(const SchemaAST& schema, char* v, char* offsets) {
+  const auto& columns = schema.getColumns();
+  char* p = v + firstColumnOffset;
+  for (size_t i = 0; i < columns.size(); i++) {
+    int32_t off = int32_t(p - v);
+    memcpy(offsets + i * sizeof(int32_t), &off, sizeof(off));
+    if (i + 1 < columns.size()) {
+      p = skipColumn(columns[i], p) + 1;
+    }
+  }
+  return offsets;
+}
+
+char* SchemaColAt(char* v, char* offsets, int64_t k) {
+  int32_t off;
+  memcpy(&off, offsets + k * sizeof(int32_t), sizeof(off));
+  return v + off;
+}
@@ -0,0 +1,58 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <cstdint>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include "ast.h"
+
+// A schema declaration gives the program functions locating the columns of a
+// row's value, specialized for the schema's column types:
+//
+//   byte_ptr <schema>_col(byte_ptr v, int64 k)
+//     The value of column k (past its tag), found by walking the columns
+//     before it. Returns null if k is out of range. With a constant k, the
+//     walk is straight-line code.
+//   byte_ptr <schema>_index(byte_ptr v, byte_ptr offsets)
+//     Walks all the columns once, storing the int32 offset of every column's
+//     value from v in offsets, which needs room for one int32 per column.
+//     Returns offsets.
+//   byte_ptr <schema>_col_at(byte_ptr v, byte_ptr offsets, int64 k)
+//     The value of column k, from a table filled by <schema>_index.
+//
+// Predicates on several columns of the same row share the walk by going
+// through <schema>_index: a prog_main taking a third byte_ptr argument gets
+// the offsets of its row, filled in before it runs (see
+// CompilerSession::CodegenIndexedEntry).
+//
+// The row is expected to hold every column of the schema, with consecutive
+// column ids starting at 0: all the column tags are one byte and there are no
+// NULLs.
+
+// SchemaFunction is one of the functions a schema gets.
+enum SchemaFunction {
+  schema_col,
+  schema_index,
+  schema_col_at,
+};
+
+// ParseSchemaFunctionName splits name into the schema name and the function,
+// if it has the form of a schema function.
+bool ParseSchemaFunctionName(
+    llvm::StringRef name, std::string* schema, SchemaFunction* fn);
+
+// DefineSchemaFunction emits the function fn of the schema into m. Like the
+// runtime builtins, it has internal linkage and is marked always-inline.
+llvm::Function* DefineSchemaFunction(
+    const SchemaAST& schema, SchemaFunction fn, llvm::Module* m);
+
+// The host versions of the schema functions, for the interpreter.
+char* SchemaCol(const SchemaAST& schema, char* v, int64_t k);
+char* SchemaIndex(const SchemaAST& schema, char* v, char* offsets);
+char* SchemaColAt(char* v, char* offsets, int64_t k);
+
+#endif
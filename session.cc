@@ -0,0 +1,756 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+
+#include "ast.h"
+#include "diag.h"
+#include "object_cache.h"
+#include "schema.h"
+#include "session.h"
+
+using std::string;
+using std::unique_ptr;
+using std::make_unique;
+using std::vector;
+
+using llvm::BasicBlock;
+using llvm::Function;
+using llvm::PointerType;
+using llvm::Type;
+using llvm::Value;
+
+CompilerSession::CompilerSession(
+    llvm::orc::KaleidoscopeJIT& jit, const string& prog,
+    PredicateMode predicateMode, const ParamValues* paramValues,
+    CompileMode compileMode, ProfileMode profileMode, FilterProfile* profile)
+  : jit(jit),
+    optLevel(jit.getTargetMachine().getOptLevel()),
+    predicateMode(predicateMode),
+    paramValues(paramValues),
+    compileMode(compileMode),
+    profileMode(profile == nullptr ? profile_none : profileMode),
+    profile(profile),
+    tm(jit.createTargetMachine()),
+    lexer(prog),
+    parser(lexer, arena) {
+  ResetModule();
+}
+
+CompilerSession::~CompilerSession() {}
+
+void CompilerSession::ResetModule() {
+  // Open a new module. Every module gets a context of its own, which goes to
+  // the JIT with it: the JIT may compile the module on another thread while
+  // we're generating the next one. Whatever is left of the previous module
+  // (if it didn't make it to the JIT) goes before its context.
+  fpm.reset();
+  module.reset();
+  builder.reset();
+  context = std::make_unique<llvm::LLVMContext>();
+  builder = std::make_unique<llvm::IRBuilder<>>(*context);
+  module = std::make_unique<llvm::Module>("my cool jit", *context);
+  module->setDataLayout(tm->createDataLayout());
+  module->setTargetTriple(tm->getTargetTriple().str());
+
+  // Create a new pass manager attached to it.
+  fpm = std::make_unique<llvm::legacy::FunctionPassManager>(module.get());
+
+  // Promote allocas to registers.
+  fpm->add(llvm::createPromoteMemoryToRegisterPass());
+  // At O0 we only want short compile times; the rest is left to codegen.
+  if (optLevel > 0) {
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    fpm->add(llvm::createInstructionCombiningPass());
+    // Reassociate expressions.
+    fpm->add(llvm::createReassociatePass());
+    // Eliminate Common SubExpressions.
+    fpm->add(llvm::createGVNPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    fpm->add(llvm::createCFGSimplificationPass());
+  }
+  // !!!
+  fpm->add(llvm::createVerifierPass(true /* fatalErrors */));
+
+  fpm->doInitialization();
+}
+
+// countInstructions returns the number of IR instructions in m.
+static uint64_t countInstructions(const llvm::Module& m) {
+  uint64_t n = 0;
+  for (const Function& f : m) {
+    for (const BasicBlock& bb : f) {
+      n += bb.size();
+    }
+  }
+  return n;
+}
+
+void CompilerSession::OptimizeModule() {
+  PhaseScope phase(clock, phase_module_passes);
+  uint64_t numInstructions = countInstructions(*module);
+  stats.irInstructionsBeforeOpt += numInstructions;
+  // The module's IR as generated (before optimizing) identifies it in the
+  // object cache. If its object has been cached, the optimizations would be
+  // wasted. Instrumented code isn't cached: it increments this process's
+  // counters.
+  if (profileMode != profile_instrument) {
+    SetModuleCacheKey(module.get());
+    if (DiskObjectCache* objCache = jit.getObjectCache()) {
+      if (objCache->hasObject(*module)) {
+        stats.objectCacheHits++;
+        stats.irInstructionsAfterOpt += numInstructions;
+        return;
+      }
+      stats.objectCacheMisses++;
+    }
+  }
+
+  llvm::legacy::PassManager mpm;
+  mpm.add(new llvm::TargetLibraryInfoWrapperPass(tm->getTargetTriple()));
+  mpm.add(llvm::createTargetTransformInfoWrapperPass(tm->getTargetIRAnalysis()));
+
+  if (optLevel == 0) {
+    // Fast path for short ad-hoc queries: just inline the runtime library
+    // functions into their callers, which they're tiny enough to be worth it.
+    mpm.add(llvm::createAlwaysInlinerLegacyPass());
+  } else {
+    // The standard pipeline: inlining (which also takes care of the runtime
+    // library), SROA, LICM, loop unrolling, vectorization and the scalar
+    // cleanups in between.
+    llvm::PassManagerBuilder pmb;
+    pmb.OptLevel = optLevel;
+    pmb.SizeLevel = 0;
+    pmb.Inliner = llvm::createFunctionInliningPass(
+        optLevel, 0 /* sizeOptLevel */, false /* disableInlineHotCallSite */);
+    pmb.LoopVectorize = true;
+    pmb.SLPVectorize = true;
+    tm->adjustPassManager(pmb);
+    pmb.populateModulePassManager(mpm);
+  }
+  mpm.add(llvm::createVerifierPass(true /* fatalErrors */));
+  mpm.run(*module);
+  stats.irInstructionsAfterOpt += countInstructions(*module);
+}
+
+Function* CompilerSession::resolveFunction(llvm::StringRef name) {
+  Function* f = module->getFunction(name);
+  if (f) {
+    return f;
+  }
+  auto it = functionProtos.find(name.str());
+  if (it != functionProtos.end()) {
+    return it->second->codegen(*this);
+  }
+  string schemaName;
+  SchemaFunction schemaFn;
+  if (ParseSchemaFunctionName(name, &schemaName, &schemaFn)) {
+    auto schemaIt = schemas.find(schemaName);
+    if (schemaIt != schemas.end()) {
+      return DefineSchemaFunction(*schemaIt->second, schemaFn, module.get());
+    }
+  }
+  return nullptr;
+}
+
+bool CompilerSession::takesState(llvm::StringRef fnName) const {
+  return fnName == "prog_main" && !states.empty();
+}
+
+bool CompilerSession::takesOutputs(llvm::StringRef fnName) const {
+  return fnName == "prog_main" && !outputs.empty();
+}
+
+bool CompilerSession::takesParams(llvm::StringRef fnName) const {
+  return fnName == "prog_main" && !params.empty() && paramValues == nullptr;
+}
+
+vector<Type*> CompilerSession::hiddenArgTypes(llvm::StringRef fnName) {
+  vector<Type*> types;
+  Type* i64PtrTy = Type::getInt64PtrTy(*context);
+  if (takesState(fnName)) {
+    types.push_back(i64PtrTy);
+  }
+  if (takesOutputs(fnName)) {
+    types.push_back(PointerType::get(i64PtrTy, 0 /* address_space */));
+    types.push_back(Type::getInt64Ty(*context));
+  }
+  if (takesParams(fnName)) {
+    types.push_back(i64PtrTy);
+  }
+  return types;
+}
+
+unique_ptr<Variable> CompilerSession::getVar(llvm::StringRef name) {
+  auto it = namedValues.find(name.str());
+  if (it == namedValues.end()) {
+    return nullptr;
+  }
+  return make_unique<Variable>(it->second);
+}
+
+// Output the batch entry point for a row function as:
+//   define i32 @<name>_batch(i8** keys, i8** vals, i32 n, i8* out_bitmap,
+//                            i64* state, i64** out_cols, i64* params)
+//   entry:
+//     acc = alloca [<num states> x i64]
+//     acc[j] = state[j], for every state variable j
+//     cols = alloca [<num outputs> x i64*]
+//     cols[j] = out_cols[j], for every output variable j
+//     args = alloca [<num params> x i64]
+//     args[j] = params[j], for every parameter j
+//     br (n == 0), exit, loop
+//   loop:
+//     i = phi [0, entry], [i+1, loop]
+//     count = phi [0, entry], [count+match, loop]
+//     match = <name>(keys[i], vals[i], acc, cols, count, args) != 0
+//     out_bitmap[i/8] = (i%8 == 0 ? 0 : out_bitmap[i/8]) | match << (i%8)
+//     br (i+1 == n), exit, loop
+//   exit:
+//     state[j] = acc[j], for every state variable j
+//     ret count
+// The bitmap doesn't need to be zeroed by the caller; every byte covering the
+// n rows is written. The row function is in the same module, so the module
+// passes can inline it into the loop. Once it is, SROA turns acc, cols and
+// args into phis: the state variables, the column pointers and the parameters
+// are kept in registers for the whole batch instead of being reloaded after
+// each store to out_bitmap or to the columns, which could alias them. Every
+// row writes its outputs at row count of the columns; a row that doesn't
+// match is overwritten by the next one, so the matching rows come out packed
+// without a branch. The arguments for
+// variables the program doesn't have aren't passed on.
+Function* CompilerSession::CodegenBatchEntry(Function* rowFn) {
+  llvm::Type* i8Ty = Type::getInt8Ty(*context);
+  llvm::Type* i32Ty = Type::getInt32Ty(*context);
+  llvm::Type* i64Ty = Type::getInt64Ty(*context);
+  llvm::Type* i8PtrTy = PointerType::get(i8Ty, 0 /* address_space */);
+  llvm::Type* i8PtrPtrTy = PointerType::get(i8PtrTy, 0 /* address_space */);
+  llvm::Type* i64PtrTy = PointerType::get(i64Ty, 0 /* address_space */);
+  llvm::Type* i64PtrPtrTy = PointerType::get(i64PtrTy, 0 /* address_space */);
+
+  bool hasState = takesState(rowFn->getName());
+  bool hasOutputs = takesOutputs(rowFn->getName());
+  bool hasParams = takesParams(rowFn->getName());
+  llvm::FunctionType* rowFnTy = rowFn->getFunctionType();
+  if (rowFnTy->getReturnType() != i8Ty ||
+      rowFnTy->getNumParams() !=
+          2 + hiddenArgTypes(rowFn->getName()).size() ||
+      rowFnTy->getParamType(0) != i8PtrTy ||
+      rowFnTy->getParamType(1) != i8PtrTy) {
+    char msg[1000];
+    sprintf(msg, "%s must have signature byte(byte_ptr, byte_ptr) to get a "
+        "batch entry point", rowFn->getName().str().c_str());
+    logErrorV(msg);
+    return nullptr;
+  }
+
+  llvm::FunctionType* ft = llvm::FunctionType::get(
+      i32Ty,
+      {i8PtrPtrTy, i8PtrPtrTy, i32Ty, i8PtrTy, i64PtrTy, i64PtrPtrTy,
+       i64PtrTy},
+      false /* isVarArg */);
+  Function* f = Function::Create(
+      ft, Function::ExternalLinkage, rowFn->getName() + "_batch",
+      module.get());
+  auto argIt = f->arg_begin();
+  Value* keys = &*argIt++;
+  Value* vals = &*argIt++;
+  Value* n = &*argIt++;
+  Value* outBitmap = &*argIt++;
+  Value* state = &*argIt++;
+  Value* outCols = &*argIt++;
+  Value* inParams = &*argIt++;
+  keys->setName("keys");
+  vals->setName("vals");
+  n->setName("n");
+  outBitmap->setName("out_bitmap");
+  state->setName("state");
+  outCols->setName("out_cols");
+  inParams->setName("params");
+
+  BasicBlock* entryBB = BasicBlock::Create(*context, "entry", f);
+  BasicBlock* loopBB = BasicBlock::Create(*context, "loop", f);
+  BasicBlock* exitBB = BasicBlock::Create(*context, "exit", f);
+
+  builder->SetInsertPoint(entryBB);
+  Value* acc = nullptr;
+  if (hasState) {
+    acc = builder->CreateBitCast(
+        builder->CreateAlloca(
+            llvm::ArrayType::get(i64Ty, states.size()), nullptr, "acc_table"),
+        i64PtrTy, "acc");
+    for (size_t j = 0; j < states.size(); j++) {
+      builder->CreateStore(
+          builder->CreateLoad(builder->CreateConstInBoundsGEP1_64(state, j)),
+          builder->CreateConstInBoundsGEP1_64(acc, j));
+    }
+  }
+  Value* cols = nullptr;
+  if (hasOutputs) {
+    cols = builder->CreateBitCast(
+        builder->CreateAlloca(
+            llvm::ArrayType::get(i64PtrTy, outputs.size()), nullptr,
+            "cols_table"),
+        i64PtrPtrTy, "cols");
+    for (size_t j = 0; j < outputs.size(); j++) {
+      builder->CreateStore(
+          builder->CreateLoad(builder->CreateConstInBoundsGEP1_64(outCols, j)),
+          builder->CreateConstInBoundsGEP1_64(cols, j));
+    }
+  }
+  Value* paramArgs = nullptr;
+  if (hasParams) {
+    paramArgs = builder->CreateBitCast(
+        builder->CreateAlloca(
+            llvm::ArrayType::get(i64Ty, params.size()), nullptr,
+            "args_table"),
+        i64PtrTy, "args");
+    for (size_t j = 0; j < params.size(); j++) {
+      builder->CreateStore(
+          builder->CreateLoad(
+              builder->CreateConstInBoundsGEP1_64(inParams, j)),
+          builder->CreateConstInBoundsGEP1_64(paramArgs, j));
+    }
+  }
+  Value* zero32 = llvm::ConstantInt::get(i32Ty, 0);
+  builder->CreateCondBr(
+      builder->CreateICmpEQ(n, zero32, "empty"), exitBB, loopBB);
+
+  builder->SetInsertPoint(loopBB);
+  llvm::PHINode* i = builder->CreatePHI(i32Ty, 2, "i");
+  llvm::PHINode* count = builder->CreatePHI(i32Ty, 2, "count");
+  i->addIncoming(zero32, entryBB);
+  count->addIncoming(zero32, entryBB);
+
+  Value* idx = builder->CreateZExt(i, Type::getInt64Ty(*context), "idx");
+  Value* k = builder->CreateLoad(builder->CreateInBoundsGEP(keys, idx), "k");
+  Value* v = builder->CreateLoad(builder->CreateInBoundsGEP(vals, idx), "v");
+  vector<Value*> args = {k, v};
+  if (hasState) {
+    args.push_back(acc);
+  }
+  if (hasOutputs) {
+    args.push_back(cols);
+    args.push_back(builder->CreateZExt(count, i64Ty, "out_row"));
+  }
+  if (hasParams) {
+    args.push_back(paramArgs);
+  }
+  Value* res = builder->CreateCall(rowFn, args, "res");
+  Value* match = builder->CreateZExt(
+      builder->CreateICmpNE(res, llvm::ConstantInt::get(i8Ty, 0)), i32Ty,
+      "match");
+
+  // Set bit i%8 of byte i/8. The first row of every byte resets it.
+  Value* bytePtr = builder->CreateInBoundsGEP(
+      outBitmap,
+      builder->CreateZExt(
+          builder->CreateLShr(i, 3), Type::getInt64Ty(*context)),
+      "byte_ptr");
+  Value* bitIdx = builder->CreateAnd(i, 7, "bit_idx");
+  Value* oldByte = builder->CreateSelect(
+      builder->CreateICmpEQ(bitIdx, zero32),
+      llvm::ConstantInt::get(i8Ty, 0),
+      builder->CreateLoad(bytePtr, "old_byte"));
+  Value* bit = builder->CreateTrunc(
+      builder->CreateShl(match, bitIdx), i8Ty, "bit");
+  builder->CreateStore(builder->CreateOr(oldByte, bit), bytePtr);
+
+  Value* nextCount = builder->CreateAdd(count, match, "next_count");
+  Value* nextI = builder->CreateAdd(
+      i, llvm::ConstantInt::get(i32Ty, 1), "next_i");
+  i->addIncoming(nextI, loopBB);
+  count->addIncoming(nextCount, loopBB);
+  builder->CreateCondBr(
+      builder->CreateICmpEQ(nextI, n, "done"), exitBB, loopBB);
+
+  builder->SetInsertPoint(exitBB);
+  llvm::PHINode* total = builder->CreatePHI(i32Ty, 2, "total");
+  total->addIncoming(zero32, entryBB);
+  total->addIncoming(nextCount, loopBB);
+  for (size_t j = 0; hasState && j < states.size(); j++) {
+    builder->CreateStore(
+        builder->CreateLoad(builder->CreateConstInBoundsGEP1_64(acc, j)),
+        builder->CreateConstInBoundsGEP1_64(state, j));
+  }
+  builder->CreateRet(total);
+
+  assert(!llvm::verifyFunction(*f, &llvm::errs()));
+
+  fpm->run(*f);
+
+  return f;
+}
+
+// Output the row function for an indexed one as:
+//   define i8 @<name>(i8* k, i8* v, <hidden args>)
+//   entry:
+//     offsets = alloca [<num columns> x i32]
+//     <schema>_index(v, offsets)
+//     ret <name>_indexed(k, v, offsets, <hidden args>)
+// Once the schema functions are inlined, the columns are walked once per row
+// and every <schema>_col_at in the indexed function is a load from the table.
+Function* CompilerSession::CodegenIndexedEntry(
+    Function* indexedFn, const string& name, const SchemaAST& schema) {
+  llvm::Type* i8Ty = Type::getInt8Ty(*context);
+  llvm::Type* i8PtrTy = Type::getInt8PtrTy(*context);
+  vector<Type*> hiddenTypes = hiddenArgTypes(name);
+  llvm::FunctionType* indexedFnTy = indexedFn->getFunctionType();
+  if (indexedFnTy->getReturnType() != i8Ty ||
+      indexedFnTy->getNumParams() != 3 + hiddenTypes.size() ||
+      indexedFnTy->getParamType(0) != i8PtrTy ||
+      indexedFnTy->getParamType(1) != i8PtrTy ||
+      indexedFnTy->getParamType(2) != i8PtrTy) {
+    char msg[1000];
+    sprintf(msg, "%s must have signature byte(byte_ptr, byte_ptr, byte_ptr) "
+        "to take column offsets", name.c_str());
+    logErrorV(msg);
+    return nullptr;
+  }
+  indexedFn->setName(name + "_indexed");
+
+  vector<Type*> paramTypes = {i8PtrTy, i8PtrTy};
+  paramTypes.insert(paramTypes.end(), hiddenTypes.begin(), hiddenTypes.end());
+  llvm::FunctionType* ft = llvm::FunctionType::get(
+      i8Ty, paramTypes, false /* isVarArg */);
+  Function* f = Function::Create(
+      ft, Function::ExternalLinkage, name, module.get());
+  auto argIt = f->arg_begin();
+  Value* k = &*argIt++;
+  Value* v = &*argIt++;
+  k->setName("k");
+  v->setName("v");
+
+  builder->SetInsertPoint(BasicBlock::Create(*context, "entry", f));
+  llvm::Type* tableTy = llvm::ArrayType::get(
+      Type::getInt32Ty(*context), schema.getColumns().size());
+  Value* offsets = builder->CreateBitCast(
+      builder->CreateAlloca(tableTy, nullptr, "table"), i8PtrTy, "offsets");
+  Function* indexFn = resolveFunction(schema.getName().str() + "_index");
+  builder->CreateCall(indexFn, {v, offsets});
+  vector<Value*> args = {k, v, offsets};
+  for (auto a = std::next(indexedFn->arg_begin(), 3);
+       a != indexedFn->arg_end(); ++a) {
+    // The hidden arguments, in the same order.
+    Value* hidden = &*argIt++;
+    hidden->setName(a->getName());
+    args.push_back(hidden);
+  }
+  builder->CreateRet(builder->CreateCall(indexedFn, args, "res"));
+
+  assert(!llvm::verifyFunction(*f, &llvm::errs()));
+
+  fpm->run(*f);
+
+  return f;
+}
+
+CompilerSession::ModuleHandleT CompilerSession::addModule() {
+  OptimizeModule();
+  // The pass manager holds on to the module, which is about to be used by
+  // other threads.
+  fpm.reset();
+  // The module binds to this program's earlier definitions rather than to
+  // other programs' ones.
+  ModuleHandleT h;
+  {
+    PhaseScope phase(clock, phase_jit_add);
+    h = jit.addModule(std::move(module), std::move(context), addedModules);
+  }
+  stats.numModules++;
+  ResetModule();
+  return h;
+}
+
+void CompilerSession::addDefinitions() {
+  vector<string> defined;
+  for (const Function& f : *module) {
+    if (!f.isDeclaration() && !f.hasLocalLinkage()) {
+      defined.push_back(f.getName().str());
+    }
+  }
+  if (defined.empty()) {
+    return;
+  }
+  ModuleHandleT h = addModule();
+  addedModules.push_back(h);
+  trackDefinitions(h, defined);
+}
+
+void CompilerSession::trackDefinitions(
+    ModuleHandleT h, const vector<string>& names) {
+  for (const string& name : names) {
+    auto it = definingModule.find(name);
+    if (it != definingModule.end() && --liveDefinitions[it->second] == 0) {
+      // Nothing binds to the old module anymore. The JIT keeps its code for
+      // as long as the modules already linked against it are around.
+      ModuleHandleT old = it->second;
+      liveDefinitions.erase(old);
+      jit.removeModule(old);
+      addedModules.erase(
+          std::find(addedModules.begin(), addedModules.end(), old));
+      stats.numModulesReclaimed++;
+    }
+    definingModule[name] = h;
+    liveDefinitions[h]++;
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing
+//===----------------------------------------------------------------------===//
+
+void CompilerSession::HandleDefinition() {
+  if (auto fnAST = parser.ParseDefinition()) {
+    if (compileMode == compile_whole_program) {
+      // A function is only defined once per module; the module with the
+      // definition this one replaces goes to the JIT as it is.
+      Function* prev = module->getFunction(fnAST->getProto().getName());
+      if (prev != nullptr && !prev->isDeclaration()) {
+        addDefinitions();
+      }
+    }
+    PhaseScope phase(clock, phase_codegen);
+    if (auto* fnIR = fnAST->codegen(*this)) {
+      DiagPrint(diag_ir, "Read function definition:", *fnIR);
+      // The filter entry point also gets a batch version, in the same module
+      // so that it can be inlined into the loop. A prog_main taking the
+      // offsets of the row's columns is called through a row function
+      // computing them, with the program's schema.
+      if (fnIR->getName() == "prog_main") {
+        if (fnAST->getProto().getArgNames().size() == 3) {
+          if (schemas.size() != 1) {
+            logErrorV("a prog_main taking column offsets needs the program "
+                "to declare exactly one schema");
+            fnIR = nullptr;
+          } else {
+            fnIR = CodegenIndexedEntry(
+                fnIR, "prog_main", *schemas.begin()->second);
+          }
+        }
+        if (fnIR) {
+          CodegenBatchEntry(fnIR);
+        }
+      }
+      // Add a module with this function and create a new module for future
+      // code. A whole program is added once it's been read.
+      if (compileMode == compile_per_definition) {
+        addDefinitions();
+      }
+    }
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+void CompilerSession::HandleExtern() {
+  if (auto protoAST = parser.ParseExtern()) {
+    PhaseScope phase(clock, phase_codegen);
+    if (auto* fnIR = protoAST->codegen(*this)) {
+      DiagPrint(diag_ir, "Read extern:", *fnIR);
+      // Add the signature to the list of functions.
+      functionProtos[protoAST->getName().str()] = protoAST;
+    }
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+void CompilerSession::HandleSchema() {
+  if (auto schemaAST = parser.ParseSchema()) {
+    Diag(diag_info, "Read schema: %s", schemaAST->getName().data());
+    // The schema's functions are generated in the modules that call them.
+    schemas[schemaAST->getName().str()] = schemaAST;
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+void CompilerSession::HandleState() {
+  if (auto stateAST = parser.ParseState()) {
+    Diag(diag_info, "Read state: %s", stateAST->getName().data());
+    if (functionProtos.count("prog_main") != 0) {
+      // prog_main has been generated with the state it had.
+      Diag(diag_error, "state %s needs to be declared before prog_main",
+          stateAST->getName().data());
+      return;
+    }
+    if (isDeclaredVariable(stateAST->getName())) {
+      Diag(diag_error, "state %s is declared twice",
+          stateAST->getName().data());
+      return;
+    }
+    states.push_back(stateAST);
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+void CompilerSession::HandleOutput() {
+  if (auto outputAST = parser.ParseOutput()) {
+    Diag(diag_info, "Read output: %s", outputAST->getName().data());
+    if (functionProtos.count("prog_main") != 0) {
+      // prog_main has been generated with the outputs it had.
+      Diag(diag_error, "output %s needs to be declared before prog_main",
+          outputAST->getName().data());
+      return;
+    }
+    if (isDeclaredVariable(outputAST->getName())) {
+      Diag(diag_error, "output %s is declared twice",
+          outputAST->getName().data());
+      return;
+    }
+    outputs.push_back(outputAST);
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+void CompilerSession::HandleParam() {
+  if (auto paramAST = parser.ParseParam()) {
+    Diag(diag_info, "Read param: %s", paramAST->getName().data());
+    if (functionProtos.count("prog_main") != 0) {
+      // prog_main has been generated with the parameters it had.
+      Diag(diag_error, "param %s needs to be declared before prog_main",
+          paramAST->getName().data());
+      return;
+    }
+    if (isDeclaredVariable(paramAST->getName())) {
+      Diag(diag_error, "param %s is declared twice",
+          paramAST->getName().data());
+      return;
+    }
+    params.push_back(paramAST);
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+bool CompilerSession::isDeclaredVariable(llvm::StringRef name) const {
+  for (const StateAST* s : states) {
+    if (s->getName() == name) {
+      return true;
+    }
+  }
+  for (const OutputAST* o : outputs) {
+    if (o->getName() == name) {
+      return true;
+    }
+  }
+  for (const ParamAST* p : params) {
+    if (p->getName() == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CompilerSession::HandleTopLevelExpression() {
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto fnAST = parser.ParseTopLevelExpr()) {
+    // The expression runs right away, with the definitions read so far; they
+    // need to be in the JIT, rather than in the module the expression's
+    // function is about to be removed with.
+    if (compileMode == compile_whole_program) {
+      addDefinitions();
+    }
+    PhaseScope phase(clock, phase_codegen);
+    if (auto* fnIR = fnAST->codegen(*this)) {
+      DiagPrint(diag_ir, "Read a top-level expr:", *fnIR);
+
+      // JIT the module containing the anonymous expression, keeping a handle
+      // so we can free it later.
+      ModuleHandleT modHandle = addModule();
+
+      // Other sessions might be evaluating their own __anon_expr.
+      char (*fp)() = nullptr;
+      {
+        PhaseScope lookupPhase(clock, phase_jit_lookup);
+        llvm::JITSymbol exprSymbol =
+            jit.findSymbolIn(modHandle, "__anon_expr");
+        assert(exprSymbol && "Function not found");
+
+        // Get the symbol's address and cast it to the right type (takes no
+        // arguments, returns a byte) so we can call it as a native function.
+        fp = (char(*)())(intptr_t)(*exprSymbol.getAddress());
+      }
+      char res;
+      {
+        // Running the expression isn't part of the compilation.
+        PhaseScope runPhase(clock, phase_none);
+        res = fp();
+      }
+      Diag(diag_info, "Evaluated to: %d", int(res));
+
+      // Remove the module with the anonymous function.
+      jit.removeModule(modHandle);
+    }
+  } else {
+    // Skip token for error recovery.
+    parser.getNextToken();
+  }
+}
+
+/// top ::= definition | external | schema | state | output | param
+///       | expression | ';'
+void CompilerSession::MainLoop() {
+  // The time that isn't spent on a definition or an expression once it's been
+  // parsed goes to the parser.
+  PhaseScope phase(clock, phase_parse);
+  while (1) {
+    switch (parser.CurTok) {
+    case tok_eof:
+      if (compileMode == compile_whole_program) {
+        addDefinitions();
+      }
+      return;
+    case tok_semi: // ignore top-level semicolons.
+      parser.getNextToken();
+      break;
+    case tok_def:
+      HandleDefinition();
+      break;
+    case tok_extern:
+      HandleExtern();
+      break;
+    case tok_schema:
+      HandleSchema();
+      break;
+    case tok_state:
+      HandleState();
+      break;
+    case tok_output:
+      HandleOutput();
+      break;
+    case tok_param:
+      HandleParam();
+      break;
+    default:
+      HandleTopLevelExpression();
+      break;
+    }
+  }
+}
@@ -0,0 +1,271 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "kaleidoscpe_jit.h"
+#include "lexer.h"
+#include "parser.h"
+#include "profile.h"
+#include "stats.h"
+
+class PrototypeAST;
+class SchemaAST;
+class StateAST;
+class OutputAST;
+class ParamAST;
+
+struct Variable {
+  VarType type;
+  llvm::Type* llvmType;
+  // Space for the value: an alloca, or the variable's slot in the state of a
+  // function taking it (see CompilerSession::takesState).
+  llvm::Value* addr;
+
+  Variable(VarType type, llvm::Type* llvmType, llvm::Value* addr)
+    : type(type), llvmType(llvmType), addr(addr) {}
+};
+
+// ParamValue is the value of one of a program's parameters (see ParamAST).
+struct ParamValue {
+  VarType type;
+  // The value of an int64 parameter.
+  int64_t ival = 0;
+  // The bytes a byte_ptr parameter points to. The program gets their length
+  // some other way, as a literal or another parameter.
+  std::string sval;
+
+  static ParamValue Int64(int64_t v) {
+    ParamValue p;
+    p.type = type_int64;
+    p.ival = v;
+    return p;
+  }
+  static ParamValue Bytes(std::string v) {
+    ParamValue p;
+    p.type = type_byte_ptr;
+    p.sval = std::move(v);
+    return p;
+  }
+};
+
+// The values of all the parameters of a program, in declaration order.
+using ParamValues = std::vector<ParamValue>;
+
+// PredicateMode is how conditions are lowered.
+enum PredicateMode {
+  // && and || short-circuit, and ifs branch. That's cheapest when the branches
+  // are predictable, for predicates matching few or most of the rows.
+  pred_branching,
+  // Both operands of && and || are evaluated and combined, and ifs that just
+  // return (see StatementAST::isReturnTree) select the returned value without
+  // branching. That avoids the mispredictions of predicates matching about
+  // half of the rows, at the cost of evaluating every comparison. Only the
+  // operands and branches that are pure (see ExprAST::isPure) get evaluated
+  // regardless of the conditions before them: the others, like dereferences
+  // guarded by a bounds check, keep short-circuiting and branching, so that
+  // the program does what it does in branching mode.
+  pred_branchless,
+};
+
+// CompileMode is how a program's definitions are split into modules.
+enum CompileMode {
+  // Every definition gets a module of its own, handed to the JIT as soon as
+  // it's been read, like in a REPL: the expressions that follow can call it.
+  // Calls to the functions of other modules are linked as external symbols,
+  // which rules out inlining them.
+  compile_per_definition,
+  // The definitions go to one module, optimized and compiled once the whole
+  // program has been read: calls between the program's functions are direct
+  // and get inlined, and the program costs one machine code emit. A top-level
+  // expression, or a definition replacing one in the module, first hands the
+  // module so far to the JIT.
+  compile_whole_program,
+};
+
+// CompilerSession is the state of one compilation: the lexer and the parser
+// reading the program, the LLVMContext and the module code is generated into,
+// and the symbol tables. Sessions don't share anything but the JIT, which is
+// thread safe, so N threads can each compile a program into the same JIT
+// through their own session. A session itself is only used by one thread at a
+// time.
+class CompilerSession {
+public:
+  using ModuleHandleT = llvm::orc::KaleidoscopeJIT::ModuleHandleT;
+
+  // If paramValues isn't null, the program is specialized for them: its
+  // parameters are constants, and prog_main doesn't take them. paramValues
+  // needs to outlive the session. Unless profileMode is profile_none, the
+  // code is instrumented into profile, or generated with its counts (see
+  // ProfileMode); profile needs to be of the same program, and to outlive
+  // the session (and, for instrumented code, the code).
+  CompilerSession(llvm::orc::KaleidoscopeJIT& jit, const std::string& prog,
+                  PredicateMode predicateMode = pred_branching,
+                  const ParamValues* paramValues = nullptr,
+                  CompileMode compileMode = compile_per_definition,
+                  ProfileMode profileMode = profile_none,
+                  FilterProfile* profile = nullptr);
+  ~CompilerSession();
+
+  // MainLoop compiles the whole program, adding modules to the JIT for its
+  // definitions (see CompileMode) and running the top-level expressions.
+  void MainLoop();
+
+  // The modules MainLoop added to the JIT for definitions, in order. The
+  // session only removes the ones whose definitions have all been replaced by
+  // later ones (see trackDefinitions); whoever wants to own the program's code
+  // takes the rest.
+  std::vector<ModuleHandleT>& getAddedModules() { return addedModules; }
+  llvm::orc::KaleidoscopeJIT& getJIT() { return jit; }
+  PredicateMode getPredicateMode() const { return predicateMode; }
+  CompileMode getCompileMode() const { return compileMode; }
+  ProfileMode getProfileMode() const { return profileMode; }
+  // The profile the code is instrumented into or generated with, or nullptr.
+  FilterProfile* getProfile() const { return profile; }
+  // The values the program is specialized for, or nullptr.
+  const ParamValues* getParamValues() const { return paramValues; }
+  // The counters of the compilation so far. The JIT's side of them (machine
+  // code and object sizes) is filled in by CompileFilter.
+  const CompileStats& getStats() const { return stats; }
+  // The session's TargetMachine; the runtime builtins are specialized for its
+  // CPU.
+  const llvm::TargetMachine& getTargetMachine() const { return *tm; }
+
+  // ResetModule opens a new module, with a new context, for the code that
+  // follows.
+  void ResetModule();
+  // OptimizeModule runs the module level passes over the module. It's called
+  // once the module is complete, just before it's handed to the JIT.
+  void OptimizeModule();
+
+  // takesState returns true if the named function gets the program's state
+  // variables: it's prog_main, and the program declares some. Such a
+  // function takes a pointer to them, an int64 per variable in declaration
+  // order, as an argument the program doesn't see.
+  bool takesState(llvm::StringRef fnName) const;
+  // takesOutputs is takesState for the output variables. The function takes
+  // the output columns (int64**, one per variable in declaration order) and
+  // the row to write in them (int64).
+  bool takesOutputs(llvm::StringRef fnName) const;
+  // takesParams is takesState for the parameters, unless the session is
+  // specialized for their values. The function takes a pointer to them, an
+  // int64 per parameter in declaration order; a byte_ptr parameter's is the
+  // pointer.
+  bool takesParams(llvm::StringRef fnName) const;
+  // hiddenArgTypes returns the types of the arguments the named function
+  // takes after the ones the program declares: the state, the outputs, then
+  // the parameters.
+  std::vector<llvm::Type*> hiddenArgTypes(llvm::StringRef fnName);
+
+  // CodegenBatchEntry emits
+  //   <name>_batch(keys, vals, n, out_bitmap, state, out_cols, params)
+  // into the current module. It calls rowFn on each of the n (key, value)
+  // rows, sets bit i of out_bitmap if row i matched and returns the number of
+  // matches. rowFn must be a byte(byte_ptr, byte_ptr) function in the current
+  // module, taking the hidden arguments too. state is the in/out array of
+  // the state variables. out_cols are the output columns, n int64s each: the
+  // outputs of the k-th matching row go to row k. params are the values of
+  // the parameters, only read. Any of them is unused, and can be null, if the
+  // program has no such variables (or its parameters are constants).
+  llvm::Function* CodegenBatchEntry(llvm::Function* rowFn);
+  // CodegenIndexedEntry takes indexedFn, a byte(byte_ptr k, byte_ptr v,
+  // byte_ptr offsets) function in the current module, and emits the
+  // byte(byte_ptr k, byte_ptr v) row function name calling it with the offsets
+  // of v's columns, filled by <schema>_index. indexedFn is renamed
+  // <name>_indexed. If indexedFn takes hidden arguments, so does the row
+  // function, which passes them on.
+  llvm::Function* CodegenIndexedEntry(
+      llvm::Function* indexedFn, const std::string& name,
+      const SchemaAST& schema);
+
+  // resolveFunction takes a function name and returns the corresponding
+  // Function from the current module (if present) or generates the function
+  // from a registered prototype if the function had previously been generated
+  // in another module. The functions of the declared schemas are generated on
+  // demand too (see schema.h).
+  llvm::Function* resolveFunction(llvm::StringRef name);
+  // getVar returns a copy of the named variable, or nullptr.
+  std::unique_ptr<Variable> getVar(llvm::StringRef name);
+
+private:
+  // addModule optimizes the current module and hands it to the JIT, with its
+  // context, and opens a new one.
+  ModuleHandleT addModule();
+  // addDefinitions adds the current module, with the definitions generated
+  // into it, to the JIT and to addedModules. A module without definitions
+  // isn't added, and stays the current one.
+  void addDefinitions();
+  // trackDefinitions records that module h, just added, defines the named
+  // functions. The modules with the definitions they replace are removed
+  // from the JIT once they have no definition left that's still current.
+  void trackDefinitions(
+      ModuleHandleT h, const std::vector<std::string>& names);
+  void HandleDefinition();
+  void HandleExtern();
+  void HandleSchema();
+  void HandleState();
+  void HandleOutput();
+  void HandleParam();
+  // isDeclaredVariable returns true if name is a declared state, output or
+  // parameter variable.
+  bool isDeclaredVariable(llvm::StringRef name) const;
+  void HandleTopLevelExpression();
+
+  llvm::orc::KaleidoscopeJIT& jit;
+  // The optimization level of the JIT (0-3).
+  const unsigned optLevel;
+  const PredicateMode predicateMode;
+  const ParamValues* const paramValues;
+  const CompileMode compileMode;
+  const ProfileMode profileMode;
+  FilterProfile* const profile;
+  // The session's own TargetMachine, for the target specific analyses in
+  // OptimizeModule; the JIT's can't be shared between threads.
+  std::unique_ptr<llvm::TargetMachine> tm;
+  Lexer lexer;
+  // The program's AST; it lives as long as the session, as the prototypes in
+  // functionProtos are used to redeclare functions in later modules.
+  ASTArena arena;
+  Parser parser;
+  std::vector<ModuleHandleT> addedModules;
+  // The module with the current definition of every function defined so far,
+  // and the number of current definitions in each of addedModules.
+  std::map<std::string, ModuleHandleT> definingModule;
+  std::map<ModuleHandleT, unsigned> liveDefinitions;
+  CompileStats stats;
+
+public:
+  // The state the AST nodes generate code with. The context and the builder
+  // belong to the current module (see ResetModule); the context is declared
+  // first so that it's destroyed last.
+  std::unique_ptr<llvm::LLVMContext> context;
+  std::unique_ptr<llvm::IRBuilder<>> builder;
+  std::unique_ptr<llvm::Module> module;
+  std::unique_ptr<llvm::legacy::FunctionPassManager> fpm;
+  // Times the phases of the compilation into the session's stats.
+  PhaseClock clock{&stats};
+  // Variable name to space where the value is stored.
+  std::map<std::string, Variable> namedValues;
+  // Map of function name to the (latest) prototype declared with that name.
+  std::map<std::string, const PrototypeAST*> functionProtos;
+  // The declared schemas, by name.
+  std::map<std::string, const SchemaAST*> schemas;
+  // The declared state variables, in order: the layout of the state.
+  std::vector<const StateAST*> states;
+  // The declared output variables, in the order of their columns.
+  std::vector<const OutputAST*> outputs;
+  // The declared parameters, in order: the layout of their values.
+  std::vector<const ParamAST*> params;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include <sstream>
+#include <string>
+
+#include "stats.h"
+
+const char* CompilePhaseName(CompilePhase p) {
+  switch (p) {
+  case phase_parse:
+    return "parse";
+  case phase_codegen:
+    return "codegen";
+  case phase_function_passes:
+    return "function_passes";
+  case phase_module_passes:
+    return "module_passes";
+  case phase_jit_add:
+    return "jit_add";
+  case phase_jit_lookup:
+    return "jit_lookup";
+  case phase_none:
+    break;
+  }
+  return "none";
+}
+
+void CompileStats::add(const CompileStats& o) {
+  for (int p = 0; p < num_compile_phases; p++) {
+    phaseNanos[p] += o.phaseNanos[p];
+  }
+  machineCodeNanos += o.machineCodeNanos;
+  numModules += o.numModules;
+  numModulesCompiled += o.numModulesCompiled;
+  numModulesReclaimed += o.numModulesReclaimed;
+  irInstructionsBeforeOpt += o.irInstructionsBeforeOpt;
+  irInstructionsAfterOpt += o.irInstructionsAfterOpt;
+  codeBytes += o.codeBytes;
+  memoryBytes += o.memoryBytes;
+  objectCacheHits += o.objectCacheHits;
+  objectCacheMisses += o.objectCacheMisses;
+}
+
+std::string CompileStats::toJSON() const {
+  std::ostringstream s;
+  s << "{\"phase_ns\": {";
+  for (int p = 0; p < num_compile_phases; p++) {
+    if (p > 0) {
+      s << ", ";
+    }
+    s << "\"" << CompilePhaseName(CompilePhase(p)) << "\": " << phaseNanos[p];
+  }
+  s << "}, \"machine_code_ns\": " << machineCodeNanos
+    << ", \"modules\": " << numModules
+    << ", \"modules_compiled\": " << numModulesCompiled
+    << ", \"modules_reclaimed\": " << numModulesReclaimed
+    << ", \"ir_instructions_before_opt\": " << irInstructionsBeforeOpt
+    << ", \"ir_instructions_after_opt\": " << irInstructionsAfterOpt
+    << ", \"code_bytes\": " << codeBytes
+    << ", \"memory_bytes\": " << memoryBytes
+    << ", \"object_cache_hits\": " << objectCacheHits
+    << ", \"object_cache_misses\": " << objectCacheMisses
+    << "}";
+  return s.str();
+}
@@ -0,0 +1,106 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// The phases of a compilation, for timing. They don't overlap: the time spent
+// in a phase started from within another one counts for the inner phase only.
+enum CompilePhase {
+  phase_parse,            // Lexing and parsing.
+  phase_codegen,          // Generating IR.
+  phase_function_passes,  // The passes run over each function as it's done.
+  phase_module_passes,    // The pipeline run over a complete module.
+  phase_jit_add,          // KaleidoscopeJIT::addModule. Includes generating
+                          // the machine code unless the JIT is lazy or has
+                          // compile threads.
+  phase_jit_lookup,       // KaleidoscopeJIT::findSymbol(In). Includes linking,
+                          // and compiling lazy modules.
+  num_compile_phases,
+  // Time that isn't counted.
+  phase_none = num_compile_phases,
+};
+
+// CompileStats are the counters of a compilation (or of several, added up).
+// A CompilerSession keeps them as it goes, and CompileFilter completes them
+// with what the JIT did with the program's modules.
+struct CompileStats {
+  // Wall time, in nanoseconds.
+  uint64_t phaseNanos[num_compile_phases] = {};
+  // The time spent generating machine code for the program's modules, on
+  // whatever thread compiled them. It's part of phase_jit_add or
+  // phase_jit_lookup when the compiling thread is the session's.
+  uint64_t machineCodeNanos = 0;
+
+  // The modules handed to the JIT, and how many of them it had compiled when
+  // the program's entry points were resolved.
+  uint64_t numModules = 0;
+  uint64_t numModulesCompiled = 0;
+  // The modules removed again because every function they defined was
+  // redefined by a later one.
+  uint64_t numModulesReclaimed = 0;
+  // The IR instructions of the modules as generated (after the function
+  // passes) and after the module pipeline. Modules whose object is in the
+  // object cache aren't optimized.
+  uint64_t irInstructionsBeforeOpt = 0;
+  uint64_t irInstructionsAfterOpt = 0;
+  // The size of the object files of the compiled modules.
+  uint64_t codeBytes = 0;
+  // The memory taken by the code and data sections of the modules linked by
+  // the time the entry points are resolved.
+  uint64_t memoryBytes = 0;
+  // Lookups of the modules in the JIT's object cache, if it has one.
+  uint64_t objectCacheHits = 0;
+  uint64_t objectCacheMisses = 0;
+
+  void add(const CompileStats& o);
+  // toJSON returns the stats as a JSON object.
+  std::string toJSON() const;
+};
+
+// CompilePhaseName returns the name of the phase in toJSON, like "parse".
+const char* CompilePhaseName(CompilePhase p);
+
+// PhaseClock attributes wall time to the phases of a CompileStats. It isn't
+// thread safe; every session has its own.
+class PhaseClock {
+public:
+  explicit PhaseClock(CompileStats* stats) : stats(stats) {}
+
+  // enter starts counting the time towards phase p, and returns the phase it
+  // was counted towards until now.
+  CompilePhase enter(CompilePhase p) {
+    auto now = std::chrono::steady_clock::now();
+    if (cur != phase_none) {
+      stats->phaseNanos[cur] += std::chrono::duration_cast<
+          std::chrono::nanoseconds>(now - since).count();
+    }
+    CompilePhase prev = cur;
+    cur = p;
+    since = now;
+    return prev;
+  }
+
+private:
+  CompileStats* stats;
+  CompilePhase cur = phase_none;
+  std::chrono::steady_clock::time_point since;
+};
+
+// PhaseScope counts the time of its scope towards a phase, and then goes back
+// to the enclosing phase.
+class PhaseScope {
+public:
+  PhaseScope(PhaseClock& clock, CompilePhase p)
+    : clock(clock), prev(clock.enter(p)) {}
+  ~PhaseScope() { clock.enter(prev); }
+  PhaseScope(const PhaseScope&) = delete;
+  PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+  PhaseClock& clock;
+  const CompilePhase prev;
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "diag.h"
+#include "lexer.h"
+#include "parser.h"
+#include "schema.h"
+#include "tiered.h"
+
+using std::string;
+using std::vector;
+
+// Programs whose sampled selectivity is in this range are compiled branchless,
+// if they have conditions that branchless code doesn't branch on.
+static const double minBranchlessSelectivity = 0.2;
+static const double maxBranchlessSelectivity = 0.8;
+
+TieredFilter::TieredFilter(
+    llvm::orc::KaleidoscopeJIT& jit, const string& prog,
+    uint64_t promoteThreshold, uint64_t profileRows)
+  : jit(jit), prog(prog), promoteThreshold(promoteThreshold),
+    profileRows(profileRows) {}
+
+std::unique_ptr<TieredFilter> TieredFilter::Create(
+    llvm::orc::KaleidoscopeJIT& jit, const string& prog,
+    uint64_t promoteThreshold, uint64_t profileRows) {
+  std::unique_ptr<TieredFilter> f(
+      new TieredFilter(jit, prog, promoteThreshold, profileRows));
+  Lexer lexer(prog);
+  Parser parser(lexer, f->arena);
+  if (!parser.ParseProgram(&f->ast)) {
+    return nullptr;
+  }
+  if (!f->ast.states.empty() || !f->ast.outputs.empty() ||
+      !f->ast.params.empty()) {
+    // The interpreter runs a row at a time; the state, the outputs and the
+    // parameters live in the batches.
+    Diag(diag_error, "programs with state, output or parameter variables "
+        "can't be tiered");
+    return nullptr;
+  }
+  f->interpProg = std::make_unique<InterpProgram>(f->ast);
+  const FunctionAST* mainFn = f->interpProg->getFunction("prog_main");
+  if (mainFn != nullptr && mainFn->getProto().getArgNames().size() == 3) {
+    f->rowSchema = f->interpProg->getOnlySchema();
+    if (f->rowSchema == nullptr) {
+      Diag(diag_error, "a prog_main taking column offsets needs the program "
+          "to declare exactly one schema");
+      return nullptr;
+    }
+  }
+  if (profileRows != 0) {
+    // The compilations parse the same source, and number its sites the same.
+    f->prof = std::make_shared<FilterProfile>(f->ast.profileSites);
+  }
+  return f;
+}
+
+TieredFilter::~TieredFilter() {
+  if (compiler.joinable()) {
+    compiler.join();
+  }
+  if (recompiler.joinable()) {
+    recompiler.join();
+  }
+}
+
+char TieredFilter::Run(const char* k, const char* v) {
+  if (const CompiledFilter* f = native.load(std::memory_order_acquire)) {
+    if (f->profile != nullptr) {
+      countProfiledRows(1);
+    }
+    return f->rowFn(k, v);
+  }
+  countRows(1);
+  Interpreter interp(*interpProg);
+  RtValue res;
+  vector<RtValue> args = {
+    RtValue::BytePtr(const_cast<char*>(k)),
+    RtValue::BytePtr(const_cast<char*>(v)),
+  };
+  // Like the row function the JIT generates for it, fill in the offsets.
+  vector<int32_t> offsets;
+  if (rowSchema != nullptr) {
+    offsets.resize(rowSchema->getColumns().size());
+    char* table = reinterpret_cast<char*>(offsets.data());
+    SchemaIndex(*rowSchema, const_cast<char*>(v), table);
+    args.push_back(RtValue::BytePtr(table));
+  }
+  if (!interp.Call("prog_main", args, &res) || res.type != type_byte) {
+    return 0;
+  }
+  if (res.b != 0) {
+    interpretedMatches++;
+  }
+  return res.b;
+}
+
+uint32_t TieredFilter::RunBatch(
+    const char** keys, const char** vals, uint32_t n, uint8_t* outBitmap) {
+  if (const CompiledFilter* f = native.load(std::memory_order_acquire)) {
+    if (f->profile != nullptr) {
+      countProfiledRows(n);
+    }
+    return f->batchFn(keys, vals, n, outBitmap, nullptr /* state */,
+                      nullptr /* outCols */, nullptr /* params */);
+  }
+  uint32_t matches = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (i % 8 == 0) {
+      outBitmap[i / 8] = 0;
+    }
+    if (Run(keys[i], vals[i]) != 0) {
+      outBitmap[i / 8] |= 1 << (i % 8);
+      matches++;
+    }
+  }
+  return matches;
+}
+
+void TieredFilter::countRows(uint64_t n) {
+  uint64_t rows = interpretedRows.fetch_add(n) + n;
+  if (rows < promoteThreshold || compileStarted.exchange(true)) {
+    return;
+  }
+  compiler = std::thread([this]() { compile(); });
+}
+
+void TieredFilter::compile() {
+  uint64_t rows = interpretedRows.load();
+  double selectivity = rows == 0 ? 0 : double(interpretedMatches.load()) / rows;
+  PredicateMode mode = pred_branching;
+  // The conditions guarding operands or branches that can't be evaluated
+  // regardless of them still branch, so the code returns what the
+  // interpreter does either way.
+  if (ast.numBranchlessConds > 0 &&
+      selectivity >= minBranchlessSelectivity &&
+      selectivity <= maxBranchlessSelectivity) {
+    mode = pred_branchless;
+  }
+  // The program is compiled from its source rather than from ast, which the
+  // interpreter keeps using while the compilation runs.
+  compiled = CompileFilter(
+      jit, prog, mode, nullptr /* paramValues */, compile_whole_program,
+      prof != nullptr ? profile_instrument : profile_none, prof);
+  if (compiled == nullptr) {
+    // Stay in the interpreter.
+    return;
+  }
+  compiledMode.store(mode);
+  native.store(compiled.get(), std::memory_order_release);
+}
+
+void TieredFilter::countProfiledRows(uint64_t n) {
+  uint64_t rows = prof->addRows(n);
+  if (rows < profileRows || recompileStarted.exchange(true)) {
+    return;
+  }
+  recompiler = std::thread([this]() { recompile(); });
+}
+
+void TieredFilter::recompile() {
+  // The rows run since, while the compilation runs, keep being counted; the
+  // compilation reads the counts as they are when it gets to them. Rather
+  // than the whole program, the profile has the conditions it finds
+  // unpredictable tested without branching, where that's safe.
+  recompiled = CompileFilter(
+      jit, prog, pred_branching, nullptr /* paramValues */,
+      compile_whole_program, profile_use, prof);
+  if (recompiled == nullptr) {
+    // Stay in the instrumented code.
+    return;
+  }
+  compiledMode.store(pred_branching);
+  optimized.store(recompiled.get(), std::memory_order_release);
+  native.store(recompiled.get(), std::memory_order_release);
+}
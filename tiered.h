@@ -0,0 +1,114 @@
+#ifndef TIERED_H
+#define TIERED_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "filter_cache.h"
+#include "interp.h"
+#include "parser.h"
+#include "profile.h"
+
+// TieredFilter runs a program in two tiers. Tier 0 is the interpreter, which
+// can start running right away. Once the program has processed
+// promoteThreshold rows, it's compiled by the JIT on a background thread
+// (tier 1); rows that come in after the native code is ready run through it.
+// One-shot queries over a few rows never pay for the compilation.
+//
+// The rows the interpreter ran are a sample of the program's selectivity,
+// which picks how its conditions get compiled: programs matching about half
+// of the rows are compiled branchless (see PredicateMode), if they have
+// conditions that can be tested without branching. Branchless code only
+// evaluates the operands and branches that can't fault or have effects
+// regardless of the conditions guarding them, so that it returns what the
+// interpreter does.
+//
+// For filters running for a long time, tier 1 can be instrumented (see
+// ProfileMode). Once it has run profileRows rows, the program is compiled
+// again on a background thread with the profile (tier 2): its branches are
+// weighted by how often they were taken, and the conditions that turned out
+// to be unpredictable are tested without branching, one by one, where
+// branchless code would test them so (see profile_use).
+//
+// Run and RunBatch can be called concurrently.
+class TieredFilter {
+public:
+  // Create parses prog. Returns nullptr if the program doesn't parse or
+  // declares state, output or parameter variables. The program gets compiled
+  // into jit. Unless profileRows is 0, tier 1 is instrumented, and tier 2
+  // compiled after profileRows rows.
+  static std::unique_ptr<TieredFilter> Create(
+      llvm::orc::KaleidoscopeJIT& jit, const std::string& prog,
+      uint64_t promoteThreshold, uint64_t profileRows = 0);
+  // Waits for the background compilations, if any are running, and releases
+  // the compiled code.
+  ~TieredFilter();
+
+  // Run filters one row, like prog_main. Returns 0 on interpreter errors.
+  char Run(const char* k, const char* v);
+  // RunBatch filters n rows, like prog_main_batch.
+  uint32_t RunBatch(
+      const char** keys, const char** vals, uint32_t n, uint8_t* outBitmap);
+
+  // isCompiled returns true once the native code is used.
+  bool isCompiled() const { return native.load() != nullptr; }
+  // isProfiled returns true once the code compiled with the profile is used.
+  bool isProfiled() const { return optimized.load() != nullptr; }
+  // The mode the program was compiled with, once isCompiled. Tier 2 is
+  // compiled in branching mode, its profile picking the conditions tested
+  // without branching.
+  PredicateMode predicateMode() const { return compiledMode.load(); }
+  // The profile collected by the instrumented tier, or nullptr if it isn't
+  // instrumented. It's complete once isProfiled; until then, it's being
+  // collected.
+  std::shared_ptr<const FilterProfile> profile() const { return prof; }
+
+private:
+  TieredFilter(llvm::orc::KaleidoscopeJIT& jit, const std::string& prog,
+               uint64_t promoteThreshold, uint64_t profileRows);
+
+  // countRows counts rows run by the interpreter and starts the compilation
+  // once there have been enough of them.
+  void countRows(uint64_t n);
+  void compile();
+  // countProfiledRows counts rows run by the instrumented code and starts
+  // the compilation with the profile once there have been enough of them.
+  void countProfiledRows(uint64_t n);
+  void recompile();
+
+  llvm::orc::KaleidoscopeJIT& jit;
+  const std::string prog;
+  const uint64_t promoteThreshold;
+  const uint64_t profileRows;
+  // The interpreted program's AST, allocated in arena.
+  ASTArena arena;
+  ParsedProgram ast;
+  std::unique_ptr<InterpProgram> interpProg;
+  // The schema of the column offsets prog_main takes, if it takes them.
+  const SchemaAST* rowSchema = nullptr;
+
+  std::atomic<uint64_t> interpretedRows{0};
+  // The interpreted rows that matched.
+  std::atomic<uint64_t> interpretedMatches{0};
+  std::atomic<bool> compileStarted{false};
+  std::thread compiler;
+  // Written by the compiler thread; published through native.
+  std::shared_ptr<const CompiledFilter> compiled;
+  std::atomic<PredicateMode> compiledMode{pred_branching};
+  std::atomic<const CompiledFilter*> native{nullptr};
+
+  // The instrumented tier's profile, if there's one.
+  std::shared_ptr<FilterProfile> prof;
+  std::atomic<bool> recompileStarted{false};
+  std::thread recompiler;
+  // Written by the recompiler thread; published through optimized, and then
+  // native. The instrumented code stays around, in compiled, for the threads
+  // that are still running it.
+  std::shared_ptr<const CompiledFilter> recompiled;
+  std::atomic<const CompiledFilter*> optimized{nullptr};
+};
+
+#endif